@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ANALYZE_MAX_CHUNKINGS 16
+#define ANALYZE_MIN_AVERAGE 256
+
+struct sampled_chunk {
+    unsigned char hash[HASH_LEN];
+    size_t len;
+};
+
+struct chunking {
+    pthread_t thread;
+    int cdc;
+    size_t size, min, max;
+    uint64_t mask;
+    unsigned long sample;
+
+    const unsigned char *data;
+    size_t datalen;
+
+    struct hash_state state;
+    size_t len;
+    uint64_t fingerprint;
+
+    uintmax_t chunks;
+    struct sampled_chunk *sampled;
+    size_t nsampled, alloc;
+};
+
+static uint64_t gear[256];
+
+static void chunking_init(struct chunking *chunking, int cdc, size_t size, unsigned long sample)
+{
+    memset(chunking, 0, sizeof(*chunking));
+    chunking->cdc = cdc;
+    chunking->size = size;
+    chunking->sample = sample;
+
+    /*
+     * Content-defined chunks are cut at the first position after the
+     * minimum length where the top bits of a gear hash over the last
+     * 64 bytes are zero, resulting in the given average length.
+     */
+    if (cdc) {
+        unsigned bits = 0;
+
+        chunking->min = size / 4;
+        chunking->max = size * 4;
+        while (((size_t) 2 << bits) <= size - chunking->min)
+            bits++;
+        chunking->mask = ~(uint64_t) 0 << (64 - bits);
+    }
+
+    if (hash_state_init(&chunking->state) < 0)
+        die("Unable to initialize hashing state");
+}
+
+/*
+ * Only a deterministic subset of chunks is remembered, selected by
+ * their hash. As identical chunks are selected alike, the number of
+ * unique bytes can be estimated from the sample.
+ */
+static void finish_chunk(struct chunking *chunking)
+{
+    struct sampled_chunk *chunk;
+    struct hash hash;
+    uint32_t selector;
+
+    if (hash_state_final(&hash, &chunking->state) < 0 ||
+            hash_state_init(&chunking->state) < 0)
+        die("Unable to hash chunk");
+
+    selector = ((uint32_t) hash.bin[0] << 24) | ((uint32_t) hash.bin[1] << 16) |
+        ((uint32_t) hash.bin[2] << 8) | (uint32_t) hash.bin[3];
+
+    if (selector % chunking->sample == 0) {
+        if (chunking->nsampled == chunking->alloc) {
+            chunking->alloc = chunking->alloc ? chunking->alloc * 2 : 1024;
+            if ((chunk = realloc(chunking->sampled, chunking->alloc * sizeof(*chunk))) == NULL)
+                die_errno("Unable to allocate chunks");
+            chunking->sampled = chunk;
+        }
+
+        chunk = &chunking->sampled[chunking->nsampled++];
+        memcpy(chunk->hash, hash.bin, HASH_LEN);
+        chunk->len = chunking->len;
+    }
+
+    chunking->chunks++;
+    chunking->len = 0;
+    chunking->fingerprint = 0;
+}
+
+/*
+ * Return the number of bytes of the given data which belong to the
+ * current chunk and whether the chunk ends after them.
+ */
+static size_t next_boundary(int *cut, struct chunking *chunking, const unsigned char *data, size_t len)
+{
+    size_t i = 0;
+
+    *cut = 0;
+
+    if (!chunking->cdc) {
+        if (chunking->size - chunking->len > len)
+            return len;
+        *cut = 1;
+        return chunking->size - chunking->len;
+    }
+
+    if (chunking->len < chunking->min)
+        i = chunking->min - chunking->len < len ? chunking->min - chunking->len : len;
+
+    for (; i < len; i++) {
+        chunking->fingerprint = (chunking->fingerprint << 1) + gear[data[i]];
+        if (!(chunking->fingerprint & chunking->mask) || chunking->len + i + 1 >= chunking->max) {
+            *cut = 1;
+            return i + 1;
+        }
+    }
+
+    return len;
+}
+
+static void *process_data(void *payload)
+{
+    struct chunking *chunking = payload;
+    const unsigned char *data = chunking->data;
+    size_t len = chunking->datalen;
+
+    while (len) {
+        int cut;
+        size_t n = next_boundary(&cut, chunking, data, len);
+
+        if (hash_state_update(&chunking->state, data, n) < 0)
+            die("Unable to update hash");
+        chunking->len += n;
+        data += n;
+        len -= n;
+
+        if (cut)
+            finish_chunk(chunking);
+    }
+
+    return NULL;
+}
+
+static int sampled_chunk_cmp(const void *a, const void *b)
+{
+    const struct sampled_chunk *x = a, *y = b;
+    return memcmp(x->hash, y->hash, HASH_LEN);
+}
+
+static void report(struct chunking *chunking, uintmax_t total, struct store *store)
+{
+    uintmax_t unique = 0, missing = 0;
+    char digits[32];
+    size_t i;
+
+    qsort(chunking->sampled, chunking->nsampled, sizeof(*chunking->sampled), sampled_chunk_cmp);
+
+    for (i = 0; i < chunking->nsampled; i++) {
+        const struct sampled_chunk *chunk = &chunking->sampled[i];
+        struct hash hash;
+        struct stat st;
+
+        if (i && !memcmp(chunk->hash, chunking->sampled[i - 1].hash, HASH_LEN))
+            continue;
+        unique += chunk->len;
+
+        if (!store)
+            continue;
+        if (hash_from_bin(&hash, chunk->hash, HASH_LEN) < 0)
+            die("Unable to encode hash");
+        if (store_stat(&st, store, &hash) < 0) {
+            if (errno != ENOENT && errno != ENOTDIR)
+                die_errno("Unable to stat block '%s'", hash.hex);
+            missing += chunk->len;
+        } else if ((size_t) st.st_size != chunk->len) {
+            missing += chunk->len;
+        }
+    }
+
+    unique *= chunking->sample;
+    missing *= chunking->sample;
+
+    /* Every chunk takes one line, followed by the trailer. */
+    snprintf(digits, sizeof(digits), "%"PRIuMAX, total);
+
+    printf("%s %lu %"PRIuMAX" %"PRIuMAX" %.2f %"PRIuMAX,
+            chunking->cdc ? "cdc" : "fixed", (unsigned long) chunking->size,
+            chunking->chunks, unique, unique ? (double) total / (double) unique : 1.0,
+            chunking->chunks * (HASH_LEN * 2 + 1) + HASH_LEN * 2 + strlen(digits) + 3);
+
+    if (!store)
+        printf("\n");
+    else if (!chunking->cdc && chunking->size == BLOCK_LEN)
+        printf(" %"PRIuMAX"\n", missing);
+    else
+        printf(" -\n");
+}
+
+int gob_analyze(int argc, const char *argv[])
+{
+    struct chunking chunkings[ANALYZE_MAX_CHUNKINGS];
+    unsigned char *buf[2];
+    struct store store;
+    const char *storepath = NULL;
+    size_t j, nchunkings = 0;
+    unsigned long sample = 1;
+    uintmax_t total = 0;
+    ssize_t bytes;
+    int i, error, current = 0;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if ((!strcmp(argv[i], "--fixed") || !strcmp(argv[i], "--cdc")) && i + 1 < argc) {
+            int cdc = !strcmp(argv[i], "--cdc");
+            size_t size;
+
+            if (parse_size(&size, argv[++i]) < 0 || !size || (cdc && size < ANALYZE_MIN_AVERAGE) ||
+                    size > SIZE_MAX / 4)
+                die("Invalid chunk size '%s'", argv[i]);
+            if (nchunkings == ANALYZE_MAX_CHUNKINGS)
+                die("Too many chunkings");
+            chunkings[nchunkings++].size = size;
+            chunkings[nchunkings - 1].cdc = cdc;
+        } else if (!strcmp(argv[i], "--sample") && i + 1 < argc)
+            sample = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--store") && i + 1 < argc)
+            storepath = argv[++i];
+        else
+            die("Unknown option '%s'", argv[i]);
+    }
+
+    if (argc != i || !sample)
+        die("USAGE: %s analyze [--fixed <SIZE>]... [--cdc <SIZE>]... [--sample <N>] [--store <DIR>]", argv[0]);
+
+    atexit(close_stdout);
+
+    if (!nchunkings) {
+        static const size_t defaults[] = { 64 * 1024, 256 * 1024, 1024 * 1024, BLOCK_LEN };
+
+        for (j = 0; j < sizeof(defaults) / sizeof(*defaults); j++) {
+            chunkings[nchunkings].cdc = 0;
+            chunkings[nchunkings++].size = defaults[j];
+        }
+        for (j = 0; j < sizeof(defaults) / sizeof(*defaults); j++) {
+            chunkings[nchunkings].cdc = 1;
+            chunkings[nchunkings++].size = defaults[j];
+        }
+    }
+
+    gear_init(gear);
+    for (j = 0; j < nchunkings; j++)
+        chunking_init(&chunkings[j], chunkings[j].cdc, chunkings[j].size, sample);
+
+    if ((buf[0] = malloc(BLOCK_LEN)) == NULL || (buf[1] = malloc(BLOCK_LEN)) == NULL)
+        die_errno("Unable to allocate buffers");
+
+    /*
+     * Every chunking is simulated by its own thread, while the next
+     * part of the input is read into the other buffer.
+     */
+    bytes = read_bytes(STDIN_FILENO, buf[current], BLOCK_LEN);
+    while (bytes > 0) {
+        for (j = 0; j < nchunkings; j++) {
+            chunkings[j].data = buf[current];
+            chunkings[j].datalen = (size_t) bytes;
+            if ((error = pthread_create(&chunkings[j].thread, NULL, process_data, &chunkings[j])) != 0) {
+                errno = error;
+                die_errno("Unable to create thread");
+            }
+        }
+
+        total += (uintmax_t) bytes;
+        current = !current;
+        bytes = read_bytes(STDIN_FILENO, buf[current], BLOCK_LEN);
+
+        for (j = 0; j < nchunkings; j++) {
+            if ((error = pthread_join(chunkings[j].thread, NULL)) != 0) {
+                errno = error;
+                die_errno("Unable to join thread");
+            }
+        }
+    }
+
+    if (bytes < 0)
+        die_errno("Unable to read input");
+
+    if (storepath && store_open(&store, storepath) < 0)
+        die("Unable to open store");
+
+    printf("chunking size chunks unique-bytes dedup-ratio index-bytes%s\n", storepath ? " new-bytes" : "");
+
+    for (j = 0; j < nchunkings; j++) {
+        if (chunkings[j].len)
+            finish_chunk(&chunkings[j]);
+        report(&chunkings[j], total, storepath ? &store : NULL);
+        free(chunkings[j].sampled);
+    }
+
+    if (storepath && store_close(&store) < 0)
+        die("Unable to close store");
+
+    free(buf[0]);
+    free(buf[1]);
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+struct block_cache_entry {
+    struct hash hash;
+    unsigned char *data;
+    size_t len;
+    struct block_cache_entry *prev, *next;
+    struct block_cache_entry *chain;
+};
+
+static size_t bucket_of(const struct block_cache *cache, const struct hash *hash)
+{
+    size_t bucket = ((size_t) hash->bin[0] << 24) | ((size_t) hash->bin[1] << 16) |
+        ((size_t) hash->bin[2] << 8) | (size_t) hash->bin[3];
+    return bucket & (cache->nbuckets - 1);
+}
+
+int block_cache_init(struct block_cache *cache, size_t budget)
+{
+    size_t nbuckets = 16;
+
+    while (nbuckets < budget / BLOCK_LEN * 2)
+        nbuckets *= 2;
+
+    memset(cache, 0, sizeof(*cache));
+    if ((cache->buckets = calloc(nbuckets, sizeof(*cache->buckets))) == NULL)
+        return -1;
+    cache->nbuckets = nbuckets;
+    cache->budget = budget;
+
+    return 0;
+}
+
+static void unlink_lru(struct block_cache *cache, struct block_cache_entry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+}
+
+static void push_lru(struct block_cache *cache, struct block_cache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+    cache->head = entry;
+}
+
+static void evict(struct block_cache *cache, struct block_cache_entry *entry)
+{
+    struct block_cache_entry **p = &cache->buckets[bucket_of(cache, &entry->hash)];
+
+    while (*p != entry)
+        p = &(*p)->chain;
+    *p = entry->chain;
+
+    unlink_lru(cache, entry);
+    cache->used -= entry->len;
+    free(entry->data);
+    free(entry);
+}
+
+void block_cache_free(struct block_cache *cache)
+{
+    while (cache->tail)
+        evict(cache, cache->tail);
+    free(cache->buckets);
+}
+
+const unsigned char *block_cache_get(struct block_cache *cache, const struct hash *hash, size_t *len)
+{
+    struct block_cache_entry *entry;
+
+    for (entry = cache->buckets[bucket_of(cache, hash)]; entry; entry = entry->chain) {
+        if (!hash_eq(&entry->hash, hash))
+            continue;
+
+        unlink_lru(cache, entry);
+        push_lru(cache, entry);
+        cache->hits++;
+
+        *len = entry->len;
+        return entry->data;
+    }
+
+    cache->misses++;
+    return NULL;
+}
+
+void block_cache_put(struct block_cache *cache, const struct hash *hash, const unsigned char *data, size_t len)
+{
+    struct block_cache_entry *entry;
+    size_t bucket;
+
+    if (len > cache->budget)
+        return;
+
+    while (cache->tail && cache->used + len > cache->budget)
+        evict(cache, cache->tail);
+
+    /* The cache is an optimization only, so silently skip blocks we cannot allocate. */
+    if ((entry = malloc(sizeof(*entry))) == NULL)
+        return;
+    if ((entry->data = malloc(len ? len : 1)) == NULL) {
+        free(entry);
+        return;
+    }
+
+    memcpy(&entry->hash, hash, sizeof(*hash));
+    memcpy(entry->data, data, len);
+    entry->len = len;
+
+    bucket = bucket_of(cache, hash);
+    entry->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+
+    push_lru(cache, entry);
+    cache->used += len;
+}
+
+ssize_t block_cache_read(unsigned char *out, size_t outlen, struct block_cache *cache,
+        struct store *store, const struct hash *hash)
+{
+    const unsigned char *data;
+    ssize_t len;
+    size_t cached;
+
+    if ((data = block_cache_get(cache, hash, &cached)) != NULL) {
+        if (cached > outlen)
+            return -1;
+        memcpy(out, data, cached);
+        return (ssize_t) cached;
+    }
+
+    if ((len = store_read(out, outlen, store, hash)) < 0)
+        return -1;
+
+    block_cache_put(cache, hash, out, (size_t) len);
+
+    return len;
+}
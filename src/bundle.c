@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+
+/*
+ * A bundle is a single sequential stream with the following layout, all
+ * integers being encoded in big endian:
+ *
+ *   header:  "GOBBNDL\0" | u32 version | u32 hash length | u64 block count
+ *   blocks:  hash | u32 length | data                (repeated)
+ *   toc:     "GOBTOC\0\0" | (hash | u64 offset | u32 length) (repeated)
+ *   footer:  u64 toc offset | "GOBBEND\0"
+ *
+ * Offsets point to the start of a block's hash relative to the start
+ * of the bundle. The table of contents is written last so that bundles
+ * can be streamed to non-seekable targets, while the footer allows
+ * seekable readers to locate it without scanning all blocks.
+ */
+#define BUNDLE_VERSION 1
+#define BUNDLE_MAGIC "GOBBNDL"
+#define BUNDLE_TOC_MAGIC "GOBTOC\0"
+#define BUNDLE_END_MAGIC "GOBBEND"
+#define BUNDLE_MAGIC_LEN 8
+#define BUNDLE_IO_BUFFER (1024 * 1024)
+
+struct bundle_entry {
+    struct hash hash;
+    uint64_t offset;
+    uint32_t length;
+    size_t seq;
+};
+
+static void put_be32(unsigned char *out, uint32_t value)
+{
+    out[0] = (unsigned char) (value >> 24);
+    out[1] = (unsigned char) (value >> 16);
+    out[2] = (unsigned char) (value >> 8);
+    out[3] = (unsigned char) value;
+}
+
+static void put_be64(unsigned char *out, uint64_t value)
+{
+    put_be32(out, (uint32_t) (value >> 32));
+    put_be32(out + 4, (uint32_t) value);
+}
+
+static uint32_t get_be32(const unsigned char *in)
+{
+    return ((uint32_t) in[0] << 24) | ((uint32_t) in[1] << 16) |
+        ((uint32_t) in[2] << 8) | (uint32_t) in[3];
+}
+
+static uint64_t get_be64(const unsigned char *in)
+{
+    return ((uint64_t) get_be32(in) << 32) | get_be32(in + 4);
+}
+
+static int entry_cmp_hash(const void *a, const void *b)
+{
+    const struct bundle_entry *x = a, *y = b;
+    int cmp = memcmp(x->hash.bin, y->hash.bin, sizeof(x->hash.bin));
+    if (cmp)
+        return cmp;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int entry_cmp_seq(const void *a, const void *b)
+{
+    const struct bundle_entry *x = a, *y = b;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void read_index(struct bundle_entry **entries, size_t *nentries,
+        size_t *alloc, const char *path)
+{
+    char *line = NULL;
+    size_t n = 0;
+    ssize_t linelen;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL)
+        die_errno("Unable to open index '%s'", path);
+
+    while ((linelen = getline(&line, &n, f)) > 0) {
+        struct bundle_entry *entry;
+
+        if (*line == '>')
+            break;
+
+        if (line[linelen - 1] == '\n')
+            line[--linelen] = '\0';
+
+        if (*nentries == *alloc) {
+            *alloc = *alloc ? *alloc * 2 : 1024;
+            if ((*entries = realloc(*entries, *alloc * sizeof(**entries))) == NULL)
+                die_errno("Unable to allocate bundle entries");
+        }
+
+        entry = &(*entries)[*nentries];
+        if (hash_from_str(&entry->hash, line, (size_t) linelen) < 0)
+            die("Invalid index hash '%s' in '%s'", line, path);
+        entry->seq = (*nentries)++;
+    }
+
+    if (linelen < 0 && !feof(f))
+        die_errno("Unable to read index '%s'", path);
+    if (linelen <= 0 || *line != '>')
+        die("Index '%s' has no trailer", path);
+
+    free(line);
+    fclose(f);
+}
+
+static void write_all(const void *data, size_t len)
+{
+    if (len && fwrite(data, len, 1, stdout) != 1)
+        die_errno("Unable to write bundle");
+}
+
+static int bundle_create(int argc, const char *argv[])
+{
+    struct bundle_entry *entries = NULL;
+    size_t i, n, nentries = 0, alloc = 0;
+    unsigned char hdr[BUNDLE_MAGIC_LEN + 16], *block;
+    struct store store;
+    uint64_t offset;
+
+    if (argc < 3)
+        die("USAGE: %s bundle create <DIR> <INDEX>...", argv[0]);
+
+    atexit(close_stdout);
+
+    if (setvbuf(stdout, NULL, _IOFBF, BUNDLE_IO_BUFFER) != 0)
+        die("Unable to set up output buffer");
+
+    for (i = 2; i < (size_t) argc; i++)
+        read_index(&entries, &nentries, &alloc, argv[i]);
+
+    /*
+     * Deduplicate blocks referenced by all indices while retaining the
+     * order in which they were first referenced, which is the order a
+     * subsequent restore will want to read them in.
+     */
+    qsort(entries, nentries, sizeof(*entries), entry_cmp_hash);
+    for (i = 0, n = 0; i < nentries; i++) {
+        if (n && hash_eq(&entries[n - 1].hash, &entries[i].hash))
+            continue;
+        entries[n++] = entries[i];
+    }
+    nentries = n;
+    qsort(entries, nentries, sizeof(*entries), entry_cmp_seq);
+
+    if (store_open(&store, argv[1]) < 0)
+        die("Unable to open store");
+
+    if ((block = malloc(BLOCK_LEN)) == NULL)
+        die_errno("Unable to allocate block");
+
+    memcpy(hdr, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN);
+    put_be32(hdr + BUNDLE_MAGIC_LEN, BUNDLE_VERSION);
+    put_be32(hdr + BUNDLE_MAGIC_LEN + 4, HASH_LEN);
+    put_be64(hdr + BUNDLE_MAGIC_LEN + 8, nentries);
+    write_all(hdr, sizeof(hdr));
+    offset = sizeof(hdr);
+
+    for (i = 0; i < nentries; i++) {
+        unsigned char len[4];
+        ssize_t blocklen;
+
+        if ((blocklen = store_read(block, BLOCK_LEN, &store, &entries[i].hash)) < 0)
+            die_errno("Unable to read block '%s'", entries[i].hash.hex);
+
+        entries[i].offset = offset;
+        entries[i].length = (uint32_t) blocklen;
+
+        put_be32(len, (uint32_t) blocklen);
+        write_all(entries[i].hash.bin, HASH_LEN);
+        write_all(len, sizeof(len));
+        write_all(block, (size_t) blocklen);
+
+        offset += HASH_LEN + sizeof(len) + (uint64_t) blocklen;
+    }
+
+    write_all(BUNDLE_TOC_MAGIC, BUNDLE_MAGIC_LEN);
+    for (i = 0; i < nentries; i++) {
+        unsigned char toc[HASH_LEN + 12];
+        memcpy(toc, entries[i].hash.bin, HASH_LEN);
+        put_be64(toc + HASH_LEN, entries[i].offset);
+        put_be32(toc + HASH_LEN + 8, entries[i].length);
+        write_all(toc, sizeof(toc));
+    }
+
+    put_be64(hdr, offset);
+    memcpy(hdr + 8, BUNDLE_END_MAGIC, BUNDLE_MAGIC_LEN);
+    write_all(hdr, 8 + BUNDLE_MAGIC_LEN);
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    free(entries);
+    free(block);
+
+    return 0;
+}
+
+static void read_all(void *data, size_t len)
+{
+    if (len && fread(data, len, 1, stdin) != 1) {
+        if (feof(stdin))
+            die("Unexpected end of bundle");
+        die_errno("Unable to read bundle");
+    }
+}
+
+static int bundle_import(int argc, const char *argv[])
+{
+    struct bundle_entry *entries;
+    unsigned char hdr[BUNDLE_MAGIC_LEN + 16], *block;
+    struct store store;
+    uint64_t i, nentries, offset;
+
+    if (argc != 2)
+        die("USAGE: %s bundle import <DIR>", argv[0]);
+
+    atexit(close_stdout);
+
+    if (setvbuf(stdin, NULL, _IOFBF, BUNDLE_IO_BUFFER) != 0)
+        die("Unable to set up input buffer");
+
+    read_all(hdr, sizeof(hdr));
+    if (memcmp(hdr, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN))
+        die("Input is not a bundle");
+    if (get_be32(hdr + BUNDLE_MAGIC_LEN) != BUNDLE_VERSION)
+        die("Unsupported bundle version %"PRIu32, get_be32(hdr + BUNDLE_MAGIC_LEN));
+    if (get_be32(hdr + BUNDLE_MAGIC_LEN + 4) != HASH_LEN)
+        die("Bundle hash length does not match");
+    nentries = get_be64(hdr + BUNDLE_MAGIC_LEN + 8);
+    offset = sizeof(hdr);
+
+    if (nentries > SIZE_MAX / sizeof(*entries) ||
+            (entries = malloc((size_t) nentries * sizeof(*entries) + 1)) == NULL)
+        die_errno("Unable to allocate bundle entries");
+    if ((block = malloc(BLOCK_LEN)) == NULL)
+        die_errno("Unable to allocate block");
+
+    if (store_open(&store, argv[1]) < 0)
+        die("Unable to open store");
+
+    for (i = 0; i < nentries; i++) {
+        unsigned char bin[HASH_LEN], len[4];
+        struct hash expected;
+        uint32_t blocklen;
+
+        read_all(bin, sizeof(bin));
+        read_all(len, sizeof(len));
+        if ((blocklen = get_be32(len)) > BLOCK_LEN)
+            die("Bundle block exceeds maximum block length");
+        read_all(block, blocklen);
+
+        if (hash_from_bin(&expected, bin, sizeof(bin)) < 0)
+            die("Unable to decode bundle block hash");
+        if (hash_compute(&entries[i].hash, block, blocklen) < 0)
+            die("Unable to hash bundle block '%s'", expected.hex);
+        if (!hash_eq(&entries[i].hash, &expected))
+            die("Hash mismatch for bundle block '%s'", expected.hex);
+        if (store_put(&store, &expected, block, blocklen, -1, 0) < 0)
+            die("Unable to store block '%s'", expected.hex);
+
+        entries[i].offset = offset;
+        entries[i].length = blocklen;
+        offset += sizeof(bin) + sizeof(len) + blocklen;
+    }
+
+    read_all(hdr, BUNDLE_MAGIC_LEN);
+    if (memcmp(hdr, BUNDLE_TOC_MAGIC, BUNDLE_MAGIC_LEN))
+        die("Bundle has no table of contents");
+
+    for (i = 0; i < nentries; i++) {
+        unsigned char toc[HASH_LEN + 12];
+
+        read_all(toc, sizeof(toc));
+        if (memcmp(toc, entries[i].hash.bin, HASH_LEN) ||
+                get_be64(toc + HASH_LEN) != entries[i].offset ||
+                get_be32(toc + HASH_LEN + 8) != entries[i].length)
+            die("Bundle table of contents does not match block '%s'", entries[i].hash.hex);
+    }
+
+    read_all(hdr, 8 + BUNDLE_MAGIC_LEN);
+    if (get_be64(hdr) != offset || memcmp(hdr + 8, BUNDLE_END_MAGIC, BUNDLE_MAGIC_LEN))
+        die("Bundle has an invalid footer");
+    if (getc(stdin) != EOF)
+        die("Trailing garbage after bundle");
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    free(entries);
+    free(block);
+
+    return 0;
+}
+
+int gob_bundle(int argc, const char *argv[])
+{
+    if (argc >= 2 && !strcmp(argv[1], "create")) {
+        memmove(argv + 1, argv + 2, sizeof(char *) * (unsigned) argc - 2);
+        return bundle_create(argc - 1, argv);
+    } else if (argc >= 2 && !strcmp(argv[1], "import")) {
+        memmove(argv + 1, argv + 2, sizeof(char *) * (unsigned) argc - 2);
+        return bundle_import(argc - 1, argv);
+    }
+
+    die("USAGE: %s bundle (create <DIR> <INDEX>...|import <DIR>)", argv[0]);
+}
@@ -18,9 +18,52 @@
 #include "common.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
+struct target_slot {
+    unsigned char *block;
+    size_t len;
+    int written;
+    int done;
+    const char *error;
+    int error_errno;
+};
+
+/*
+ * Blocks of the target are compared and restored by multiple workers.
+ * Workers claim blocks in order and put them into a window of slots,
+ * which are consumed in order again to compute the overall hash and
+ * to record checkpoints.
+ */
+struct target_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    const struct hash *hashes;
+    size_t nhashes, len;
+    size_t next, consumed;
+    struct target_slot *slots;
+    size_t nslots;
+};
+
+struct target_worker {
+    pthread_t thread;
+    struct store store;
+    struct target_queue *queue;
+};
+
+struct ordered_job {
+    pthread_t thread;
+    struct store store;
+    unsigned char *block;
+    const struct restore_plan *plan;
+    size_t first, stride;
+    int fd;
+    off_t base;
+};
+
 static int parse_trailer(struct hash *hash_out, size_t *datalen_out, const char *trailer)
 {
     if (*trailer != '>')
@@ -44,56 +87,624 @@ static int parse_trailer(struct hash *hash_out, size_t *datalen_out, const char
     return 0;
 }
 
+static void read_index(struct hash **hashes, size_t *nhashes, struct hash *hash_out, size_t *datalen_out)
+{
+    struct index_reader index;
+    size_t linelen, alloc = 0;
+    char *line;
+    int err;
+
+    if (index_reader_init(&index, STDIN_FILENO) < 0)
+        die_errno("Unable to allocate index buffer");
+
+    while ((err = index_reader_line(&index, &line, &linelen)) > 0) {
+        if (*line == '>')
+            break;
+
+        if (*nhashes == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            if ((*hashes = realloc(*hashes, alloc * sizeof(**hashes))) == NULL)
+                die_errno("Unable to allocate index");
+        }
+
+        if (hash_from_str(&(*hashes)[*nhashes], line, linelen) < 0)
+            die("Invalid index hash '%s'", line);
+        (*nhashes)++;
+    }
+
+    if (err < 0)
+        die_errno("Unable to read index");
+
+    if (err == 0 || (parse_trailer(hash_out, datalen_out, line)) < 0)
+        die("Unable to read index");
+
+    index_reader_free(&index);
+}
+
+/*
+ * Restore a single block of the target unless it matches already.
+ * Errors are recorded in the slot rather than raised here, so that
+ * they are reported in index order after all preceding blocks have
+ * been covered by a checkpoint.
+ */
+static void restore_target_block(struct target_slot *slot, int fd, struct store *store,
+        const struct hash *expected, off_t offset)
+{
+    struct timespec start;
+    struct hash hash;
+    ssize_t bytes;
+
+    slot->written = 0;
+    slot->error = NULL;
+    slot->error_errno = 0;
+
+    if ((bytes = pread_bytes(fd, slot->block, slot->len, offset)) < 0) {
+        slot->error = "Unable to read target block '%s'";
+        slot->error_errno = errno;
+        return;
+    }
+
+    if ((size_t) bytes == slot->len) {
+        if (hash_compute(&hash, slot->block, slot->len) < 0) {
+            slot->error = "Unable to hash target block '%s'";
+            return;
+        }
+        if (hash_eq(&hash, expected))
+            return;
+    }
+
+    if ((bytes = store_read(slot->block, BLOCK_LEN, store, expected)) < 0) {
+        slot->error = "Unable to open block '%s'";
+        slot->error_errno = errno;
+        return;
+    }
+    if ((size_t) bytes != slot->len) {
+        slot->error = "Size mismatch for block '%s'";
+        return;
+    }
+
+    /* Corrupt blocks must not overwrite the target. */
+    if (hash_compute(&hash, slot->block, slot->len) < 0 || !hash_eq(&hash, expected)) {
+        slot->error = "Hash mismatch for block '%s'";
+        return;
+    }
+
+    trace_start(&start);
+    if (pwrite_bytes(fd, slot->block, slot->len, offset) < 0) {
+        slot->error = "Unable to write block '%s'";
+        slot->error_errno = errno;
+        return;
+    }
+    trace_span("output-write", expected, &start);
+    metrics_add(METRIC_OUTPUT_BYTES, slot->len);
+    slot->written = 1;
+}
+
+static void *restore_target_blocks(void *payload)
+{
+    struct target_worker *worker = payload;
+    struct target_queue *queue = worker->queue;
+    struct target_slot *slot;
+    size_t i;
+
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->next < queue->nhashes && queue->next >= queue->consumed + queue->nslots)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        if (queue->next == queue->nhashes) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        i = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        slot = &queue->slots[i % queue->nslots];
+        slot->len = queue->len - i * BLOCK_LEN;
+        if (slot->len > BLOCK_LEN)
+            slot->len = BLOCK_LEN;
+
+        restore_target_block(slot, queue->fd, &worker->store, &queue->hashes[i], (off_t) i * BLOCK_LEN);
+
+        pthread_mutex_lock(&queue->lock);
+        slot->done = 1;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Restore onto an existing target by comparing each of its blocks
+ * with the index and only writing those blocks which differ. Blocks
+ * are processed by long-lived workers, and the resulting target
+ * contents are fed into the overall hash in index order.
+ */
+static int cat_target(const char *storepath, const char *target, size_t njobs, int verbose,
+        struct checkpoint *checkpoint)
+{
+    struct target_queue queue;
+    struct target_worker *workers;
+    struct hash_state state;
+    struct hash expected_hash, computed_hash, *hashes = NULL;
+    size_t i, nhashes = 0, written = 0, expected_len;
+    struct stat st;
+    int fd, error;
+
+    read_index(&hashes, &nhashes, &expected_hash, &expected_len);
+
+    if ((expected_len + BLOCK_LEN - 1) / BLOCK_LEN != nhashes)
+        die("Size mismatch");
+
+    if ((fd = open(target, O_RDWR|O_CREAT, 0666)) < 0)
+        die_errno("Unable to open target '%s'", target);
+
+    if (hash_state_init(&state) < 0)
+        die("Unable to initialize hashing state");
+
+    i = 0;
+    if (checkpoint) {
+        if (checkpoint->blocks > nhashes)
+            die("Checkpoint does not match index");
+        state = checkpoint->state;
+        i = (size_t) checkpoint->blocks;
+    }
+
+    memset(&queue, 0, sizeof(queue));
+    queue.fd = fd;
+    queue.hashes = hashes;
+    queue.nhashes = nhashes;
+    queue.len = expected_len;
+    queue.next = queue.consumed = i;
+
+    if ((error = pthread_mutex_init(&queue.lock, NULL)) != 0 ||
+            (error = pthread_cond_init(&queue.cond, NULL)) != 0) {
+        errno = error;
+        die_errno("Unable to initialize workers");
+    }
+
+    queue.nslots = njobs * 2;
+    if ((queue.slots = calloc(queue.nslots, sizeof(*queue.slots))) == NULL ||
+            (workers = calloc(njobs, sizeof(*workers))) == NULL)
+        die_errno("Unable to allocate jobs");
+    for (i = 0; i < queue.nslots; i++)
+        if ((queue.slots[i].block = malloc(BLOCK_LEN)) == NULL)
+            die_errno("Unable to allocate block");
+
+    for (i = 0; i < njobs; i++) {
+        if (store_open(&workers[i].store, storepath) < 0)
+            die("Unable to open store");
+        workers[i].queue = &queue;
+
+        if ((error = pthread_create(&workers[i].thread, NULL, restore_target_blocks, &workers[i])) != 0) {
+            errno = error;
+            die_errno("Unable to create thread");
+        }
+    }
+
+    for (i = queue.consumed; i < nhashes; i++) {
+        struct target_slot *slot = &queue.slots[i % queue.nslots];
+
+        pthread_mutex_lock(&queue.lock);
+        while (!slot->done)
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        pthread_mutex_unlock(&queue.lock);
+
+        if (slot->error) {
+            errno = slot->error_errno;
+            if (slot->error_errno)
+                die_errno(slot->error, hashes[i].hex);
+            die(slot->error, hashes[i].hex);
+        }
+
+        if (hash_state_update(&state, slot->block, slot->len) < 0)
+            die("Unable to update hash");
+        written += (size_t) slot->written;
+
+        pthread_mutex_lock(&queue.lock);
+        slot->done = 0;
+        queue.consumed++;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+
+        /*
+         * All blocks up to this one have been written, while blocks
+         * after it which have been restored already are compared
+         * again when resuming.
+         */
+        if (checkpoint && (i + 1) % checkpoint->interval == 0 && i + 1 < nhashes) {
+            if (fsync(fd) < 0)
+                die_errno("Unable to sync target '%s'", target);
+            if (checkpoint_write(checkpoint, i + 1, (uintmax_t) (i + 1) * BLOCK_LEN, &state) < 0)
+                die_errno("Unable to write checkpoint '%s'", checkpoint->path);
+        }
+    }
+
+    for (i = 0; i < njobs; i++) {
+        if ((error = pthread_join(workers[i].thread, NULL)) != 0) {
+            errno = error;
+            die_errno("Unable to join thread");
+        }
+        if (store_close(&workers[i].store) < 0)
+            die("Unable to close store");
+    }
+
+    if (hash_state_final(&computed_hash, &state) < 0)
+        die("Unable to finalize hash");
+
+    if (!hash_eq(&computed_hash, &expected_hash))
+        die("Hash mismatch");
+
+    if (fstat(fd, &st) < 0)
+        die_errno("Unable to stat target '%s'", target);
+    if (S_ISREG(st.st_mode) && (size_t) st.st_size > expected_len &&
+            ftruncate(fd, (off_t) expected_len) < 0)
+        die_errno("Unable to truncate target '%s'", target);
+
+    if (try_close(fd) < 0)
+        die_errno("Unable to close target '%s'", target);
+
+    if (verbose)
+        fprintf(stderr, "%lu of %lu blocks written\n",
+                (unsigned long) written, (unsigned long) nhashes);
+
+    for (i = 0; i < queue.nslots; i++)
+        free(queue.slots[i].block);
+    free(queue.slots);
+    free(workers);
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.lock);
+    free(hashes);
+
+    return 0;
+}
+
+static void *restore_ordered_blocks(void *payload)
+{
+    struct ordered_job *job = payload;
+    struct timespec start;
+    size_t i, j;
+
+    for (i = job->first; i < job->plan->nblocks; i += job->stride) {
+        const struct plan_block *block = &job->plan->blocks[i];
+        struct hash hash;
+        ssize_t bytes;
+
+        if ((bytes = store_read(job->block, BLOCK_LEN, &job->store, block->hash)) < 0)
+            die_errno("Unable to read block '%s'", block->hash->hex);
+        if ((size_t) bytes != block->len)
+            die("Size mismatch for block '%s'", block->hash->hex);
+
+        if (hash_compute(&hash, job->block, (size_t) bytes) < 0)
+            die("Unable to hash block '%s'", block->hash->hex);
+        if (!hash_eq(&hash, block->hash))
+            die("Hash mismatch for block '%s'", block->hash->hex);
+
+        for (j = block->first; j < block->first + block->nrefs; j++) {
+            const struct plan_ref *ref = &job->plan->refs[j];
+
+            if (ref->len != block->len)
+                die("Size mismatch for block '%s'", block->hash->hex);
+            trace_start(&start);
+            if (pwrite_bytes(job->fd, job->block, ref->len, job->base + (off_t) ref->offset) < 0)
+                die_errno("Unable to write block '%s'", block->hash->hex);
+            trace_span("output-write", block->hash, &start);
+            metrics_add(METRIC_OUTPUT_BYTES, ref->len);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Read the restored output back in index order to verify the overall
+ * hash. Write-only outputs are opened again for reading.
+ */
+static void verify_ordered(int fd, off_t base, size_t len, const struct hash *expected_hash, unsigned char *block)
+{
+    struct hash_state state;
+    struct hash computed_hash;
+    char path[64];
+    size_t offset;
+    int flags, rfd = fd;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0)
+        die_errno("Unable to get output flags");
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+        sprintf(path, "/dev/fd/%d", fd);
+        if ((rfd = open(path, O_RDONLY)) < 0)
+            die_errno("Unable to open output for verification");
+    }
+
+    if (hash_state_init(&state) < 0)
+        die("Unable to initialize hashing state");
+
+    for (offset = 0; offset < len; offset += BLOCK_LEN) {
+        size_t blocklen = len - offset < BLOCK_LEN ? len - offset : BLOCK_LEN;
+        ssize_t bytes;
+
+        if ((bytes = pread_bytes(rfd, block, blocklen, base + (off_t) offset)) < 0)
+            die_errno("Unable to read back output");
+        if ((size_t) bytes != blocklen)
+            die("Output is shorter than expected");
+        if (hash_state_update(&state, block, blocklen) < 0)
+            die("Unable to update hash");
+    }
+
+    if (hash_state_final(&computed_hash, &state) < 0)
+        die("Unable to finalize hash");
+    if (!hash_eq(&computed_hash, expected_hash))
+        die("Hash mismatch");
+
+    if (rfd != fd)
+        close(rfd);
+}
+
+/*
+ * Restore into a seekable output in the order blocks are laid out in
+ * the store instead of index order, so that a store on rotating disks
+ * is read mostly sequentially. Every block is read once, verified
+ * and written to all of its offsets. As the output is not written
+ * sequentially, the overall hash is computed by reading the output
+ * back once all blocks have been written.
+ */
+static int cat_ordered(const char *storepath, int fd, size_t njobs, int verbose)
+{
+    struct restore_plan plan;
+    struct ordered_job *jobs;
+    struct store store;
+    struct hash expected_hash, *hashes = NULL;
+    size_t i, nhashes = 0, expected_len;
+    struct stat st;
+    off_t base;
+    int error, flags;
+
+    read_index(&hashes, &nhashes, &expected_hash, &expected_len);
+
+    if ((expected_len + BLOCK_LEN - 1) / BLOCK_LEN != nhashes)
+        die("Size mismatch");
+
+    if ((base = lseek(fd, 0, SEEK_CUR)) < 0 || fstat(fd, &st) < 0)
+        die_errno("Ordered restores require seekable output");
+    /* Appending writes ignore the offsets blocks are written to. */
+    if ((flags = fcntl(fd, F_GETFL)) < 0 || (flags & O_APPEND))
+        die("Ordered restores require output not opened for appending");
+
+    plan_init(&plan);
+    for (i = 0; i < nhashes; i++) {
+        size_t len = expected_len - i * BLOCK_LEN;
+        if (plan_add(&plan, 0, &hashes[i], (uint64_t) i * BLOCK_LEN, len > BLOCK_LEN ? BLOCK_LEN : len) < 0)
+            die_errno("Unable to allocate restore plan");
+    }
+
+    if (store_open(&store, storepath) < 0)
+        die("Unable to open store");
+    if (plan_finalize(&plan, &store) < 0)
+        die("Unable to plan restore");
+
+    if (S_ISREG(st.st_mode) && ftruncate(fd, base + (off_t) expected_len) < 0)
+        die_errno("Unable to truncate output");
+
+    if (njobs > plan.nblocks)
+        njobs = plan.nblocks ? plan.nblocks : 1;
+
+    if ((jobs = calloc(njobs, sizeof(*jobs))) == NULL)
+        die_errno("Unable to allocate jobs");
+
+    /*
+     * Jobs process blocks in an interleaved fashion, so that all of
+     * them together move through the store in order.
+     */
+    for (i = 0; i < njobs; i++) {
+        if ((jobs[i].block = malloc(BLOCK_LEN)) == NULL)
+            die_errno("Unable to allocate block");
+        if (store_open(&jobs[i].store, storepath) < 0)
+            die("Unable to open store");
+        jobs[i].plan = &plan;
+        jobs[i].first = i;
+        jobs[i].stride = njobs;
+        jobs[i].fd = fd;
+        jobs[i].base = base;
+
+        if ((error = pthread_create(&jobs[i].thread, NULL, restore_ordered_blocks, &jobs[i])) != 0) {
+            errno = error;
+            die_errno("Unable to create thread");
+        }
+    }
+
+    for (i = 0; i < njobs; i++) {
+        if ((error = pthread_join(jobs[i].thread, NULL)) != 0) {
+            errno = error;
+            die_errno("Unable to join thread");
+        }
+        if (store_close(&jobs[i].store) < 0)
+            die("Unable to close store");
+    }
+
+    verify_ordered(fd, base, expected_len, &expected_hash, jobs[0].block);
+    for (i = 0; i < njobs; i++)
+        free(jobs[i].block);
+
+    if (verbose)
+        fprintf(stderr, "%lu unique blocks read for %lu blocks\n",
+                (unsigned long) plan.nblocks, (unsigned long) nhashes);
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    plan_free(&plan);
+    free(jobs);
+    free(hashes);
+
+    return 0;
+}
+
 int gob_cat(int argc, const char *argv[])
 {
     struct hash_state state;
     struct hash expected_hash, computed_hash;
+    struct block_cache cache;
+    struct checkpoint checkpoint;
+    struct index_reader index;
+    struct timespec start;
     struct store store;
-    unsigned char *block = malloc(BLOCK_LEN);
-    char *line = NULL;
-    ssize_t linelen;
-    size_t total = 0, n = 0, expected_len;
+    unsigned char *block;
+    const char *target = NULL, *checkpoint_path = NULL;
+    char *line;
+    size_t total = 0, linelen, expected_len, cache_size = 16 * BLOCK_LEN;
+    uintmax_t blocks = 0;
+    unsigned long njobs = 4, interval = CHECKPOINT_INTERVAL;
+    int i, err, fd, verbose = 0, resume = 0, ordered = 0;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--target") && i + 1 < argc)
+            target = argv[++i];
+        else if (!strcmp(argv[i], "--ordered"))
+            ordered = 1;
+        else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+            njobs = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+            if (parse_size(&cache_size, argv[++i]) < 0)
+                die("Invalid cache size '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--verbose")) {
+            verbose = 1;
+        } else if (!strcmp(argv[i], "--limit") && i + 1 < argc) {
+            if (throttle_set(argv[++i]) < 0)
+                die("Invalid limit '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--limit-file") && i + 1 < argc) {
+            if (throttle_watch(argv[++i]) < 0)
+                die("Unable to read limits from '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            if (metrics_enable(argv[++i], "cat") < 0)
+                die_errno("Unable to write metrics to '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            if (trace_enable(argv[++i]) < 0)
+                die_errno("Unable to write trace to '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc)
+            checkpoint_path = argv[++i];
+        else if (!strcmp(argv[i], "--checkpoint-interval") && i + 1 < argc)
+            interval = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--resume"))
+            resume = 1;
+        else
+            die("Unknown option '%s'", argv[i]);
+    }
 
-    if (argc != 2)
-        die("USAGE: %s cat <DIR>", argv[0]);
+    if (argc - i != 1 || !njobs || !interval || (resume && !checkpoint_path) || (ordered && checkpoint_path))
+        die("USAGE: %s cat [--target <FILE>] [--ordered] [--jobs <N>] [--cache-size <SIZE>] [--limit <KEY>=<RATE>]... [--limit-file <FILE>] [--metrics <FILE>] [--trace <FILE>] [--checkpoint <FILE> [--checkpoint-interval <N>] [--resume]] [--verbose] <DIR>", argv[0]);
 
     atexit(close_stdout);
 
-    if (store_open(&store, argv[1]) < 0)
+    if (ordered) {
+        if (!target)
+            return cat_ordered(argv[i], STDOUT_FILENO, njobs, verbose);
+        if ((fd = open(target, O_RDWR|O_CREAT, 0666)) < 0)
+            die_errno("Unable to open target '%s'", target);
+        err = cat_ordered(argv[i], fd, njobs, verbose);
+        if (try_close(fd) < 0)
+            die_errno("Unable to close target '%s'", target);
+        return err;
+    }
+
+    if (checkpoint_path) {
+        if (checkpoint_open(&checkpoint, checkpoint_path, interval, resume) < 0)
+            die_errno("Unable to open checkpoint '%s'", checkpoint_path);
+
+        /*
+         * Output written after the last checkpoint is discarded, so
+         * standard output needs to be seekable when not restoring
+         * onto a target. Output covered by the checkpoint is not
+         * written again, so it must not have been truncated by the
+         * caller, or the restored data would silently contain holes.
+         */
+        if (!target) {
+            struct stat st;
+
+            if (lseek(STDOUT_FILENO, (off_t) checkpoint.bytes, SEEK_SET) < 0)
+                die_errno("Checkpoints require seekable output");
+            if (fstat(STDOUT_FILENO, &st) < 0)
+                die_errno("Unable to stat output");
+            if (checkpoint.bytes && (!S_ISREG(st.st_mode) || (uintmax_t) st.st_size < checkpoint.bytes))
+                die("Resuming requires the output of the interrupted run");
+            if (S_ISREG(st.st_mode) && ftruncate(STDOUT_FILENO, (off_t) checkpoint.bytes) < 0)
+                die_errno("Unable to truncate output");
+        }
+    }
+
+    if (target) {
+        err = cat_target(argv[i], target, njobs, verbose, checkpoint_path ? &checkpoint : NULL);
+        if (checkpoint_path && !err && checkpoint_remove(&checkpoint) < 0)
+            die_errno("Unable to remove checkpoint '%s'", checkpoint_path);
+        return err;
+    }
+
+    if ((block = malloc(BLOCK_LEN)) == NULL)
+        die_errno("Unable to allocate block");
+
+    if (block_cache_init(&cache, cache_size) < 0)
+        die_errno("Unable to allocate block cache");
+
+    if (store_open(&store, argv[i]) < 0)
         die("Unable to open store");
 
+    if (index_reader_init(&index, STDIN_FILENO) < 0)
+        die_errno("Unable to allocate index buffer");
+
     if (hash_state_init(&state) < 0)
         die("Unable to initialize hashing state");
 
-    while ((linelen = getline(&line, &n, stdin)) > 0) {
+    if (checkpoint_path) {
+        state = checkpoint.state;
+        total = (size_t) checkpoint.bytes;
+    }
+
+    while ((err = index_reader_line(&index, &line, &linelen)) > 0) {
         struct hash hash;
         ssize_t blocklen;
 
         if (*line == '>')
             break;
 
-        if (line[linelen - 1] == '\n')
-            line[--linelen] = '\0';
-
-        if (hash_from_str(&hash, line, (size_t) linelen) < 0)
+        if (hash_from_str(&hash, line, linelen) < 0)
             die("Invalid index hash '%s'", line);
 
-        if ((blocklen = store_read(block, BLOCK_LEN, &store, &hash)) < 0)
+        if (checkpoint_path && blocks < checkpoint.blocks) {
+            blocks++;
+            continue;
+        }
+
+        /*
+         * Zero-filled or templated regions cause the same block to be
+         * referenced many times, so keep recently read blocks around.
+         */
+        if ((blocklen = block_cache_read(block, BLOCK_LEN, &cache, &store, &hash)) < 0)
             die_errno("Unable to open block '%s'", line);
 
+        trace_start(&start);
         if (hash_state_update(&state, block, (size_t) blocklen) < 0)
             die("Unable to update hash");
+        trace_span("hash-total", &hash, &start);
 
+        trace_start(&start);
         if (write_bytes(STDOUT_FILENO, block, (size_t) blocklen) < 0)
             die_errno("Unable to write block '%s'", line);
+        trace_span("output-write", &hash, &start);
+        metrics_add(METRIC_OUTPUT_BYTES, (uintmax_t) blocklen);
 
         total += (size_t) blocklen;
+
+        if (checkpoint_path && ++blocks % interval == 0) {
+            if (fsync(STDOUT_FILENO) < 0)
+                die_errno("Unable to sync output");
+            if (checkpoint_write(&checkpoint, blocks, total, &state) < 0)
+                die_errno("Unable to write checkpoint '%s'", checkpoint_path);
+        }
     }
 
-    if (linelen < 0 && !feof(stdin))
+    if (err < 0)
         die_errno("Unable to read index");
 
-    if ((parse_trailer(&expected_hash, &expected_len, line)) < 0)
+    if (err == 0 || (parse_trailer(&expected_hash, &expected_len, line)) < 0)
         die("Unable to read index");
 
     if (hash_state_final(&computed_hash, &state) < 0)
@@ -108,7 +719,15 @@ int gob_cat(int argc, const char *argv[])
     if (store_close(&store) < 0)
         die("Unable to close store");
 
-    free(line);
+    if (checkpoint_path && checkpoint_remove(&checkpoint) < 0)
+        die_errno("Unable to remove checkpoint '%s'", checkpoint_path);
+
+    if (verbose)
+        fprintf(stderr, "%"PRIuMAX" cache hits, %"PRIuMAX" cache misses\n",
+                cache.hits, cache.misses);
+
+    block_cache_free(&cache);
+    index_reader_free(&index);
     free(block);
 
     return 0;
@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define HEXCHARS "0123456789abcdef"
+
+struct scan_state {
+    struct store *store;
+    struct catalog_entry *entries;
+    size_t nentries;
+    size_t alloc;
+};
+
+static int is_hex(const char *name, size_t len)
+{
+    return strlen(name) == len && strspn(name, HEXCHARS) == len;
+}
+
+static int is_delta(const char *name, size_t len)
+{
+    return strlen(name) == len + strlen(BLOCK_STORE_DELTA_SUFFIX) && strspn(name, HEXCHARS) == len &&
+        !strcmp(name + len, BLOCK_STORE_DELTA_SUFFIX);
+}
+
+static void add_entry(struct scan_state *state, const unsigned char *hash, uint32_t size, uint32_t location)
+{
+    struct catalog_entry *entry;
+
+    if (state->nentries == state->alloc) {
+        state->alloc = state->alloc ? state->alloc * 2 : 4096;
+        if ((entry = realloc(state->entries, state->alloc * sizeof(*entry))) == NULL)
+            die_errno("Unable to allocate catalog entries");
+        state->entries = entry;
+    }
+
+    entry = &state->entries[state->nentries];
+    memcpy(entry->hash, hash, HASH_LEN);
+    entry->size = size;
+    entry->location = location;
+    entry->seq = state->nentries++;
+}
+
+static void add_block(struct scan_state *state, const char *path, const char *prefix,
+        const char *name, size_t namelen, int delta, const struct stat *st)
+{
+    char hex[HASH_LEN * 2 + 1];
+    struct stat deltast;
+    struct hash hash;
+
+    if (snprintf(hex, sizeof(hex), "%s%.*s", prefix, (int) namelen, name) != HASH_LEN * 2 ||
+            hash_from_str(&hash, hex, HASH_LEN * 2) < 0)
+        die("Invalid block name '%s/%s'", path, name);
+
+    /* Deltas are recorded with the size of the reconstructed block. */
+    if (delta) {
+        if (store_stat(&deltast, state->store, &hash) < 0)
+            die_errno("Unable to read delta '%s/%s'", path, name);
+        st = &deltast;
+    }
+
+    add_entry(state, hash.bin, (uint32_t) st->st_size, CATALOG_LOCATION_LOOSE);
+}
+
+/*
+ * Collect all blocks stored in the sharding hierarchy below the
+ * given path. Entries whose name or type does not match the layout
+ * are ignored, as they are reported by gob-fsck(1) already.
+ */
+static void scan_level(struct scan_state *state, const char *path, const char *prefix, unsigned level)
+{
+    const struct store_config *config = &state->store->config;
+    size_t namelen = level == config->shard_depth ?
+        HASH_LEN * 2 - config->shard_depth * config->shard_width :
+        config->shard_width;
+    struct dirent *ent;
+    DIR *dir;
+    int fd;
+
+    if ((fd = level ? openat(state->store->fd, path, O_RDONLY) : dup(state->store->fd)) < 0 ||
+            (dir = fdopendir(fd)) == NULL)
+        die_errno("Unable to open sharding directory '%s'", path);
+
+    while ((errno = 0, ent = readdir(dir)) != NULL) {
+        char subpath[STORE_SHARD_PATH_MAX + DELTA_NAME_MAX + 1], subprefix[STORE_SHARD_PATH_MAX];
+        int delta = level == config->shard_depth && is_delta(ent->d_name, namelen);
+        struct stat st;
+
+        if (!is_hex(ent->d_name, namelen) && !delta)
+            continue;
+
+        if (level)
+            snprintf(subpath, sizeof(subpath), "%s/%s", path, ent->d_name);
+        else
+            snprintf(subpath, sizeof(subpath), "%s", ent->d_name);
+
+        if (fstatat(state->store->fd, subpath, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            die_errno("Unable to stat '%s'", subpath);
+
+        if (level == config->shard_depth && S_ISREG(st.st_mode)) {
+            add_block(state, path, prefix, ent->d_name, namelen, delta, &st);
+        } else if (level != config->shard_depth && S_ISDIR(st.st_mode)) {
+            snprintf(subprefix, sizeof(subprefix), "%s%s", prefix, ent->d_name);
+            scan_level(state, subpath, subprefix, level + 1);
+        }
+    }
+    if (errno)
+        die_errno("Unable to read sharding directory '%s'", path);
+
+    if (try_closedir(dir) < 0)
+        die_errno("Unable to close sharding directory '%s'", path);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct catalog_entry *x = a, *y = b;
+    int cmp = memcmp(x->hash, y->hash, HASH_LEN);
+    if (cmp)
+        return cmp;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Collect loose blocks first and packed blocks from the most recent
+ * pack on. Blocks are looked up in the same order, so only the first
+ * copy of every block is kept.
+ */
+static void scan_store(struct scan_state *state, struct store *store)
+{
+    struct pack_entry entry;
+    size_t i, j, n = 0;
+
+    memset(state, 0, sizeof(*state));
+    state->store = store;
+    scan_level(state, ".", "", 0);
+
+    if (store_packs_load(store) < 0)
+        die_errno("Unable to load packs");
+    for (i = 0; i < store->npacks; i++) {
+        for (j = 0; j < store->packs[i].nrecords; j++) {
+            pack_entry_at(&entry, &store->packs[i], j);
+            add_entry(state, entry.hash, entry.size, store->packs[i].id);
+        }
+    }
+
+    qsort(state->entries, state->nentries, sizeof(*state->entries), entry_cmp);
+    for (i = 0; i < state->nentries; i++)
+        if (!n || memcmp(state->entries[i].hash, state->entries[n - 1].hash, HASH_LEN))
+            state->entries[n++] = state->entries[i];
+    state->nentries = n;
+}
+
+static int catalog_rebuild(int argc, const char *argv[])
+{
+    struct scan_state state;
+    struct store store;
+
+    if (argc != 2)
+        die("USAGE: %s catalog rebuild <DIR>", argv[0]);
+
+    if (store_open(&store, argv[1]) < 0)
+        die("Unable to open store");
+
+    /*
+     * Lock the catalog before scanning, so that blocks written
+     * concurrently are either found by the scan or appended to the
+     * new catalog once the lock is released.
+     */
+    if (store_catalog_lock(&store) < 0)
+        die_errno("Unable to lock catalog");
+
+    scan_store(&state, &store);
+
+    if (store_catalog_replace(&store, state.entries, state.nentries) < 0)
+        die_errno("Unable to write catalog");
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    free(state.entries);
+
+    return 0;
+}
+
+static int catalog_check(int argc, const char *argv[])
+{
+    struct catalog_entry *entries;
+    struct scan_state state;
+    struct store store;
+    struct hash hash;
+    size_t i = 0, j = 0, nentries;
+    int err = 0;
+
+    if (argc != 2)
+        die("USAGE: %s catalog check <DIR>", argv[0]);
+
+    if (store_open(&store, argv[1]) < 0)
+        die("Unable to open store");
+
+    if (store_catalog_read(&entries, &nentries, &store) < 0)
+        die_errno("Unable to read catalog");
+
+    scan_store(&state, &store);
+
+    while (i < nentries || j < state.nentries) {
+        int cmp = i == nentries ? 1 : j == state.nentries ? -1 :
+            memcmp(entries[i].hash, state.entries[j].hash, HASH_LEN);
+
+        if (cmp < 0) {
+            hash_from_bin(&hash, entries[i].hash, HASH_LEN);
+            warn("catalog entry '%s' has no block", hash.hex);
+            err = -1;
+            i++;
+        } else if (cmp > 0) {
+            hash_from_bin(&hash, state.entries[j].hash, HASH_LEN);
+            warn("block '%s' is missing from catalog", hash.hex);
+            err = -1;
+            j++;
+        } else {
+            if (entries[i].size != state.entries[j].size) {
+                hash_from_bin(&hash, entries[i].hash, HASH_LEN);
+                warn("catalog entry '%s' has size %lu, but block has %lu", hash.hex,
+                        (unsigned long) entries[i].size, (unsigned long) state.entries[j].size);
+                err = -1;
+            }
+            if (entries[i].location != state.entries[j].location) {
+                hash_from_bin(&hash, entries[i].hash, HASH_LEN);
+                warn("catalog entry '%s' has location %lu, but block has %lu", hash.hex,
+                        (unsigned long) entries[i].location, (unsigned long) state.entries[j].location);
+                err = -1;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    free(state.entries);
+    free(entries);
+
+    return err;
+}
+
+static int catalog_compact(int argc, const char *argv[])
+{
+    struct store store;
+
+    if (argc != 2)
+        die("USAGE: %s catalog compact <DIR>", argv[0]);
+
+    if (store_open(&store, argv[1]) < 0)
+        die("Unable to open store");
+
+    if (store_catalog_compact(&store) < 0)
+        die_errno("Unable to compact catalog");
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    return 0;
+}
+
+static int catalog_list(int argc, const char *argv[])
+{
+    struct catalog_entry *entries;
+    struct store store;
+    struct hash hash;
+    size_t i, nentries;
+
+    if (argc != 2)
+        die("USAGE: %s catalog list <DIR>", argv[0]);
+
+    atexit(close_stdout);
+
+    if (store_open(&store, argv[1]) < 0)
+        die("Unable to open store");
+
+    if (store_catalog_read(&entries, &nentries, &store) < 0)
+        die_errno("Unable to read catalog");
+
+    for (i = 0; i < nentries; i++) {
+        hash_from_bin(&hash, entries[i].hash, HASH_LEN);
+        printf("%s %lu\n", hash.hex, (unsigned long) entries[i].size);
+    }
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    free(entries);
+
+    return 0;
+}
+
+int gob_catalog(int argc, const char *argv[])
+{
+    if (argc >= 2 && !strcmp(argv[1], "rebuild")) {
+        memmove(argv + 1, argv + 2, sizeof(char *) * (unsigned) argc - 2);
+        return catalog_rebuild(argc - 1, argv);
+    } else if (argc >= 2 && !strcmp(argv[1], "check")) {
+        memmove(argv + 1, argv + 2, sizeof(char *) * (unsigned) argc - 2);
+        return catalog_check(argc - 1, argv);
+    } else if (argc >= 2 && !strcmp(argv[1], "compact")) {
+        memmove(argv + 1, argv + 2, sizeof(char *) * (unsigned) argc - 2);
+        return catalog_compact(argc - 1, argv);
+    } else if (argc >= 2 && !strcmp(argv[1], "list")) {
+        memmove(argv + 1, argv + 2, sizeof(char *) * (unsigned) argc - 2);
+        return catalog_list(argc - 1, argv);
+    }
+
+    die("USAGE: %s catalog (rebuild|check|compact|list) <DIR>", argv[0]);
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct output {
+    const char *index;
+    const char *path;
+    uint64_t len;
+    int fd;
+};
+
+struct restore_job {
+    pthread_t thread;
+    struct store store;
+    unsigned char *block;
+    const struct restore_plan *plan;
+    const struct output *outputs;
+    size_t first, stride;
+    uintmax_t written;
+};
+
+static void read_index(struct restore_plan *plan, struct output *output, size_t outputnr)
+{
+    struct index_reader index;
+    struct hash hash;
+    size_t linelen;
+    uint64_t offset = 0;
+    char *line;
+    int fd, err;
+
+    if ((fd = open(output->index, O_RDONLY)) < 0)
+        die_errno("Unable to open index '%s'", output->index);
+
+    if (index_reader_init(&index, fd) < 0)
+        die_errno("Unable to allocate index buffer");
+
+    while ((err = index_reader_line(&index, &line, &linelen)) > 0) {
+        if (*line == '>')
+            break;
+
+        if (hash_from_str(&hash, line, linelen) < 0)
+            die("Invalid index hash '%s' in '%s'", line, output->index);
+
+        if (plan_add(plan, outputnr, &hash, offset, BLOCK_LEN) < 0)
+            die_errno("Unable to allocate restore plan");
+        offset += BLOCK_LEN;
+    }
+
+    if (err < 0)
+        die_errno("Unable to read index '%s'", output->index);
+    if (err == 0 || linelen < HASH_LEN * 2 + 3 || line[HASH_LEN * 2 + 1] != ' ')
+        die("Index '%s' has no valid trailer", output->index);
+
+    output->len = (uint64_t) strtoumax(line + HASH_LEN * 2 + 2, NULL, 10);
+    if ((output->len + BLOCK_LEN - 1) / BLOCK_LEN != offset / BLOCK_LEN)
+        die("Index '%s' has an invalid length", output->index);
+
+    /* Only the last block of an index may be shorter. */
+    if (offset)
+        plan->refs[plan->nrefs - 1].len = (size_t) (output->len - (offset - BLOCK_LEN));
+
+    index_reader_free(&index);
+    if (try_close(fd) < 0)
+        die_errno("Unable to close index '%s'", output->index);
+}
+
+static void *restore_blocks(void *payload)
+{
+    struct restore_job *job = payload;
+    size_t i, j;
+
+    for (i = job->first; i < job->plan->nblocks; i += job->stride) {
+        const struct plan_block *block = &job->plan->blocks[i];
+        struct hash hash;
+        ssize_t bytes;
+
+        if ((bytes = store_read(job->block, BLOCK_LEN, &job->store, block->hash)) < 0)
+            die_errno("Unable to read block '%s'", block->hash->hex);
+
+        if (hash_compute(&hash, job->block, (size_t) bytes) < 0)
+            die("Unable to hash block '%s'", block->hash->hex);
+        if (!hash_eq(&hash, block->hash))
+            die("Hash mismatch for block '%s'", block->hash->hex);
+
+        for (j = block->first; j < block->first + block->nrefs; j++) {
+            const struct plan_ref *ref = &job->plan->refs[j];
+            const struct output *output = &job->outputs[ref->output];
+
+            if ((size_t) bytes != ref->len)
+                die("Size mismatch for block '%s' in '%s'", block->hash->hex, output->index);
+
+            if (pwrite_bytes(output->fd, job->block, ref->len, (off_t) ref->offset) < 0)
+                die_errno("Unable to write '%s'", output->path);
+            job->written++;
+        }
+    }
+
+    return NULL;
+}
+
+int gob_cat_many(int argc, const char *argv[])
+{
+    struct restore_plan plan;
+    struct restore_job *jobs;
+    struct output *outputs;
+    struct store store;
+    uintmax_t written = 0;
+    size_t j, noutputs;
+    unsigned long njobs = 4;
+    int i, error, verbose = 0;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+            njobs = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--verbose"))
+            verbose = 1;
+        else
+            die("Unknown option '%s'", argv[i]);
+    }
+
+    if (argc - i < 2 || !njobs)
+        die("USAGE: %s cat-many [--jobs <N>] [--verbose] <DIR> <INDEX>:<OUTPUT>...", argv[0]);
+
+    atexit(close_stdout);
+
+    noutputs = (size_t) (argc - i - 1);
+    if ((outputs = calloc(noutputs, sizeof(*outputs))) == NULL)
+        die_errno("Unable to allocate outputs");
+
+    plan_init(&plan);
+
+    for (j = 0; j < noutputs; j++) {
+        const char *arg = argv[i + 1 + (int) j], *sep;
+        char *index;
+
+        if ((sep = strchr(arg, ':')) == NULL || sep == arg || !sep[1])
+            die("Invalid restore target '%s'", arg);
+
+        if ((index = malloc((size_t) (sep - arg) + 1)) == NULL)
+            die_errno("Unable to allocate index path");
+        memcpy(index, arg, (size_t) (sep - arg));
+        index[sep - arg] = '\0';
+
+        outputs[j].index = index;
+        outputs[j].path = sep + 1;
+
+        read_index(&plan, &outputs[j], j);
+    }
+
+    if (store_open(&store, argv[i]) < 0)
+        die("Unable to open store");
+
+    if (plan_finalize(&plan, &store) < 0)
+        die("Unable to plan restore");
+
+    for (j = 0; j < noutputs; j++) {
+        struct stat st;
+
+        if ((outputs[j].fd = open(outputs[j].path, O_WRONLY|O_CREAT, 0666)) < 0)
+            die_errno("Unable to open output '%s'", outputs[j].path);
+        if (fstat(outputs[j].fd, &st) < 0)
+            die_errno("Unable to stat output '%s'", outputs[j].path);
+        if (S_ISREG(st.st_mode) && ftruncate(outputs[j].fd, (off_t) outputs[j].len) < 0)
+            die_errno("Unable to truncate output '%s'", outputs[j].path);
+    }
+
+    if (njobs > plan.nblocks)
+        njobs = plan.nblocks ? plan.nblocks : 1;
+
+    if ((jobs = calloc(njobs, sizeof(*jobs))) == NULL)
+        die_errno("Unable to allocate jobs");
+
+    for (j = 0; j < njobs; j++) {
+        if ((jobs[j].block = malloc(BLOCK_LEN)) == NULL)
+            die_errno("Unable to allocate block");
+        if (store_open(&jobs[j].store, argv[i]) < 0)
+            die("Unable to open store");
+        jobs[j].plan = &plan;
+        jobs[j].outputs = outputs;
+        jobs[j].first = j;
+        jobs[j].stride = njobs;
+
+        if ((error = pthread_create(&jobs[j].thread, NULL, restore_blocks, &jobs[j])) != 0) {
+            errno = error;
+            die_errno("Unable to create thread");
+        }
+    }
+
+    for (j = 0; j < njobs; j++) {
+        if ((error = pthread_join(jobs[j].thread, NULL)) != 0) {
+            errno = error;
+            die_errno("Unable to join thread");
+        }
+        written += jobs[j].written;
+
+        if (store_close(&jobs[j].store) < 0)
+            die("Unable to close store");
+        free(jobs[j].block);
+    }
+
+    for (j = 0; j < noutputs; j++) {
+        if (try_close(outputs[j].fd) < 0)
+            die_errno("Unable to close output '%s'", outputs[j].path);
+        free((char *) outputs[j].index);
+    }
+
+    if (verbose)
+        fprintf(stderr, "%lu unique blocks read for %"PRIuMAX" blocks written\n",
+                (unsigned long) plan.nblocks, written);
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    plan_free(&plan);
+    free(outputs);
+    free(jobs);
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A checkpoint file is an append-only log of index lines, which are
+ * interleaved with checkpoint records of the form
+ *
+ *     #<BLOCKS> <BYTES> <HASHSTATE>
+ *
+ * A record states that the first BLOCKS blocks, spanning BYTES bytes
+ * of data, have been processed and that the serialized hashing state
+ * covers them. Everything after the last complete record is
+ * discarded when resuming.
+ */
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CHECKPOINT_RECORD_MAX (2 * 21 + HASH_STATE_LEN * 2 + 4)
+
+static int parse_record(struct checkpoint *checkpoint, const char *line, size_t len)
+{
+    unsigned char state[HASH_STATE_LEN];
+    uintmax_t blocks, bytes;
+    char *end;
+
+    blocks = strtoumax(line + 1, &end, 10);
+    if (*end != ' ')
+        return -1;
+    bytes = strtoumax(end + 1, &end, 10);
+    if (*end != ' ' || (size_t) (line + len - (end + 1)) != HASH_STATE_LEN * 2 ||
+            hex_decode(state, end + 1, HASH_STATE_LEN * 2) < 0 ||
+            hash_state_load(&checkpoint->state, state) < 0)
+        return -1;
+
+    checkpoint->blocks = blocks;
+    checkpoint->bytes = bytes;
+
+    return 0;
+}
+
+/*
+ * Load the last complete record and discard everything written after
+ * it. Index lines are only stored by gob-chunk(1), so a record either
+ * follows as many index lines as it has blocks or none at all.
+ */
+static int checkpoint_load(struct checkpoint *checkpoint)
+{
+    struct index_reader reader;
+    struct hash hash;
+    struct stat st;
+    uintmax_t nhashes = 0;
+    off_t offset = 0, end = 0;
+    size_t linelen;
+    char *line;
+    int err;
+
+    if (fstat(checkpoint->fd, &st) < 0 || index_reader_init(&reader, checkpoint->fd) < 0)
+        return -1;
+
+    while ((err = index_reader_line(&reader, &line, &linelen)) > 0) {
+        if (offset + (off_t) linelen + 1 > st.st_size)
+            break;
+        offset += (off_t) linelen + 1;
+
+        if (*line == '#') {
+            if ((nhashes && nhashes != strtoumax(line + 1, NULL, 10)) ||
+                    parse_record(checkpoint, line, linelen) < 0)
+                break;
+            end = offset;
+        } else if (hash_from_str(&hash, line, linelen) == 0) {
+            nhashes++;
+        } else {
+            break;
+        }
+    }
+
+    index_reader_free(&reader);
+
+    if (err < 0 || ftruncate(checkpoint->fd, end) < 0)
+        return -1;
+
+    return 0;
+}
+
+int checkpoint_open(struct checkpoint *checkpoint, const char *path, unsigned long interval, int resume)
+{
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->path = path;
+    checkpoint->interval = interval;
+
+    if (hash_state_init(&checkpoint->state) < 0)
+        return -1;
+
+    if ((checkpoint->fd = open(path, O_RDWR|O_CREAT|O_APPEND|(resume ? 0 : O_TRUNC), 0644)) < 0)
+        return -1;
+
+    if ((resume && checkpoint_load(checkpoint) < 0) ||
+            index_writer_init(&checkpoint->index, checkpoint->fd) < 0) {
+        close(checkpoint->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Write all index lines covered by the checkpoint into the given index. */
+int checkpoint_replay(struct checkpoint *checkpoint, struct index_writer *index)
+{
+    struct index_reader reader;
+    struct hash hash;
+    uintmax_t nhashes = 0;
+    size_t linelen;
+    char *line;
+    int err = 0;
+
+    if (lseek(checkpoint->fd, 0, SEEK_SET) < 0 || index_reader_init(&reader, checkpoint->fd) < 0)
+        return -1;
+
+    while (nhashes < checkpoint->blocks && (err = index_reader_line(&reader, &line, &linelen)) > 0) {
+        if (*line == '#')
+            continue;
+        if (hash_from_str(&hash, line, linelen) < 0 || index_writer_add(index, &hash) < 0) {
+            err = -1;
+            break;
+        }
+        nhashes++;
+    }
+
+    index_reader_free(&reader);
+
+    if (err < 0 || nhashes != checkpoint->blocks) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int checkpoint_add(struct checkpoint *checkpoint, const struct hash *hash)
+{
+    return index_writer_add(&checkpoint->index, hash);
+}
+
+/*
+ * Append a record for the given position. Index lines added before
+ * are written first and the file is synced, so that the record is
+ * only visible once everything it covers is durable.
+ */
+int checkpoint_write(struct checkpoint *checkpoint, uintmax_t blocks, uintmax_t bytes, const struct hash_state *state)
+{
+    unsigned char serialized[HASH_STATE_LEN];
+    char record[CHECKPOINT_RECORD_MAX];
+    int len;
+
+    hash_state_save(serialized, state);
+
+    len = snprintf(record, sizeof(record), "#%"PRIuMAX" %"PRIuMAX" ", blocks, bytes);
+    if (len < 0 || (size_t) len + HASH_STATE_LEN * 2 + 1 > sizeof(record)) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    hex_encode(record + len, serialized, HASH_STATE_LEN);
+    len += HASH_STATE_LEN * 2;
+    record[len++] = '\n';
+
+    if (index_writer_flush(&checkpoint->index) < 0 ||
+            write_bytes(checkpoint->fd, (unsigned char *) record, (size_t) len) < 0 ||
+            fsync(checkpoint->fd) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Remove the checkpoint after the operation has finished successfully. */
+int checkpoint_remove(struct checkpoint *checkpoint)
+{
+    index_writer_free(&checkpoint->index);
+
+    if (try_close(checkpoint->fd) < 0 || unlink(checkpoint->path) < 0)
+        return -1;
+
+    return 0;
+}
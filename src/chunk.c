@@ -18,52 +18,665 @@
 #include "common.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 
+#define CHUNK_MAX_STORES 16
+#define CHUNK_QUEUE_LEN 4
+
+struct store_queue;
+
+struct store_writer {
+    pthread_t thread;
+    struct store store;
+    const char *path;
+    int optional;
+    int failed;
+
+    struct store_queue *queue;
+    uintmax_t next;
+};
+
+struct queued_block {
+    unsigned char *data;
+    size_t len;
+    struct hash hash;
+    off_t srcoff;
+};
+
+/*
+ * Hashed blocks are handed to one long-lived thread per store via a
+ * ring of slots, so that reading the input overlaps with writing and
+ * a slow store only stalls reading once the ring is full. A slot is
+ * reused once all stores which have not failed have written it.
+ */
+struct store_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct store_writer *writers;
+    size_t nwriters;
+    struct queued_block slots[CHUNK_QUEUE_LEN];
+    uintmax_t head;
+    int srcfd;
+    int done;
+};
+
+/*
+ * A failure of a required store is fatal, while optional stores are
+ * dropped with a warning.
+ */
+static void report_failure(const struct store_writer *writer, const struct hash *hash)
+{
+    if (!writer->optional)
+        die_errno("Unable to write block '%s' to store '%s'", hash->hex, writer->path);
+
+    warn("Unable to write block '%s' to store '%s', dropping it: %s",
+            hash->hex, writer->path, strerror(errno));
+}
+
+/*
+ * Write the block into all stores which have not failed yet. This is
+ * used by the workers of parallel chunking, which already write
+ * multiple blocks at the same time.
+ */
+static void write_stores(struct store_writer *writers, size_t nwriters,
+        const struct hash *hash, const unsigned char *data, size_t len, int srcfd, off_t srcoff)
+{
+    size_t i;
+
+    for (i = 0; i < nwriters; i++) {
+        if (writers[i].failed || store_put(&writers[i].store, hash, data, len, srcfd, srcoff) == 0)
+            continue;
+
+        report_failure(&writers[i], hash);
+        writers[i].failed = 1;
+        store_close(&writers[i].store);
+    }
+}
+
+static void *write_queued_blocks(void *payload)
+{
+    struct store_writer *writer = payload;
+    struct store_queue *queue = writer->queue;
+    struct queued_block *block;
+    int err;
+
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        while (!writer->failed && writer->next == queue->head && !queue->done)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        if (writer->failed || writer->next == queue->head) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        block = &queue->slots[writer->next % CHUNK_QUEUE_LEN];
+        pthread_mutex_unlock(&queue->lock);
+
+        err = store_put(&writer->store, &block->hash, block->data, block->len,
+                queue->srcfd, block->srcoff);
+        if (err < 0) {
+            report_failure(writer, &block->hash);
+            store_close(&writer->store);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        if (err < 0)
+            writer->failed = 1;
+        else
+            writer->next++;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return NULL;
+}
+
+static void queue_init(struct store_queue *queue, struct store_writer *writers, size_t nwriters, int srcfd)
+{
+    size_t i;
+    int error;
+
+    memset(queue, 0, sizeof(*queue));
+    queue->writers = writers;
+    queue->nwriters = nwriters;
+    queue->srcfd = srcfd;
+
+    if ((error = pthread_mutex_init(&queue->lock, NULL)) != 0 ||
+            (error = pthread_cond_init(&queue->cond, NULL)) != 0) {
+        errno = error;
+        die_errno("Unable to initialize store writers");
+    }
+
+    for (i = 0; i < CHUNK_QUEUE_LEN; i++)
+        if ((queue->slots[i].data = malloc(BLOCK_LEN)) == NULL)
+            die_errno("Unable to allocate block");
+
+    for (i = 0; i < nwriters; i++) {
+        if (writers[i].failed)
+            continue;
+        writers[i].queue = queue;
+        if ((error = pthread_create(&writers[i].thread, NULL, write_queued_blocks, &writers[i])) != 0) {
+            errno = error;
+            die_errno("Unable to create thread");
+        }
+    }
+}
+
+/* Wait until all stores which have not failed have written count blocks. */
+static void queue_wait(struct store_queue *queue, uintmax_t count)
+{
+    size_t i;
+
+    pthread_mutex_lock(&queue->lock);
+    for (i = 0; i < queue->nwriters; i++)
+        while (!queue->writers[i].failed && queue->writers[i].next < count)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Return the next free slot, waiting for the slowest store if required. */
+static struct queued_block *queue_acquire(struct store_queue *queue)
+{
+    if (queue->head >= CHUNK_QUEUE_LEN)
+        queue_wait(queue, queue->head - CHUNK_QUEUE_LEN + 1);
+    return &queue->slots[queue->head % CHUNK_QUEUE_LEN];
+}
+
+static void queue_publish(struct store_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->head++;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * Make all queued blocks durable in all stores which have not failed
+ * yet, so that a checkpoint never covers blocks which could still be
+ * lost.
+ */
+static void queue_sync(struct store_queue *queue)
+{
+    struct store_writer *writer;
+    size_t i;
+
+    queue_wait(queue, queue->head);
+
+    for (i = 0; i < queue->nwriters; i++) {
+        writer = &queue->writers[i];
+        if (writer->failed || store_sync(&writer->store) == 0)
+            continue;
+
+        if (!writer->optional)
+            die_errno("Unable to sync store '%s'", writer->path);
+
+        warn("Unable to sync store '%s', dropping it: %s", writer->path, strerror(errno));
+        pthread_mutex_lock(&queue->lock);
+        writer->failed = 1;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+        store_close(&writer->store);
+    }
+}
+
+static void queue_finish(struct store_queue *queue)
+{
+    size_t i;
+    int error;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->done = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (i = 0; i < queue->nwriters; i++) {
+        if (!queue->writers[i].queue)
+            continue;
+        if ((error = pthread_join(queue->writers[i].thread, NULL)) != 0) {
+            errno = error;
+            die_errno("Unable to join thread");
+        }
+    }
+
+    for (i = 0; i < CHUNK_QUEUE_LEN; i++)
+        free(queue->slots[i].data);
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
+}
+
+struct chunk_slot {
+    unsigned char *data;
+    size_t len;
+    struct hash hash;
+    int done;
+};
+
+/*
+ * Blocks of seekable inputs are independent of each other, so they
+ * are read, hashed and stored by multiple workers. Workers claim
+ * blocks in order and put them into a window of slots, which are
+ * consumed in order again to compute the overall hash and index.
+ */
+struct parallel_input {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    int srcfd;
+    uintmax_t size;
+    uintmax_t nblocks, next, consumed;
+    struct chunk_slot *slots;
+    size_t nslots;
+};
+
+struct chunk_worker {
+    pthread_t thread;
+    struct parallel_input *input;
+    struct store_writer writers[CHUNK_MAX_STORES];
+    size_t nwriters;
+};
+
+static void *chunk_blocks(void *payload)
+{
+    struct chunk_worker *worker = payload;
+    struct parallel_input *input = worker->input;
+    struct chunk_slot *slot;
+    struct timespec start;
+    uintmax_t i, offset;
+    ssize_t bytes;
+    size_t len;
+
+    while (1) {
+        pthread_mutex_lock(&input->lock);
+        while (input->next < input->nblocks && input->next >= input->consumed + input->nslots)
+            pthread_cond_wait(&input->cond, &input->lock);
+        if (input->next == input->nblocks) {
+            pthread_mutex_unlock(&input->lock);
+            break;
+        }
+        i = input->next++;
+        pthread_mutex_unlock(&input->lock);
+
+        slot = &input->slots[i % input->nslots];
+        offset = i * BLOCK_LEN;
+        len = input->size - offset < BLOCK_LEN ? (size_t) (input->size - offset) : BLOCK_LEN;
+
+        throttle(THROTTLE_INPUT, len);
+        trace_start(&start);
+        if ((bytes = pread_bytes(input->fd, slot->data, len, (off_t) offset)) < 0)
+            die_errno("Unable to read block");
+        if ((size_t) bytes != len)
+            die("Input has been truncated while chunking");
+        trace_span("input-read", NULL, &start);
+        metrics_add(METRIC_INPUT_BYTES, (uintmax_t) len);
+
+        if (hash_compute(&slot->hash, slot->data, len) < 0)
+            die("Unable to hash block");
+        write_stores(worker->writers, worker->nwriters, &slot->hash, slot->data, len,
+                input->srcfd, (off_t) offset);
+
+        pthread_mutex_lock(&input->lock);
+        slot->len = len;
+        slot->done = 1;
+        pthread_cond_broadcast(&input->cond);
+        pthread_mutex_unlock(&input->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Chunk the whole input with the given number of workers, each of
+ * which writes into its own instances of the stores. Returns the
+ * number of bytes chunked.
+ */
+static uintmax_t chunk_parallel(struct hash_state *state, struct index_writer *index,
+        struct store_writer *writers, size_t nwriters, int fd, int srcfd, size_t njobs)
+{
+    struct parallel_input input;
+    struct chunk_worker *workers;
+    struct timespec start;
+    struct stat st;
+    uintmax_t i;
+    size_t j, k;
+    int error;
+
+    memset(&input, 0, sizeof(input));
+    input.fd = fd;
+    input.srcfd = srcfd;
+
+    /* The size of block devices is only reported by seeking to their end. */
+    if (fstat(fd, &st) < 0)
+        die_errno("Unable to stat input");
+    if (S_ISREG(st.st_mode))
+        input.size = (uintmax_t) st.st_size;
+    else if ((st.st_size = lseek(fd, 0, SEEK_END)) >= 0)
+        input.size = (uintmax_t) st.st_size;
+    else
+        die_errno("Unable to determine size of input");
+    input.nblocks = (input.size + BLOCK_LEN - 1) / BLOCK_LEN;
+
+    if ((error = pthread_mutex_init(&input.lock, NULL)) != 0 ||
+            (error = pthread_cond_init(&input.cond, NULL)) != 0) {
+        errno = error;
+        die_errno("Unable to initialize workers");
+    }
+
+    input.nslots = njobs * 2;
+    if ((input.slots = calloc(input.nslots, sizeof(*input.slots))) == NULL ||
+            (workers = calloc(njobs, sizeof(*workers))) == NULL)
+        die_errno("Unable to allocate workers");
+    for (j = 0; j < input.nslots; j++)
+        if ((input.slots[j].data = malloc(BLOCK_LEN)) == NULL)
+            die_errno("Unable to allocate block");
+
+    for (j = 0; j < njobs; j++) {
+        workers[j].input = &input;
+        workers[j].nwriters = nwriters;
+        for (k = 0; k < nwriters; k++) {
+            workers[j].writers[k].path = writers[k].path;
+            workers[j].writers[k].optional = writers[k].optional;
+            workers[j].writers[k].failed = writers[k].failed;
+            if (workers[j].writers[k].failed || store_open(&workers[j].writers[k].store, writers[k].path) == 0)
+                continue;
+            if (!writers[k].optional)
+                die("Unable to open store '%s'", writers[k].path);
+            warn("Unable to open store '%s', dropping it", writers[k].path);
+            workers[j].writers[k].failed = 1;
+        }
+
+        if ((error = pthread_create(&workers[j].thread, NULL, chunk_blocks, &workers[j])) != 0) {
+            errno = error;
+            die_errno("Unable to create thread");
+        }
+    }
+
+    for (i = 0; i < input.nblocks; i++) {
+        struct chunk_slot *slot = &input.slots[i % input.nslots];
+
+        trace_start(&start);
+        pthread_mutex_lock(&input.lock);
+        while (!slot->done)
+            pthread_cond_wait(&input.cond, &input.lock);
+        pthread_mutex_unlock(&input.lock);
+        trace_span("wait", &slot->hash, &start);
+
+        trace_start(&start);
+        if (hash_state_update(state, slot->data, slot->len) < 0)
+            die("Unable to update hash");
+        trace_span("hash-total", &slot->hash, &start);
+        if (index_writer_add(index, &slot->hash) < 0)
+            die_errno("Unable to write index");
+
+        pthread_mutex_lock(&input.lock);
+        slot->done = 0;
+        input.consumed++;
+        pthread_cond_broadcast(&input.cond);
+        pthread_mutex_unlock(&input.lock);
+    }
+
+    /*
+     * A store dropped by any of the workers misses some of the blocks,
+     * so our own handle of it is dropped as well.
+     */
+    for (j = 0; j < njobs; j++) {
+        if ((error = pthread_join(workers[j].thread, NULL)) != 0) {
+            errno = error;
+            die_errno("Unable to join thread");
+        }
+        for (k = 0; k < nwriters; k++) {
+            if (workers[j].writers[k].failed) {
+                if (!writers[k].failed)
+                    store_close(&writers[k].store);
+                writers[k].failed = 1;
+                continue;
+            }
+            if (store_close(&workers[j].writers[k].store) < 0)
+                die("Unable to close store '%s'", writers[k].path);
+        }
+    }
+
+    for (j = 0; j < input.nslots; j++)
+        free(input.slots[j].data);
+    free(input.slots);
+    free(workers);
+    pthread_cond_destroy(&input.cond);
+    pthread_mutex_destroy(&input.lock);
+
+    return input.size;
+}
+
+/*
+ * Skip input which has already been processed. Data read from pipes
+ * is read and discarded, as it cannot be seeked.
+ */
+static int skip_input(int fd, uintmax_t len)
+{
+    unsigned char *buf;
+    ssize_t bytes = 0;
+
+    if (lseek(fd, (off_t) len, SEEK_CUR) >= 0)
+        return 0;
+    if (errno != ESPIPE || (buf = malloc(BLOCK_LEN)) == NULL)
+        return -1;
+
+    while (len && (bytes = read_bytes(fd, buf, len < BLOCK_LEN ? (size_t) len : BLOCK_LEN)) > 0)
+        len -= (uintmax_t) bytes;
+
+    free(buf);
+
+    if (bytes < 0)
+        return -1;
+    if (len) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
 int gob_chunk(int argc, const char *argv[])
 {
-    unsigned char *block = malloc(BLOCK_LEN);
+    const unsigned char *data;
+    struct checkpoint checkpoint;
     struct hash_state state;
     struct hash hash;
-    struct store store;
-    size_t total = 0;
-    ssize_t bytes;
+    struct store_writer writers[CHUNK_MAX_STORES];
+    struct store_queue queue;
+    struct queued_block *slot;
+    struct reader reader;
+    struct index_writer index;
+    struct timespec start;
+    struct stat st;
+    const char *checkpoint_path = NULL, *input = NULL, *optional[CHUNK_MAX_STORES];
+    size_t j, total = 0, nwriters = 0, noptional = 0, njobs = 1;
+    uintmax_t blocks = 0;
+    ssize_t bytes = 0;
+    off_t offset = 0;
+    unsigned long readahead = 4, interval = CHECKPOINT_INTERVAL;
+    int i, direct = 0, resume = 0, reflink = 0, srcfd = -1, fd = STDIN_FILENO;
 
-    if (argc != 2)
-        die("USAGE: %s chunk <DIR>", argv[0]);
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--direct"))
+            direct = 1;
+        else if (!strcmp(argv[i], "--readahead") && i + 1 < argc)
+            readahead = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--limit") && i + 1 < argc) {
+            if (throttle_set(argv[++i]) < 0)
+                die("Invalid limit '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--limit-file") && i + 1 < argc) {
+            if (throttle_watch(argv[++i]) < 0)
+                die("Unable to read limits from '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            if (metrics_enable(argv[++i], "chunk") < 0)
+                die_errno("Unable to write metrics to '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            if (trace_enable(argv[++i]) < 0)
+                die_errno("Unable to write trace to '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc)
+            checkpoint_path = argv[++i];
+        else if (!strcmp(argv[i], "--checkpoint-interval") && i + 1 < argc)
+            interval = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--resume"))
+            resume = 1;
+        else if (!strcmp(argv[i], "--reflink"))
+            reflink = 1;
+        else if (!strcmp(argv[i], "--input") && i + 1 < argc)
+            input = argv[++i];
+        else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+            njobs = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--optional") && i + 1 < argc && noptional < CHUNK_MAX_STORES)
+            optional[noptional++] = argv[++i];
+        else
+            die("Unknown option '%s'", argv[i]);
+    }
+
+    if (argc - i < 1 || (size_t) (argc - i) + noptional > CHUNK_MAX_STORES ||
+            !readahead || !interval || (resume && !checkpoint_path) ||
+            !njobs || (njobs > 1 && (!input || direct || checkpoint_path)))
+        die("USAGE: %s chunk [--input <FILE> [--jobs <N>]] [--direct [--readahead <N>]] [--limit <KEY>=<RATE>]... [--limit-file <FILE>] [--metrics <FILE>] [--trace <FILE>] [--checkpoint <FILE> [--checkpoint-interval <N>] [--resume]] [--reflink] [--optional <DIR>]... <DIR>...", argv[0]);
 
     atexit(close_stdout);
 
-    if (store_open(&store, argv[1]) < 0)
-        die("Unable to open store");
+    if (input && (fd = open(input, O_RDONLY)) < 0)
+        die_errno("Unable to open input '%s'", input);
+
+    memset(writers, 0, sizeof(writers));
+    for (; i < argc; i++)
+        writers[nwriters++].path = argv[i];
+    for (j = 0; j < noptional; j++) {
+        writers[nwriters].path = optional[j];
+        writers[nwriters++].optional = 1;
+    }
+
+    for (j = 0; j < nwriters; j++) {
+        if (store_open(&writers[j].store, writers[j].path) == 0)
+            continue;
+        if (!writers[j].optional)
+            die("Unable to open store '%s'", writers[j].path);
+        warn("Unable to open store '%s', dropping it", writers[j].path);
+        writers[j].failed = 1;
+    }
+
+    if (index_writer_init(&index, STDOUT_FILENO) < 0)
+        die_errno("Unable to allocate index buffer");
 
     if (hash_state_init(&state) < 0)
         die("Unable to initialize hashing state");
 
-    while ((bytes = read_bytes(STDIN_FILENO, block, BLOCK_LEN)) > 0) {
+    /*
+     * When resuming, the index covered by the checkpoint is written
+     * again, so the index needs to be redirected into a new file.
+     */
+    if (checkpoint_path) {
+        if (checkpoint_open(&checkpoint, checkpoint_path, interval, resume) < 0)
+            die_errno("Unable to open checkpoint '%s'", checkpoint_path);
+        if (checkpoint_replay(&checkpoint, &index) < 0)
+            die_errno("Unable to replay checkpoint '%s'", checkpoint_path);
+        if (checkpoint.bytes && skip_input(fd, checkpoint.bytes) < 0)
+            die_errno("Unable to skip already chunked input");
+
+        state = checkpoint.state;
+        total = (size_t) checkpoint.bytes;
+        blocks = checkpoint.blocks;
+    }
+
+    /*
+     * Blocks can only be cloned from regular files, everything else
+     * is written as usual.
+     */
+    if (reflink && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (offset = lseek(fd, 0, SEEK_CUR)) >= 0)
+        srcfd = fd;
+
+    if (njobs > 1) {
+        total = (size_t) chunk_parallel(&state, &index, writers, nwriters, fd, srcfd, njobs);
+    } else if (direct) {
+        if (reader_init(&reader, fd, readahead, 1) < 0)
+            die_errno("Unable to set up direct input");
+        for (j = 0; j < nwriters; j++)
+            writers[j].store.drop_cache = 1;
+    }
+
+    if (njobs == 1)
+        queue_init(&queue, writers, nwriters, srcfd);
+
+    trace_start(&start);
+    while (njobs == 1) {
+        slot = queue_acquire(&queue);
+        if (!direct) {
+            bytes = read_bytes(fd, slot->data, BLOCK_LEN);
+        } else if ((bytes = reader_next(&reader, &data)) > 0) {
+            memcpy(slot->data, data, (size_t) bytes);
+            reader_release(&reader);
+        }
+        if (bytes <= 0)
+            break;
+        trace_span("input-read", NULL, &start);
+
+        throttle(THROTTLE_INPUT, (size_t) bytes);
+        metrics_add(METRIC_INPUT_BYTES, (uintmax_t) bytes);
         total += (size_t) bytes;
 
-        if (hash_state_update(&state, block, (size_t) bytes) < 0)
+        trace_start(&start);
+        if (hash_state_update(&state, slot->data, (size_t) bytes) < 0)
             die("Unable to update hash");
-        if (store_write(&hash, &store, block, (size_t) bytes) < 0)
-            die("Unable to store block");
-        puts(hash.hex);
+        trace_span("hash-total", NULL, &start);
+        if (hash_compute(&hash, slot->data, (size_t) bytes) < 0)
+            die("Unable to hash block");
+        slot->hash = hash;
+        slot->len = (size_t) bytes;
+        slot->srcoff = offset;
+        queue_publish(&queue);
+        offset += (off_t) bytes;
+        if (index_writer_add(&index, &hash) < 0)
+            die_errno("Unable to write index");
+
+        if (checkpoint_path) {
+            if (checkpoint_add(&checkpoint, &hash) < 0)
+                die_errno("Unable to write checkpoint '%s'", checkpoint_path);
+            if (++blocks % interval == 0) {
+                queue_sync(&queue);
+                if (checkpoint_write(&checkpoint, blocks, total, &state) < 0)
+                    die_errno("Unable to write checkpoint '%s'", checkpoint_path);
+            }
+        }
+
+        trace_start(&start);
     }
 
     if (bytes < 0)
         die_errno("Unable to read block");
 
+    if (njobs == 1)
+        queue_finish(&queue);
+
+    if (direct && reader_close(&reader) < 0)
+        die("Unable to shut down direct input");
+
     if (hash_state_final(&hash, &state) < 0)
         die("Unable to finalize hash");
 
-    printf(">%s %"PRIuMAX"\n", hash.hex, total);
+    if (index_writer_trailer(&index, &hash, total) < 0)
+        die_errno("Unable to write index");
+
+    for (j = 0; j < nwriters; j++) {
+        if (writers[j].failed) {
+            warn("Index is not valid for store '%s'", writers[j].path);
+            continue;
+        }
+        if (store_close(&writers[j].store) < 0)
+            die("Unable to close store '%s'", writers[j].path);
+    }
+
+    if (checkpoint_path && checkpoint_remove(&checkpoint) < 0)
+        die_errno("Unable to remove checkpoint '%s'", checkpoint_path);
 
-    if (store_close(&store) < 0)
-        die("Unable to close store");
+    if (input && try_close(fd) < 0)
+        die_errno("Unable to close input '%s'", input);
 
-    free(block);
+    index_writer_free(&index);
 
     return 0;
 }
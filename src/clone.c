@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* copy_file_range() is not part of POSIX. */
+#define _GNU_SOURCE
+
+#include "common.h"
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#ifdef HAVE_FICLONERANGE
+# include <linux/fs.h>
+#endif
+
+/*
+ * Fill the empty file dst with len bytes of src starting at the given
+ * offset without copying them through userspace. Copy-on-write
+ * filesystems share the extents via FICLONERANGE, which requires the
+ * range to be aligned to the filesystem block size unless it ends at
+ * the end of src. Otherwise, copy_file_range() lets the kernel copy
+ * the data, which may still clone it.
+ */
+int clone_range(int dst, int src, off_t offset, size_t len)
+{
+#ifdef HAVE_FICLONERANGE
+    struct file_clone_range range;
+
+    range.src_fd = src;
+    range.src_offset = (uint64_t) offset;
+    range.src_length = (uint64_t) len;
+    range.dest_offset = 0;
+
+    if (ioctl(dst, FICLONERANGE, &range) == 0)
+        return 0;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    {
+        loff_t in = (loff_t) offset, out = 0;
+
+        while (len) {
+            ssize_t bytes = copy_file_range(src, &in, dst, &out, len, 0);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes < 0)
+                return -1;
+            if (bytes == 0) {
+                /* The input has been truncated since reading it. */
+                errno = EINVAL;
+                return -1;
+            }
+            len -= (size_t) bytes;
+        }
+
+        return 0;
+    }
+#else
+    (void) dst;
+    (void) src;
+    (void) offset;
+    (void) len;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
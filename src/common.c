@@ -31,6 +31,8 @@ void die(const char *fmt, ...)
 {
     va_list ap;
 
+    metrics_add(METRIC_ERRORS, 1);
+
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
     va_end(ap);
@@ -43,6 +45,8 @@ void die_errno(const char *fmt, ...)
 {
     va_list ap;
 
+    metrics_add(METRIC_ERRORS, 1);
+
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
     va_end(ap);
@@ -55,12 +59,39 @@ void warn(const char *fmt, ...)
 {
     va_list ap;
 
+    metrics_add(METRIC_ERRORS, 1);
+
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
     va_end(ap);
     putc('\n', stderr);
 }
 
+int parse_size(size_t *out, const char *str)
+{
+    unsigned long value;
+    unsigned shift = 0;
+    char *end;
+
+    errno = 0;
+    value = strtoul(str, &end, 10);
+    if (errno || end == str || *str == '-')
+        return -1;
+
+    switch (*end) {
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+        default: break;
+    }
+
+    if (*end || value > (SIZE_MAX >> shift))
+        return -1;
+
+    *out = (size_t) value << shift;
+    return 0;
+}
+
 int try_close(int fd)
 {
   int error;
@@ -132,64 +163,59 @@ int write_bytes(int fd, const unsigned char *buf, size_t buflen)
     return 0;
 }
 
-static char to_hex[] = "0123456789abcdef";
+ssize_t pread_bytes(int fd, unsigned char *buf, size_t buflen, off_t offset)
+{
+    size_t total = 0;
+
+    while (total != buflen) {
+        ssize_t bytes = pread(fd, buf + total, buflen - total, offset + (off_t) total);
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (bytes < 0)
+            return -1;
+        if (bytes == 0)
+            break;
+        total += (size_t) bytes;
+    }
+
+    return (ssize_t) total;
+}
 
-int hash_from_bin(struct hash *out, const unsigned char *data, size_t len)
+int pwrite_bytes(int fd, const unsigned char *buf, size_t buflen, off_t offset)
 {
-    size_t i;
-    char *p = &out->hex[0];
+    size_t total = 0;
 
+    while (total != buflen) {
+        ssize_t bytes = pwrite(fd, buf + total, buflen - total, offset + (off_t) total);
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (bytes <= 0)
+            return -1;
+        total += (size_t) bytes;
+    }
+
+    return 0;
+}
+
+int hash_from_bin(struct hash *out, const unsigned char *data, size_t len)
+{
     if (len != HASH_LEN)
         return -1;
 
     memcpy(&out->bin[0], data, len);
-
-    for (i = 0; i < HASH_LEN; i++) {
-        *p++ = to_hex[((unsigned int) out->bin[i]) >> 4];
-        *p++ = to_hex[((unsigned int) out->bin[i]) & 0xf];
-    }
-    *p = '\0';
+    hex_encode(&out->hex[0], &out->bin[0], HASH_LEN);
+    out->hex[HASH_LEN * 2] = '\0';
 
     return 0;
 }
 
-static signed char from_hex[] = {
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 00 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 10 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 20 */
-    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1, /* 30 */
-    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 40 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 50 */
-    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 60 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 70 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 80 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 90 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* a0 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* b0 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* c0 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* d0 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* e0 */
-    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* f0 */
-};
-
 int hash_from_str(struct hash *out, const char *str, size_t len)
 {
-    size_t i;
-
-    if (len != HASH_LEN * 2)
+    if (len != HASH_LEN * 2 || hex_decode(&out->bin[0], str, len) < 0)
         return -1;
 
-    memset(out, 0, sizeof(*out));
-
-    for (i = 0; i < len; i++) {
-        signed char c = from_hex[(unsigned char) str[i]];
-        if (c < 0)
-            return -1;
-        out->bin[i / 2] |= (unsigned char)(c << (i % 2 ? 0 : 4));
-    }
-
-    memset(&out->hex[0], 0, sizeof(out->hex));
-    strncpy(&out->hex[0], str, len);
+    memcpy(&out->hex[0], str, len);
+    out->hex[HASH_LEN * 2] = '\0';
 
     return 0;
 }
@@ -202,11 +228,15 @@ int hash_eq(const struct hash *a, const struct hash *b)
 int hash_compute(struct hash *out, const unsigned char *data, size_t len)
 {
     struct hash_state state;
+    struct timespec start;
 
+    trace_start(&start);
     if (hash_state_init(&state) < 0 ||
             hash_state_update(&state, data, len) < 0 ||
             hash_state_final(out, &state) < 0)
         return -1;
+    trace_span("hash", out, &start);
+
     return 0;
 }
 
@@ -219,8 +249,13 @@ int hash_state_init(struct hash_state *state)
 
 int hash_state_update(struct hash_state *state, const unsigned char *data, size_t len)
 {
+    struct timespec start;
+
+    metrics_start(&start);
     if (blake2b_update(&state->state, data, len) < 0)
         return -1;
+    metrics_observe(METRIC_HASH, &start);
+
     return 0;
 }
 
@@ -232,164 +267,1552 @@ int hash_state_final(struct hash *out, struct hash_state *state)
     return hash_from_bin(out, hash, sizeof(hash));
 }
 
-int store_init(const char *path)
+static void encode_u64(unsigned char *out, uint64_t value)
 {
-    int storefd, versionfd;
-    uint32_t version;
-    struct stat st;
+    size_t i;
+    for (i = 0; i < 8; i++)
+        out[i] = (unsigned char) (value >> (56 - i * 8));
+}
 
-    if ((stat(path, &st)) == 0)
-        die("Path exists already: %s", path);
+static uint64_t decode_u64(const unsigned char *in)
+{
+    uint64_t value = 0;
+    size_t i;
+    for (i = 0; i < 8; i++)
+        value = (value << 8) | in[i];
+    return value;
+}
 
-    if (mkdir(path, 0777) < 0 || (storefd = open(path, O_RDONLY)) < 0)
-        die_errno("Cannot create store directory: %s", path);
+/*
+ * Serialize the hashing state into HASH_STATE_LEN bytes, so that
+ * hashing can be continued by another process.
+ */
+void hash_state_save(unsigned char *out, const struct hash_state *state)
+{
+    const blake2b_state *s = &state->state;
+    size_t i;
 
-    if ((versionfd = openat(storefd, BLOCK_STORE_VERSION_FILE, O_CREAT|O_EXCL|O_WRONLY, 0666)) < 0)
-        die_errno("Unable to initialize store version");
+    for (i = 0; i < 8; i++)
+        encode_u64(out + i * 8, s->h[i]);
+    for (i = 0; i < 2; i++) {
+        encode_u64(out + 64 + i * 8, s->t[i]);
+        encode_u64(out + 80 + i * 8, s->f[i]);
+    }
+    memcpy(out + 96, s->buf, BLAKE2B_BLOCKBYTES);
+    encode_u64(out + 224, (uint64_t) s->buflen);
+    encode_u64(out + 232, (uint64_t) s->outlen);
+    out[240] = s->last_node;
+}
 
-    version = htonl(BLOCK_STORE_VERSION);
+int hash_state_load(struct hash_state *state, const unsigned char *in)
+{
+    blake2b_state *s = &state->state;
+    size_t i;
 
-    if (write_bytes(versionfd, (unsigned char *) &version, sizeof(version)) < 0)
-        die_errno("Unable to write store version");
+    if (decode_u64(in + 224) > BLAKE2B_BLOCKBYTES || decode_u64(in + 232) != HASH_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    if (try_close(versionfd) < 0 || try_close(storefd) < 0)
-        die_errno("Unable to finalize creation");
+    for (i = 0; i < 8; i++)
+        s->h[i] = decode_u64(in + i * 8);
+    for (i = 0; i < 2; i++) {
+        s->t[i] = decode_u64(in + 64 + i * 8);
+        s->f[i] = decode_u64(in + 80 + i * 8);
+    }
+    memcpy(s->buf, in + 96, BLAKE2B_BLOCKBYTES);
+    s->buflen = (size_t) decode_u64(in + 224);
+    s->outlen = (size_t) decode_u64(in + 232);
+    s->last_node = in[240];
 
     return 0;
 }
 
-int store_open(struct store *out, const char *path)
+void store_config_init(struct store_config *config)
 {
-    struct stat st;
-    int i, storefd, versionfd;
-    uint32_t version;
+    config->shard_depth = 1;
+    config->shard_width = 2;
+    config->reshard_depth = 0;
+    config->reshard_width = 0;
+    config->cache[0] = '\0';
+    config->cache_size = 0;
+    config->delta_depth = 0;
+    strcpy(config->backend, "files");
+}
+
+static int parse_unsigned(unsigned *out, const char *value)
+{
+    unsigned long result;
+    char *end;
+
+    errno = 0;
+    result = strtoul(value, &end, 10);
+    if (errno || end == value || *end || result > UINT_MAX)
+        return -1;
 
-    if ((storefd = open(path, O_RDONLY)) < 0)
-        die_errno("Unable to open storage '%s'", path);
+    *out = (unsigned) result;
+    return 0;
+}
 
-    if (fstat(storefd, &st) < 0 || !S_ISDIR(st.st_mode))
-        die("Storage is not a directory");
+int store_config_validate(const struct store_config *config)
+{
+    if (config->shard_width < 1 || config->shard_width > 4 ||
+            config->shard_depth < 1 || config->shard_depth > 4 ||
+            config->shard_depth * config->shard_width > 8)
+        return -1;
+    if ((config->reshard_depth || config->reshard_width) &&
+            (config->reshard_width < 1 || config->reshard_width > 4 ||
+             config->reshard_depth < 1 || config->reshard_depth > 4 ||
+             config->reshard_depth * config->reshard_width > 8))
+        return -1;
+    if (config->delta_depth > DELTA_MAX_DEPTH)
+        return -1;
+    if (store_backend_find(config->backend) == NULL)
+        return -1;
+    return 0;
+}
 
-    if ((versionfd = openat(storefd, BLOCK_STORE_VERSION_FILE, O_RDONLY)) < 0)
-        die_errno("Could not open store's version file");
+int store_config_read(struct store_config *out, int storefd)
+{
+    char *line = NULL, *key, *value, *end;
+    size_t n = 0;
+    ssize_t linelen;
+    FILE *f;
+    int fd;
 
-    if (read_bytes(versionfd, (unsigned char *) &version, sizeof(version)) != sizeof(version))
-        die_errno("Unable to read store version");
+    store_config_init(out);
 
-    version = ntohl(version);
-    if (version != BLOCK_STORE_VERSION)
-        die_errno("Unable to open block store with version %"PRIu32, version);
+    if ((fd = openat(storefd, BLOCK_STORE_CONFIG_FILE, O_RDONLY)) < 0)
+        return errno == ENOENT ? 0 : -1;
 
-    if (try_close(versionfd) < 0)
-        die_errno("Unable to close block's version file");
+    if ((f = fdopen(fd, "r")) == NULL) {
+        try_close(fd);
+        return -1;
+    }
 
-    out->fd = storefd;
-    for (i = 0; i < 256; i++)
-        out->shardfds[i] = -1;
+    /*
+     * The configuration consists of "key = value" lines. Unknown keys
+     * are rejected so that we never write to a store whose layout we
+     * do not fully understand.
+     */
+    while ((linelen = getline(&line, &n, f)) > 0) {
+        if (line[linelen - 1] == '\n')
+            line[--linelen] = '\0';
+
+        for (key = line; *key == ' '; key++);
+        if (*key == '\0' || *key == '#')
+            continue;
 
+        if ((value = strchr(key, '=')) == NULL) {
+            warn("Invalid configuration line '%s'", line);
+            goto err;
+        }
+
+        for (end = value; end > key && end[-1] == ' '; end--);
+        *end = '\0';
+        for (value++; *value == ' '; value++);
+
+        if (!strcmp(key, "shard-depth")) {
+            if (parse_unsigned(&out->shard_depth, value) < 0)
+                goto invalid;
+        } else if (!strcmp(key, "shard-width")) {
+            if (parse_unsigned(&out->shard_width, value) < 0)
+                goto invalid;
+        } else if (!strcmp(key, "reshard-from-depth")) {
+            if (parse_unsigned(&out->reshard_depth, value) < 0)
+                goto invalid;
+        } else if (!strcmp(key, "reshard-from-width")) {
+            if (parse_unsigned(&out->reshard_width, value) < 0)
+                goto invalid;
+        } else if (!strcmp(key, "cache")) {
+            if (!*value || strlen(value) >= sizeof(out->cache))
+                goto invalid;
+            strcpy(out->cache, value);
+        } else if (!strcmp(key, "cache-size")) {
+            if (parse_size(&out->cache_size, value) < 0)
+                goto invalid;
+        } else if (!strcmp(key, "delta-depth")) {
+            if (parse_unsigned(&out->delta_depth, value) < 0)
+                goto invalid;
+        } else if (!strcmp(key, "backend")) {
+            if (strlen(value) >= sizeof(out->backend) || store_backend_find(value) == NULL)
+                goto invalid;
+            strcpy(out->backend, value);
+        } else {
+            warn("Unknown configuration key '%s'", key);
+            goto err;
+        }
+
+        continue;
+invalid:
+        warn("Invalid value '%s' for configuration key '%s'", value, key);
+        goto err;
+    }
+
+    if (ferror(f) || store_config_validate(out) < 0)
+        goto err;
+
+    free(line);
+    fclose(f);
     return 0;
+
+err:
+    free(line);
+    fclose(f);
+    return -1;
 }
 
-int store_close(struct store *store)
+int store_config_write(int storefd, const struct store_config *config)
 {
-    int i;
+    char buf[STORE_CACHE_PATH_MAX + 256];
+    int fd, len;
 
-    if (try_close(store->fd) < 0)
+    if (store_config_validate(config) < 0)
         return -1;
 
-    for (i = 0; i < 256; i++)
-        if (store->shardfds[i] >= 0 && try_close(store->shardfds[i]) < 0)
-            return -1;
+    len = snprintf(buf, sizeof(buf),
+            "shard-depth = %u\n"
+            "shard-width = %u\n",
+            config->shard_depth, config->shard_width);
+    if (len >= 0 && config->reshard_depth)
+        len += snprintf(buf + len, sizeof(buf) - (size_t) len,
+                "reshard-from-depth = %u\n"
+                "reshard-from-width = %u\n",
+                config->reshard_depth, config->reshard_width);
+    if (len >= 0 && config->cache[0])
+        len += snprintf(buf + len, sizeof(buf) - (size_t) len,
+                "cache = %s\n"
+                "cache-size = %lu\n",
+                config->cache, (unsigned long) config->cache_size);
+    if (len >= 0 && config->delta_depth)
+        len += snprintf(buf + len, sizeof(buf) - (size_t) len,
+                "delta-depth = %u\n", config->delta_depth);
+    if (len >= 0 && strcmp(config->backend, "files"))
+        len += snprintf(buf + len, sizeof(buf) - (size_t) len,
+                "backend = %s\n", config->backend);
+    if (len < 0 || (size_t) len >= sizeof(buf))
+        return -1;
+
+    if ((fd = openat(storefd, BLOCK_STORE_CONFIG_FILE ".tmp", O_CREAT|O_TRUNC|O_WRONLY, 0666)) < 0)
+        return -1;
+
+    if (write_bytes(fd, (unsigned char *) buf, (size_t) len) < 0 || fsync(fd) < 0) {
+        try_close(fd);
+        unlinkat(storefd, BLOCK_STORE_CONFIG_FILE ".tmp", 0);
+        return -1;
+    }
+
+    if (try_close(fd) < 0 ||
+            renameat(storefd, BLOCK_STORE_CONFIG_FILE ".tmp", storefd, BLOCK_STORE_CONFIG_FILE) < 0) {
+        unlinkat(storefd, BLOCK_STORE_CONFIG_FILE ".tmp", 0);
+        return -1;
+    }
 
     return 0;
 }
 
-static int open_shard(struct store *store, const struct hash *hash, int create)
+/*
+ * The catalog starts with a header consisting of a magic, the
+ * format version, the record length and the number of records which
+ * have been sorted by the last compaction. Records consist of the
+ * block's hash, its size and its location and are appended in the
+ * order blocks are written.
+ */
+static void catalog_encode_header(unsigned char *out, uint64_t sorted)
 {
-    struct stat st;
-    char shard[3];
-    int shardfd;
+    uint32_t version = htonl(CATALOG_VERSION), reclen = htonl(CATALOG_RECORD_LEN);
+    uint32_t hi = htonl((uint32_t) (sorted >> 32)), lo = htonl((uint32_t) sorted);
+
+    memcpy(out, CATALOG_MAGIC, 8);
+    memcpy(out + 8, &version, 4);
+    memcpy(out + 12, &reclen, 4);
+    memcpy(out + 16, &hi, 4);
+    memcpy(out + 20, &lo, 4);
+}
 
-    if ((shardfd = store->shardfds[hash->bin[0]]) >= 0)
-        return shardfd;
+static int catalog_decode_header(uint64_t *sorted, const unsigned char *in)
+{
+    uint32_t version, reclen, hi, lo;
 
-    shard[0] = hash->hex[0];
-    shard[1] = hash->hex[1];
-    shard[2] = '\0';
+    memcpy(&version, in + 8, 4);
+    memcpy(&reclen, in + 12, 4);
+    memcpy(&hi, in + 16, 4);
+    memcpy(&lo, in + 20, 4);
 
-    if ((shardfd = openat(store->fd, shard, O_RDONLY)) >= 0) {
-        if (fstat(shardfd, &st) < 0 || !S_ISDIR(st.st_mode))
-            die("Shard is not a directory");
-        goto out;
+    if (memcmp(in, CATALOG_MAGIC, 8) || ntohl(version) != CATALOG_VERSION ||
+            ntohl(reclen) != CATALOG_RECORD_LEN) {
+        errno = EINVAL;
+        return -1;
     }
 
-    if (!create)
-        die_errno("Unable to open sharding directory '%s'", shard);
+    *sorted = ((uint64_t) ntohl(hi) << 32) | ntohl(lo);
+    return 0;
+}
 
-    if (mkdirat(store->fd, shard, 0755) < 0)
-        die_errno("Unable to create sharding directory '%s'", shard);
-    if ((shardfd = openat(store->fd, shard, O_RDONLY)) < 0)
-        die_errno("Unable to open sharding directory '%s'", shard);
+static void catalog_encode(unsigned char *out, const struct catalog_entry *entry)
+{
+    uint32_t size = htonl(entry->size), location = htonl(entry->location);
 
-out:
-    store->shardfds[hash->bin[0]] = shardfd;
-    return shardfd;
+    memcpy(out, entry->hash, HASH_LEN);
+    memcpy(out + HASH_LEN, &size, 4);
+    memcpy(out + HASH_LEN + 4, &location, 4);
 }
 
-int store_write(struct hash *out, struct store *store, const unsigned char *data, size_t datalen)
+static void catalog_decode(struct catalog_entry *out, const unsigned char *in)
 {
-    struct hash hash;
-    int fd, shardfd;
-    char name[sizeof(hash.hex) + 5];
+    uint32_t size, location;
 
-    if (hash_compute(&hash, data, datalen) < 0)
-        die("Unable to hash block");
+    memcpy(out->hash, in, HASH_LEN);
+    memcpy(&size, in + HASH_LEN, 4);
+    memcpy(&location, in + HASH_LEN + 4, 4);
+    out->size = ntohl(size);
+    out->location = ntohl(location);
+}
+
+/*
+ * Appending processes hold a shared lock on the catalog, while
+ * compaction takes an exclusive lock and then atomically replaces
+ * the catalog. Processes which were waiting for the lock thus need
+ * to check whether they have locked the current catalog.
+ */
+static int catalog_lock(int fd, short type)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+
+    while (fcntl(fd, F_SETLKW, &lock) < 0)
+        if (errno != EINTR)
+            return -1;
+
+    return 0;
+}
 
-    if (snprintf(name, sizeof(name), "%s.tmp", hash.hex + 2) < 0)
-        die("Unable to compute block name");
+static int catalog_lock_current(struct store *store, short type)
+{
+    struct stat a, b;
+
+    while (1) {
+        if (catalog_lock(store->catalogfd, type) < 0 || fstat(store->catalogfd, &a) < 0 ||
+                fstatat(store->fd, BLOCK_STORE_CATALOG_FILE, &b, 0) < 0)
+            return -1;
 
-    if ((shardfd = open_shard(store, &hash, 1)) < 0)
-        die("Unable to open shard");
+        if (a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+            return 0;
 
-    if ((fd = openat(shardfd, name, O_CREAT|O_EXCL|O_WRONLY, 0644)) < 0) {
-        if (errno == EEXIST)
-            goto out;
-        die_errno("Unable to create block '%s'", hash.hex);
+        close(store->catalogfd);
+        if ((store->catalogfd = openat(store->fd, BLOCK_STORE_CATALOG_FILE, O_RDWR|O_APPEND)) < 0)
+            return -1;
     }
+}
 
-    if (write_bytes(fd, data, datalen) < 0 || try_close(fd) < 0) {
-        unlinkat(shardfd, name, 0);
-        die_errno("Unable to write block '%s'", hash.hex);
+static int catalog_append(struct store *store, const struct hash *hash, size_t len)
+{
+    unsigned char record[CATALOG_RECORD_LEN];
+    struct catalog_entry entry;
+    int err;
+
+    if (store->catalogfd < 0)
+        return 0;
+
+    memcpy(entry.hash, hash->bin, HASH_LEN);
+    entry.size = (uint32_t) len;
+    entry.location = CATALOG_LOCATION_LOOSE;
+    catalog_encode(record, &entry);
+
+    if (catalog_lock_current(store, F_RDLCK) < 0)
+        return -1;
+    err = write_bytes(store->catalogfd, record, sizeof(record));
+    if (catalog_lock(store->catalogfd, F_UNLCK) < 0)
+        err = -1;
+
+    store->catalog_appended = 1;
+
+    return err;
+}
+
+static int catalog_entry_cmp(const void *a, const void *b)
+{
+    const struct catalog_entry *x = a, *y = b;
+    int cmp = memcmp(x->hash, y->hash, HASH_LEN);
+    if (cmp)
+        return cmp;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Sort entries by hash and drop duplicates, where later entries win. */
+static void catalog_sort(struct catalog_entry *entries, size_t *nentries)
+{
+    size_t i, n = 0;
+
+    qsort(entries, *nentries, sizeof(*entries), catalog_entry_cmp);
+
+    for (i = 0; i < *nentries; i++) {
+        if (i + 1 < *nentries && !memcmp(entries[i].hash, entries[i + 1].hash, HASH_LEN))
+            continue;
+        entries[n++] = entries[i];
     }
 
-    if (renameat(shardfd, name, shardfd, hash.hex + 2) < 0) {
-        unlinkat(shardfd, name, 0);
-        die_errno("Unable to move temporary block '%s'", hash.hex);
+    *nentries = n;
+}
+
+int store_catalog_read(struct catalog_entry **out, size_t *nout, const struct store *store)
+{
+    unsigned char *buf;
+    struct catalog_entry *entries = NULL;
+    size_t i, n = 0, alloc = 0;
+    uint64_t sorted;
+    off_t offset = CATALOG_HEADER_LEN;
+    ssize_t bytes;
+
+    if (store->catalogfd < 0) {
+        errno = ENOENT;
+        return -1;
     }
 
-out:
-    if (out)
-        memcpy(out, &hash, sizeof(*out));
+    if ((buf = malloc(INDEX_BUFFER_LEN)) == NULL)
+        return -1;
+
+    if (pread_bytes(store->catalogfd, buf, CATALOG_HEADER_LEN, 0) != CATALOG_HEADER_LEN ||
+            catalog_decode_header(&sorted, buf) < 0)
+        goto err;
+
+    /* A trailing partial record can only be caused by a concurrent append. */
+    while ((bytes = pread_bytes(store->catalogfd, buf, INDEX_BUFFER_LEN, offset)) >= CATALOG_RECORD_LEN) {
+        size_t records = (size_t) bytes / CATALOG_RECORD_LEN;
+
+        if (n + records > alloc) {
+            struct catalog_entry *tmp;
+            alloc = alloc ? alloc * 2 : 4096;
+            if (alloc < n + records)
+                alloc = n + records;
+            if ((tmp = realloc(entries, alloc * sizeof(*entries))) == NULL)
+                goto err;
+            entries = tmp;
+        }
+
+        for (i = 0; i < records; i++) {
+            catalog_decode(&entries[n], buf + i * CATALOG_RECORD_LEN);
+            entries[n].seq = n;
+            n++;
+        }
+
+        offset += (off_t) (records * CATALOG_RECORD_LEN);
+    }
+    if (bytes < 0)
+        goto err;
 
+    catalog_sort(entries, &n);
+
+    free(buf);
+    *out = entries;
+    *nout = n;
     return 0;
+
+err:
+    free(buf);
+    free(entries);
+    return -1;
 }
 
-ssize_t store_read(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash)
+static int catalog_write(int storefd, const struct catalog_entry *entries, size_t n)
 {
-    int fd, shardfd;
-    ssize_t len;
+    unsigned char *buf;
+    size_t i, len;
+    int fd;
 
-    if ((shardfd = open_shard(store, hash, 0)) < 0)
-        die("Unable to open shard");
+    if ((buf = malloc(INDEX_BUFFER_LEN)) == NULL)
+        return -1;
+
+    if ((fd = openat(storefd, BLOCK_STORE_CATALOG_FILE ".tmp", O_CREAT|O_TRUNC|O_WRONLY, 0644)) < 0) {
+        free(buf);
+        return -1;
+    }
 
-    if ((fd = openat(shardfd, hash->hex + 2, O_RDONLY)) < 0)
-        die_errno("Unable to open block '%s'", hash->hex);
+    catalog_encode_header(buf, n);
+    len = CATALOG_HEADER_LEN;
+
+    for (i = 0; i < n; i++) {
+        if (len + CATALOG_RECORD_LEN > INDEX_BUFFER_LEN) {
+            if (write_bytes(fd, buf, len) < 0)
+                goto err;
+            len = 0;
+        }
+        catalog_encode(buf + len, &entries[i]);
+        len += CATALOG_RECORD_LEN;
+    }
 
-    if ((len = read_bytes(fd, out, outlen)) < 0)
-        die_errno("Unable to read block '%s'", hash->hex);
+    if (write_bytes(fd, buf, len) < 0 || fsync(fd) < 0)
+        goto err;
 
+    free(buf);
     if (try_close(fd) < 0)
-        die_errno("Unable to close block '%s'", hash->hex);
+        return -1;
 
-    return len;
+    return renameat(storefd, BLOCK_STORE_CATALOG_FILE ".tmp", storefd, BLOCK_STORE_CATALOG_FILE);
+
+err:
+    free(buf);
+    close(fd);
+    unlinkat(storefd, BLOCK_STORE_CATALOG_FILE ".tmp", 0);
+    return -1;
+}
+
+int store_catalog_lock(struct store *store)
+{
+    if (store->catalogfd < 0) {
+        if (catalog_write(store->fd, NULL, 0) < 0 ||
+                (store->catalogfd = openat(store->fd, BLOCK_STORE_CATALOG_FILE, O_RDWR|O_APPEND)) < 0)
+            return -1;
+    }
+
+    return catalog_lock_current(store, F_WRLCK);
+}
+
+/*
+ * Replace the catalog with the given entries. The caller needs to
+ * hold the catalog lock, which gets released by closing the old
+ * catalog.
+ */
+int store_catalog_replace(struct store *store, const struct catalog_entry *entries, size_t n)
+{
+    if (catalog_write(store->fd, entries, n) < 0)
+        return -1;
+
+    close(store->catalogfd);
+    if ((store->catalogfd = openat(store->fd, BLOCK_STORE_CATALOG_FILE, O_RDWR|O_APPEND)) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Record the given entries in the catalog, replacing existing entries
+ * for the same blocks, e.g. when blocks have been moved into a pack.
+ */
+int store_catalog_update(struct store *store, struct catalog_entry *entries, size_t n)
+{
+    struct catalog_entry *all, *tmp;
+    size_t i, nall;
+    int err;
+
+    if (store_catalog_lock(store) < 0 || store_catalog_read(&all, &nall, store) < 0)
+        return -1;
+
+    if ((tmp = realloc(all, (nall + n) * sizeof(*all) + 1)) == NULL) {
+        free(all);
+        return -1;
+    }
+    all = tmp;
+
+    for (i = 0; i < n; i++) {
+        all[nall] = entries[i];
+        all[nall].seq = nall;
+        nall++;
+    }
+    catalog_sort(all, &nall);
+
+    err = store_catalog_replace(store, all, nall);
+    free(all);
+
+    return err;
+}
+
+int store_catalog_compact(struct store *store)
+{
+    struct catalog_entry *entries;
+    size_t n;
+    int err;
+
+    if (store_catalog_lock(store) < 0 || store_catalog_read(&entries, &n, store) < 0)
+        return -1;
+
+    err = store_catalog_replace(store, entries, n);
+    free(entries);
+
+    return err;
+}
+
+/*
+ * Compact the catalog once the number of appended records exceeds
+ * the number of records sorted by the last compaction, so that the
+ * cost of compaction is amortized over the appended records.
+ */
+static int catalog_maybe_compact(struct store *store)
+{
+    unsigned char header[CATALOG_HEADER_LEN];
+    uint64_t sorted, records;
+    struct stat st;
+
+    if (store->catalogfd < 0 || !store->catalog_appended)
+        return 0;
+
+    if (fstat(store->catalogfd, &st) < 0 ||
+            pread_bytes(store->catalogfd, header, sizeof(header), 0) != sizeof(header) ||
+            catalog_decode_header(&sorted, header) < 0)
+        return -1;
+
+    records = ((uint64_t) st.st_size - CATALOG_HEADER_LEN) / CATALOG_RECORD_LEN;
+    if (records < sorted || records - sorted < CATALOG_COMPACT_MIN || records - sorted < sorted)
+        return 0;
+
+    return store_catalog_compact(store);
+}
+
+int store_init(const char *path, const struct store_config *config)
+{
+    int storefd, versionfd;
+    uint32_t version;
+    struct stat st;
+
+    if ((stat(path, &st)) == 0)
+        die("Path exists already: %s", path);
+
+    if (store_config_validate(config) < 0)
+        die("Invalid store configuration");
+
+    if (mkdir(path, 0777) < 0 || (storefd = open(path, O_RDONLY)) < 0)
+        die_errno("Cannot create store directory: %s", path);
+
+    if (store_config_write(storefd, config) < 0)
+        die_errno("Unable to write store configuration");
+
+    if (catalog_write(storefd, NULL, 0) < 0)
+        die_errno("Unable to initialize catalog");
+
+    if ((versionfd = openat(storefd, BLOCK_STORE_VERSION_FILE, O_CREAT|O_EXCL|O_WRONLY, 0666)) < 0)
+        die_errno("Unable to initialize store version");
+
+    version = htonl(BLOCK_STORE_VERSION);
+
+    if (write_bytes(versionfd, (unsigned char *) &version, sizeof(version)) < 0)
+        die_errno("Unable to write store version");
+
+    if (try_close(versionfd) < 0 || try_close(storefd) < 0)
+        die_errno("Unable to finalize creation");
+
+    return 0;
+}
+
+/*
+ * Opening a store reports errors instead of dying so that it can be
+ * used by libgob, too.
+ */
+static int open_store(struct store *out, const char *path, int resharding, int nested)
+{
+    struct stat st;
+    int i, storefd, versionfd = -1;
+    uint32_t version;
+    char *cachepath;
+
+    if ((storefd = open(path, O_RDONLY)) < 0) {
+        warn("Unable to open storage '%s': %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(storefd, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        warn("Storage is not a directory");
+        goto err;
+    }
+
+    if ((versionfd = openat(storefd, BLOCK_STORE_VERSION_FILE, O_RDONLY)) < 0 ||
+            read_bytes(versionfd, (unsigned char *) &version, sizeof(version)) != sizeof(version)) {
+        warn("Unable to read store version: %s", strerror(errno));
+        goto err;
+    }
+
+    /*
+     * Version 1 stores predate the configuration file and always use
+     * the default sharding layout, which is what we get when reading
+     * the configuration of a store without one.
+     */
+    version = ntohl(version);
+    if (version < 1 || version > BLOCK_STORE_VERSION) {
+        warn("Unable to open block store with version %"PRIu32, version);
+        goto err;
+    }
+
+    if (try_close(versionfd) < 0) {
+        versionfd = -1;
+        goto err;
+    }
+    versionfd = -1;
+
+    if (store_config_read(&out->config, storefd) < 0) {
+        warn("Unable to read store configuration");
+        goto err;
+    }
+
+    if (out->config.reshard_depth && !resharding) {
+        warn("Store is being resharded, rerun gob-reshard(1) to finish");
+        goto err;
+    }
+
+    /* Stores created by older versions may not have a catalog. */
+    if ((out->catalogfd = openat(storefd, BLOCK_STORE_CATALOG_FILE, O_RDWR|O_APPEND)) < 0 &&
+            (errno == EACCES || errno == EROFS))
+        out->catalogfd = openat(storefd, BLOCK_STORE_CATALOG_FILE, O_RDONLY);
+    if (out->catalogfd < 0 && errno != ENOENT) {
+        warn("Unable to open catalog: %s", strerror(errno));
+        goto err;
+    }
+
+    out->backend = store_backend_find(out->config.backend);
+    out->backend_data = NULL;
+    out->fd = storefd;
+    out->drop_cache = 0;
+    out->noclone = 0;
+    out->tmpcounter = 0;
+    out->catalog_appended = 0;
+    out->cache = NULL;
+    out->cache_written = 0;
+    out->packs = NULL;
+    out->npacks = 0;
+    out->packs_loaded = 0;
+    memset(&out->sketches, 0, sizeof(out->sketches));
+    for (i = 0; i < STORE_SHARD_CACHE; i++)
+        out->shardfds[i] = -1;
+
+    if (out->backend->open && out->backend->open(out) < 0) {
+        warn("Unable to open %s backend: %s", out->backend->name, strerror(errno));
+        if (out->catalogfd >= 0)
+            close(out->catalogfd);
+        goto err;
+    }
+
+    /*
+     * The cache store only holds copies of blocks, so the store stays
+     * usable without it, e.g. when the device backing it has failed.
+     * Relative paths are interpreted relative to the store.
+     */
+    if (out->config.cache[0] && !resharding && !nested) {
+        if ((cachepath = malloc(strlen(path) + strlen(out->config.cache) + 2)) == NULL ||
+                (out->cache = malloc(sizeof(*out->cache))) == NULL)
+            die_errno("Unable to allocate cache store");
+
+        if (out->config.cache[0] == '/')
+            strcpy(cachepath, out->config.cache);
+        else
+            sprintf(cachepath, "%s/%s", path, out->config.cache);
+
+        if (open_store(out->cache, cachepath, 0, 1) < 0) {
+            warn("Unable to open cache store '%s', continuing without it", cachepath);
+            free(out->cache);
+            out->cache = NULL;
+        } else if (out->cache->backend != &files_backend) {
+            warn("Cache store '%s' does not use the files backend, continuing without it", cachepath);
+            store_close(out->cache);
+            free(out->cache);
+            out->cache = NULL;
+        }
+
+        free(cachepath);
+    }
+
+    return 0;
+
+err:
+    if (versionfd >= 0)
+        close(versionfd);
+    close(storefd);
+    return -1;
+}
+
+int store_open(struct store *out, const char *path)
+{
+    return open_store(out, path, 0, 0);
+}
+
+int store_open_for_reshard(struct store *out, const char *path)
+{
+    return open_store(out, path, 1, 0);
+}
+
+static int cache_evict(struct store *store);
+
+int store_close(struct store *store)
+{
+    int i;
+
+    if (store->cache) {
+        if (store->cache_written && cache_evict(store) < 0)
+            warn("Unable to evict blocks from cache store: %s", strerror(errno));
+        if (store_close(store->cache) < 0)
+            warn("Unable to close cache store");
+        free(store->cache);
+        store->cache = NULL;
+    }
+
+    store_packs_free(store);
+    sketch_index_free(&store->sketches);
+
+    if (store->backend->close && store->backend->close(store) < 0)
+        return -1;
+
+    if (catalog_maybe_compact(store) < 0 ||
+            (store->catalogfd >= 0 && try_close(store->catalogfd) < 0))
+        return -1;
+
+    if (try_close(store->fd) < 0)
+        return -1;
+
+    for (i = 0; i < STORE_SHARD_CACHE; i++)
+        if (store->shardfds[i] >= 0 && try_close(store->shardfds[i]) < 0)
+            return -1;
+
+    return 0;
+}
+
+const char *store_shard_path(char *out, const struct store_config *config, const struct hash *hash)
+{
+    const char *hex = hash->hex;
+    unsigned i, j;
+
+    for (i = 0; i < config->shard_depth; i++) {
+        if (i)
+            *out++ = '/';
+        for (j = 0; j < config->shard_width; j++)
+            *out++ = *hex++;
+    }
+    *out = '\0';
+
+    return hex;
+}
+
+static uint32_t shard_id(const struct store_config *config, const struct hash *hash)
+{
+    unsigned i, nibbles = config->shard_depth * config->shard_width;
+    uint32_t id = 0;
+
+    for (i = 0; i < nibbles; i++)
+        id = (id << 4) | ((hash->bin[i / 2] >> (i % 2 ? 0 : 4)) & 0xf);
+
+    return id;
+}
+
+/*
+ * Shard directories are cached in a direct-mapped table keyed by
+ * their prefix. For layouts with more than STORE_SHARD_CACHE leaf
+ * directories, colliding shards evict each other so that the number
+ * of open file descriptors stays bounded.
+ */
+static int open_shard(struct store *store, const struct hash *hash, int create)
+{
+    char shard[STORE_SHARD_PATH_MAX];
+    uint32_t id = shard_id(&store->config, hash);
+    size_t slot = id % STORE_SHARD_CACHE;
+    struct timespec start;
+    struct stat st;
+    unsigned level;
+    int shardfd;
+
+    if ((shardfd = store->shardfds[slot]) >= 0 && store->shardids[slot] == id)
+        return shardfd;
+
+    trace_start(&start);
+
+    store_shard_path(shard, &store->config, hash);
+
+    if ((shardfd = openat(store->fd, shard, O_RDONLY)) >= 0) {
+        if (fstat(shardfd, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            close(shardfd);
+            errno = ENOTDIR;
+            return -1;
+        }
+        goto out;
+    }
+
+    if (!create)
+        return -1;
+
+    /* Concurrent writers may race with us creating the same shard. */
+    for (level = 1; level <= store->config.shard_depth; level++) {
+        size_t len = level * (store->config.shard_width + 1) - 1;
+        char c = shard[len];
+
+        shard[len] = '\0';
+        if (mkdirat(store->fd, shard, 0755) < 0 && errno != EEXIST)
+            return -1;
+        shard[len] = c;
+    }
+
+    if ((shardfd = openat(store->fd, shard, O_RDONLY)) < 0)
+        return -1;
+
+out:
+    if (store->shardfds[slot] >= 0 && try_close(store->shardfds[slot]) < 0) {
+        store->shardfds[slot] = -1;
+        close(shardfd);
+        return -1;
+    }
+    store->shardfds[slot] = shardfd;
+    store->shardids[slot] = id;
+    trace_span("open-shard", hash, &start);
+    return shardfd;
+}
+
+static const char *delta_name(char *out, const char *blockname)
+{
+    strcpy(out, blockname);
+    strcat(out, BLOCK_STORE_DELTA_SUFFIX);
+    return out;
+}
+
+/*
+ * Blocks only ever appear under their final name once completely
+ * written, so an existing block does not need to be written again,
+ * regardless of whether it is stored in full, as delta or packed.
+ */
+static int block_exists(struct store *store, int shardfd, const struct hash *hash)
+{
+    char shard[STORE_SHARD_PATH_MAX], deltaname[DELTA_NAME_MAX];
+    struct pack_entry entry;
+    const char *blockname;
+    struct stat st;
+
+    blockname = store_shard_path(shard, &store->config, hash);
+
+    if (fstatat(shardfd, blockname, &st, 0) == 0 && S_ISREG(st.st_mode))
+        return 1;
+    if (fstatat(shardfd, delta_name(deltaname, blockname), &st, 0) == 0 && S_ISREG(st.st_mode))
+        return 1;
+
+    return store_pack_find(&entry, store, hash, 0) != NULL;
+}
+
+/*
+ * Write the block into the store unless it exists already. Deltas are
+ * written with a suffix, in which case blocklen is the length of the
+ * reconstructed block as recorded in the catalog. Returns 1 if the
+ * block has been written, 0 if it existed already and -1 on error.
+ */
+static int write_block(struct store *store, const struct hash *hash, const char *suffix,
+        const unsigned char *data, size_t datalen, size_t blocklen, int srcfd, off_t srcoff, int throttled)
+{
+    char name[sizeof(hash->hex) + 64], blockname[DELTA_NAME_MAX], shard[STORE_SHARD_PATH_MAX];
+    struct timespec start;
+    int fd, shardfd, saved_errno;
+
+    strcpy(blockname, store_shard_path(shard, &store->config, hash));
+    strcat(blockname, suffix);
+
+    if ((shardfd = open_shard(store, hash, 1)) < 0)
+        return -1;
+
+    if (block_exists(store, shardfd, hash))
+        return 0;
+
+    /*
+     * Multiple writers may store the same block concurrently, so every
+     * writer uses its own temporary file. Whoever renames last simply
+     * replaces the block with identical contents. Handles of the same
+     * process may pick the same name, which is resolved by O_EXCL.
+     */
+    do {
+        if (snprintf(name, sizeof(name), "%s.%ld.%u.tmp", blockname, (long) getpid(), store->tmpcounter++) < 0)
+            return -1;
+    } while ((fd = openat(shardfd, name, O_CREAT|O_EXCL|O_WRONLY, 0644)) < 0 && errno == EEXIST);
+
+    if (fd < 0)
+        return -1;
+
+    if (throttled)
+        throttle(THROTTLE_STORE_WRITE, datalen);
+
+    trace_start(&start);
+
+    /*
+     * Blocks of file inputs are cloned from the input if possible, so
+     * that they share extents on copy-on-write filesystems. Stores on
+     * a different filesystem will keep failing, so we stop trying.
+     */
+    if (srcfd >= 0 && !store->noclone) {
+        if (clone_range(fd, srcfd, srcoff, datalen) == 0) {
+            metrics_add(METRIC_STORE_CLONED_BYTES, (uintmax_t) datalen);
+            data = NULL;
+        } else {
+            if (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL)
+                store->noclone = 1;
+            if (ftruncate(fd, 0) < 0)
+                goto err;
+        }
+    }
+
+    if (data && write_bytes(fd, data, datalen) < 0)
+        goto err;
+
+    /*
+     * Drop the block from the page cache, so that backups do not evict
+     * the working set of other processes. Dirty pages are not dropped,
+     * so the block needs to be written back first.
+     */
+    if (store->drop_cache) {
+        if (fdatasync(fd) < 0)
+            goto err;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    if (try_close(fd) < 0) {
+        fd = -1;
+        goto err;
+    }
+    fd = -1;
+    trace_span("write", hash, &start);
+
+    trace_start(&start);
+    if (renameat(shardfd, name, shardfd, blockname) < 0)
+        goto err;
+    trace_span("rename", hash, &start);
+
+    if (catalog_append(store, hash, blocklen) < 0)
+        return -1;
+
+    return 1;
+
+err:
+    saved_errno = errno;
+    if (fd >= 0)
+        close(fd);
+    unlinkat(shardfd, name, 0);
+    errno = saved_errno;
+    return -1;
+}
+
+static int open_delta(struct store *store, int shardfd, const struct hash *hash)
+{
+    char shard[STORE_SHARD_PATH_MAX], deltaname[DELTA_NAME_MAX];
+    return openat(shardfd, delta_name(deltaname, store_shard_path(shard, &store->config, hash)), O_RDONLY);
+}
+
+static ssize_t read_block_at(unsigned char *out, size_t outlen, struct store *store,
+        const struct hash *hash, unsigned depth);
+
+/*
+ * Reconstruct a block from its delta and its base, which may itself
+ * be stored as delta. The result is verified, as a delta applied to
+ * the wrong base would silently yield garbage.
+ */
+static ssize_t read_delta(unsigned char *out, size_t outlen, struct store *store,
+        const struct hash *hash, int fd, unsigned depth)
+{
+    unsigned char *delta = NULL, *base = NULL;
+    struct hash basehash, computed;
+    uint32_t basedepth, size;
+    ssize_t deltalen, baselen, len = -1;
+    int saved_errno;
+
+    if (depth >= DELTA_MAX_DEPTH) {
+        errno = ELOOP;
+        goto out;
+    }
+
+    if ((delta = malloc(DELTA_HEADER_LEN + BLOCK_LEN)) == NULL || (base = malloc(BLOCK_LEN)) == NULL)
+        goto out;
+
+    if ((deltalen = read_bytes(fd, delta, DELTA_HEADER_LEN + BLOCK_LEN)) < 0 ||
+            delta_header_decode(&basehash, &basedepth, &size, delta, (size_t) deltalen) < 0)
+        goto out;
+
+    if ((baselen = read_block_at(base, BLOCK_LEN, store, &basehash, depth + 1)) < 0 ||
+            (len = delta_apply(out, outlen, base, (size_t) baselen,
+                               delta + DELTA_HEADER_LEN, (size_t) deltalen - DELTA_HEADER_LEN)) < 0)
+        goto out;
+
+    if ((size_t) len != size || hash_compute(&computed, out, (size_t) len) < 0 || !hash_eq(&computed, hash)) {
+        errno = EIO;
+        len = -1;
+    }
+
+out:
+    saved_errno = errno;
+    close(fd);
+    free(delta);
+    free(base);
+    errno = saved_errno;
+    return len;
+}
+
+static ssize_t read_block(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash)
+{
+    return read_block_at(out, outlen, store, hash, 0);
+}
+
+static ssize_t read_block_at(unsigned char *out, size_t outlen, struct store *store,
+        const struct hash *hash, unsigned depth)
+{
+    char shard[STORE_SHARD_PATH_MAX];
+    int fd, shardfd;
+    ssize_t len;
+
+    /* Blocks which are not stored in full may be deltas or have been repacked. */
+    if ((shardfd = open_shard(store, hash, 0)) < 0)
+        return errno == ENOENT || errno == ENOTDIR ? store_pack_read(out, outlen, store, hash) : -1;
+
+    if ((fd = openat(shardfd, store_shard_path(shard, &store->config, hash), O_RDONLY)) < 0) {
+        if (errno != ENOENT && errno != ENOTDIR)
+            return -1;
+        if ((fd = open_delta(store, shardfd, hash)) >= 0)
+            return read_delta(out, outlen, store, hash, fd, depth);
+        return errno == ENOENT || errno == ENOTDIR ? store_pack_read(out, outlen, store, hash) : -1;
+    }
+
+    if ((len = read_bytes(fd, out, outlen)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (try_close(fd) < 0)
+        return -1;
+
+    return len;
+}
+
+/*
+ * Blocks of the cache store are evicted in the order of their
+ * modification time, which gets updated whenever a cached block is
+ * used again.
+ */
+static void cache_touch(struct store *cache, const struct hash *hash)
+{
+    char shard[STORE_SHARD_PATH_MAX];
+    int shardfd;
+
+    if ((shardfd = open_shard(cache, hash, 0)) >= 0)
+        utimensat(shardfd, store_shard_path(shard, &cache->config, hash), NULL, 0);
+}
+
+struct cache_age {
+    size_t entry;
+    struct timespec mtime;
+};
+
+static int cache_age_cmp(const void *a, const void *b)
+{
+    const struct cache_age *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec > y->mtime.tv_nsec;
+}
+
+/*
+ * Evict the least recently used blocks from the cache store until it
+ * uses less than 90% of its budget. The size of the cache store is
+ * computed from its catalog, which is replaced by the remaining
+ * blocks while holding its lock.
+ */
+static int cache_evict(struct store *store)
+{
+    struct store *cache = store->cache;
+    struct catalog_entry *entries;
+    struct cache_age *ages;
+    uintmax_t used = 0, budget = store->config.cache_size;
+    size_t i, n, nages = 0, nkept = 0;
+    char *evict;
+    int err;
+
+    store->cache_written = 0;
+
+    if (!budget)
+        return 0;
+
+    if (store_catalog_read(&entries, &n, cache) < 0)
+        return -1;
+    for (i = 0; i < n; i++)
+        used += entries[i].size;
+    free(entries);
+
+    if (used <= budget)
+        return 0;
+
+    if (store_catalog_lock(cache) < 0 || store_catalog_read(&entries, &n, cache) < 0)
+        return -1;
+
+    if ((ages = calloc(n + 1, sizeof(*ages))) == NULL || (evict = calloc(n + 1, 1)) == NULL) {
+        free(ages);
+        free(entries);
+        return -1;
+    }
+
+    used = 0;
+    for (i = 0; i < n; i++) {
+        struct hash hash;
+        struct stat st;
+
+        hash_from_bin(&hash, entries[i].hash, HASH_LEN);
+        if (store_stat(&st, cache, &hash) < 0) {
+            evict[i] = 1;
+            continue;
+        }
+
+        ages[nages].entry = i;
+        ages[nages].mtime = st.st_mtim;
+        nages++;
+        used += entries[i].size;
+    }
+
+    qsort(ages, nages, sizeof(*ages), cache_age_cmp);
+
+    for (i = 0; i < nages && used > budget - budget / 10; i++) {
+        const struct catalog_entry *entry = &entries[ages[i].entry];
+        char shard[STORE_SHARD_PATH_MAX];
+        struct hash hash;
+        int shardfd;
+
+        hash_from_bin(&hash, entry->hash, HASH_LEN);
+        if ((shardfd = open_shard(cache, &hash, 0)) < 0 ||
+                unlinkat(shardfd, store_shard_path(shard, &cache->config, &hash), 0) < 0)
+            continue;
+
+        evict[ages[i].entry] = 1;
+        used -= entry->size;
+        metrics_add(METRIC_CACHE_EVICTED_BYTES, entry->size);
+    }
+
+    for (i = 0; i < n; i++)
+        if (!evict[i])
+            entries[nkept++] = entries[i];
+
+    err = store_catalog_replace(cache, entries, nkept);
+
+    free(evict);
+    free(ages);
+    free(entries);
+
+    return err;
+}
+
+/*
+ * Copy a block into the cache store. As the block is stored in the
+ * store itself, failures only disable the cache.
+ */
+static void cache_put(struct store *store, const struct hash *hash, const unsigned char *data, size_t datalen)
+{
+    int written;
+
+    store->cache->drop_cache = store->drop_cache;
+
+    if ((written = write_block(store->cache, hash, "", data, datalen, datalen, -1, 0, 0)) < 0) {
+        warn("Unable to write block '%s' into cache store, disabling it: %s", hash->hex, strerror(errno));
+        store_close(store->cache);
+        free(store->cache);
+        store->cache = NULL;
+        return;
+    }
+
+    if (!written) {
+        cache_touch(store->cache, hash);
+        return;
+    }
+
+    store->cache_written += datalen;
+    if (store->config.cache_size && store->cache_written >= store->config.cache_size / 8 &&
+            cache_evict(store) < 0)
+        warn("Unable to evict blocks from cache store: %s", strerror(errno));
+}
+
+/*
+ * Store a block as delta against a similar block found via the
+ * sketches of previously written blocks. Deltas are only used when
+ * they save at least half of the block, otherwise the block is
+ * written in full and may serve as base for later blocks.
+ */
+static int write_delta(size_t *stored, struct store *store, const struct hash *hash,
+        const unsigned char *data, size_t datalen, int srcfd, off_t srcoff)
+{
+    unsigned char *delta = NULL, *basedata = NULL;
+    struct sketch_entry base;
+    struct sketch sketch;
+    struct hash basehash;
+    ssize_t baselen, deltalen = -1;
+    uint32_t depth = 0;
+    int shardfd, written;
+
+    if ((shardfd = open_shard(store, hash, 1)) < 0)
+        return -1;
+    if (block_exists(store, shardfd, hash))
+        return 0;
+
+    if (!store->sketches.loaded && sketch_index_load(&store->sketches, store->fd) < 0) {
+        warn("Unable to load sketches, storing blocks in full: %s", strerror(errno));
+        store->config.delta_depth = 0;
+        return write_block(store, hash, "", data, datalen, datalen, srcfd, srcoff, 1);
+    }
+
+    sketch_compute(&sketch, data, datalen);
+
+    /* Any failure to produce a delta simply stores the block in full. */
+    if (sketch_index_find(&base, &store->sketches, &sketch, store->config.delta_depth) == 0 &&
+            memcmp(base.hash, hash->bin, HASH_LEN) && hash_from_bin(&basehash, base.hash, HASH_LEN) == 0 &&
+            (delta = malloc(DELTA_HEADER_LEN + datalen / 2)) != NULL &&
+            (basedata = malloc(BLOCK_LEN)) != NULL &&
+            (baselen = read_block(basedata, BLOCK_LEN, store, &basehash)) >= 0 &&
+            (deltalen = delta_encode(delta + DELTA_HEADER_LEN, datalen / 2,
+                                     basedata, (size_t) baselen, data, datalen)) >= 0) {
+        depth = base.depth + 1;
+        delta_header_encode(delta, &basehash, depth, (uint32_t) datalen);
+        *stored = DELTA_HEADER_LEN + (size_t) deltalen;
+        if ((written = write_block(store, hash, BLOCK_STORE_DELTA_SUFFIX, delta, *stored, datalen, -1, 0, 1)) > 0)
+            metrics_add(METRIC_BLOCKS_DELTA, 1);
+    } else {
+        written = write_block(store, hash, "", data, datalen, datalen, srcfd, srcoff, 1);
+    }
+
+    free(basedata);
+    free(delta);
+
+    if (written > 0 && sketch_index_add(&store->sketches, hash, depth, &sketch) < 0)
+        warn("Unable to record sketch of block '%s': %s", hash->hex, strerror(errno));
+
+    return written;
+}
+
+static int files_put(size_t *stored, struct store *store, const struct hash *hash,
+        const unsigned char *data, size_t datalen, int srcfd, off_t srcoff)
+{
+    if (store->config.delta_depth)
+        return write_delta(stored, store, hash, data, datalen, srcfd, srcoff);
+    return write_block(store, hash, "", data, datalen, datalen, srcfd, srcoff, 1);
+}
+
+/*
+ * Store a block whose hash has been computed by the caller already,
+ * e.g. to write the same block into multiple stores. If srcfd is not
+ * negative, the block is the range of that file starting at srcoff
+ * and gets cloned from it where possible.
+ */
+int store_put(struct store *store, const struct hash *hash, const unsigned char *data, size_t datalen,
+        int srcfd, off_t srcoff)
+{
+    struct timespec start;
+    size_t stored = datalen;
+    int written;
+
+    metrics_start(&start);
+
+    if ((written = store->backend->put(&stored, store, hash, data, datalen, srcfd, srcoff)) < 0)
+        return -1;
+
+    if (written) {
+        metrics_add(METRIC_BLOCKS_NEW, 1);
+        metrics_add(METRIC_STORE_WRITTEN_BYTES, stored);
+    } else {
+        metrics_add(METRIC_BLOCKS_DEDUPLICATED, 1);
+    }
+
+    /* Recently backed up blocks are the ones most likely to be restored. */
+    if (store->cache)
+        cache_put(store, hash, data, datalen);
+
+    metrics_observe(METRIC_STORE_WRITE, &start);
+
+    return 0;
+}
+
+int store_write(struct hash *out, struct store *store, const unsigned char *data, size_t datalen)
+{
+    struct hash hash;
+
+    if (hash_compute(&hash, data, datalen) < 0)
+        die("Unable to hash block");
+
+    if (store_put(store, &hash, data, datalen, -1, 0) < 0)
+        die_errno("Unable to write block '%s'", hash.hex);
+
+    if (out)
+        memcpy(out, &hash, sizeof(*out));
+
+    return 0;
+}
+
+/*
+ * Read a block, preferring the cache store if there is one and it is
+ * to be used. Integrity checks bypass the cache store, as it would
+ * otherwise hide corrupt blocks of the store itself.
+ */
+static ssize_t read_store(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash,
+        int cached)
+{
+    struct timespec start;
+    struct hash computed;
+    ssize_t len;
+
+    metrics_start(&start);
+    trace_start(&start);
+
+    if (cached && store->cache) {
+        if ((len = read_block(out, outlen, store->cache, hash)) >= 0) {
+            if (hash_compute(&computed, out, (size_t) len) == 0 && hash_eq(&computed, hash)) {
+                cache_touch(store->cache, hash);
+                metrics_add(METRIC_CACHE_HITS, 1);
+                goto out;
+            }
+            /* Corrupt cached blocks are replaced by the block from the store. */
+            store_remove_loose(store->cache, hash);
+        }
+        metrics_add(METRIC_CACHE_MISSES, 1);
+    }
+
+    if ((len = store->backend->read(out, outlen, store, hash)) < 0)
+        return -1;
+
+    throttle(THROTTLE_STORE_READ, (size_t) len);
+
+    /* Corrupt blocks must not end up in the cache under their name. */
+    if (cached && store->cache && hash_compute(&computed, out, (size_t) len) == 0 && hash_eq(&computed, hash))
+        cache_put(store, hash, out, (size_t) len);
+
+out:
+    trace_span("store-read", hash, &start);
+    metrics_observe(METRIC_STORE_READ, &start);
+    metrics_add(METRIC_STORE_READ_BYTES, (uintmax_t) len);
+
+    return len;
+}
+
+ssize_t store_read(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash)
+{
+    return read_store(out, outlen, store, hash, 1);
+}
+
+ssize_t store_read_uncached(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash)
+{
+    return read_store(out, outlen, store, hash, 0);
+}
+
+int store_stat(struct stat *out, struct store *store, const struct hash *hash)
+{
+    return store->backend->stat(out, store, hash);
+}
+
+int store_locate(uint64_t *out, struct store *store, const struct hash *hash)
+{
+    return store->backend->locate(out, store, hash);
+}
+
+/* Make all blocks written into the store so far durable. */
+int store_sync(struct store *store)
+{
+    return store->backend->sync ? store->backend->sync(store) : 0;
+}
+
+static int files_stat(struct stat *out, struct store *store, const struct hash *hash)
+{
+    unsigned char header[DELTA_HEADER_LEN];
+    char shard[STORE_SHARD_PATH_MAX];
+    struct pack_entry entry;
+    const struct pack *pack;
+    struct hash base;
+    uint32_t depth, size;
+    int fd, shardfd, err;
+    ssize_t len;
+
+    if ((shardfd = open_shard(store, hash, 0)) >= 0) {
+        if (fstatat(shardfd, store_shard_path(shard, &store->config, hash), out, 0) == 0)
+            return 0;
+
+        /* Deltas report their own status with the size of the reconstructed block. */
+        if (errno == ENOENT && (fd = open_delta(store, shardfd, hash)) >= 0) {
+            if ((err = fstat(fd, out)) == 0 && (len = read_bytes(fd, header, sizeof(header))) < 0)
+                err = -1;
+            else if (!err && (err = delta_header_decode(&base, &depth, &size, header, (size_t) len)) == 0)
+                out->st_size = (off_t) size;
+            close(fd);
+            return err;
+        }
+    }
+    if (errno != ENOENT && errno != ENOTDIR)
+        return -1;
+
+    /* Packed blocks report the status of their pack with their own size. */
+    if ((pack = store_pack_find(&entry, store, hash, 1)) == NULL || fstat(pack->fd, out) < 0)
+        return -1;
+    out->st_size = (off_t) entry.size;
+
+    return 0;
+}
+
+/*
+ * Determine the position of a block on the underlying device, so that
+ * reading many blocks ordered by their location turns random reads
+ * into mostly sequential ones.
+ */
+static int files_locate(uint64_t *out, struct store *store, const struct hash *hash)
+{
+    char shard[STORE_SHARD_PATH_MAX];
+    struct pack_entry entry;
+    const struct pack *pack;
+    int fd, shardfd, err;
+
+    if ((shardfd = open_shard(store, hash, 0)) < 0 ||
+            ((fd = openat(shardfd, store_shard_path(shard, &store->config, hash), O_RDONLY)) < 0 &&
+             (errno != ENOENT || (fd = open_delta(store, shardfd, hash)) < 0))) {
+        if ((errno != ENOENT && errno != ENOTDIR) ||
+                (pack = store_pack_find(&entry, store, hash, 1)) == NULL ||
+                file_location(out, pack->fd) < 0)
+            return -1;
+        *out += entry.offset;
+        return 0;
+    }
+
+    err = file_location(out, fd);
+    close(fd);
+
+    return err;
+}
+
+/*
+ * Blocks only become durable once both their contents and their
+ * directory entries have been written back, which syncfs() covers
+ * without having to track every file written.
+ */
+static int files_sync(struct store *store)
+{
+    return sync_filesystem(store->fd);
+}
+
+/*
+ * Blocks are stored as files in sharding directories, falling back
+ * to deltas and packs for blocks which are not stored in full.
+ */
+const struct store_backend files_backend = {
+    "files",
+    NULL,
+    NULL,
+    files_put,
+    read_block,
+    files_stat,
+    files_locate,
+    files_sync
+};
+
+const struct store_backend *store_backend_find(const char *name)
+{
+    static const struct store_backend *backends[] = { &files_backend, &memory_backend };
+    size_t i;
+
+    for (i = 0; i < sizeof(backends) / sizeof(*backends); i++)
+        if (!strcmp(backends[i]->name, name))
+            return backends[i];
+
+    return NULL;
+}
+
+/* Remove the loose copy of a block, e.g. after it has been repacked. */
+int store_remove_loose(struct store *store, const struct hash *hash)
+{
+    char shard[STORE_SHARD_PATH_MAX], deltaname[DELTA_NAME_MAX];
+    const char *blockname;
+    int shardfd;
+
+    if ((shardfd = open_shard(store, hash, 0)) < 0)
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+
+    blockname = store_shard_path(shard, &store->config, hash);
+    if ((unlinkat(shardfd, blockname, 0) < 0 && errno != ENOENT) ||
+            (unlinkat(shardfd, delta_name(deltaname, blockname), 0) < 0 && errno != ENOENT))
+        return -1;
+
+    return 0;
 }
@@ -20,16 +20,54 @@
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "blake2/blake2.h"
 
-#define BLOCK_STORE_VERSION 1
+#define BLOCK_STORE_VERSION 2
 #define BLOCK_STORE_VERSION_FILE "version"
+#define BLOCK_STORE_CONFIG_FILE "config"
+#define BLOCK_STORE_CATALOG_FILE "catalog"
+#define BLOCK_STORE_PACKS_DIR "packs"
+#define BLOCK_STORE_SKETCHES_FILE "sketches"
+#define BLOCK_STORE_DELTA_SUFFIX ".delta"
+
+#define CATALOG_MAGIC "GOBCATL\0"
+#define CATALOG_VERSION 1
+#define CATALOG_HEADER_LEN 24
+#define CATALOG_RECORD_LEN (HASH_LEN + 8)
+#define CATALOG_LOCATION_LOOSE 0
+#define CATALOG_COMPACT_MIN 1024
+
+#define PACK_MAGIC "GOBPACK\0"
+#define PACK_VERSION 1
+#define PACK_HEADER_LEN 16
+#define PACK_RECORD_LEN (HASH_LEN + 12)
+
+#define DELTA_MAGIC "GOBDELT\0"
+#define DELTA_HEADER_LEN (HASH_LEN + 16)
+#define DELTA_NAME_MAX (HASH_LEN * 2 + sizeof(BLOCK_STORE_DELTA_SUFFIX))
+#define DELTA_MAX_DEPTH 8
+#define SKETCH_FEATURES 4
+#define SKETCH_RECORD_LEN (HASH_LEN + 4 + SKETCH_FEATURES * 8)
+
+#define STORE_SHARD_CACHE 256
+#define STORE_SHARD_PATH_MAX 24
+#define STORE_CACHE_PATH_MAX 4096
+#define STORE_BACKEND_NAME_MAX 16
+
+#define INDEX_BUFFER_LEN (1024 * 1024)
+
+#define HASH_STATE_LEN 241
+#define CHECKPOINT_INTERVAL 256
 
 struct hash {
     unsigned char bin[HASH_LEN];
@@ -40,26 +78,230 @@ struct hash_state {
     blake2b_state state;
 };
 
+struct store_config {
+    unsigned shard_depth;
+    unsigned shard_width;
+    unsigned reshard_depth;
+    unsigned reshard_width;
+    char cache[STORE_CACHE_PATH_MAX];
+    size_t cache_size;
+    unsigned delta_depth;
+    char backend[STORE_BACKEND_NAME_MAX];
+};
+
+struct catalog_entry {
+    unsigned char hash[HASH_LEN];
+    uint32_t size;
+    uint32_t location;
+    size_t seq;
+};
+
+struct pack_entry {
+    unsigned char hash[HASH_LEN];
+    uint64_t offset;
+    uint32_t size;
+};
+
+struct pack {
+    uint32_t id;
+    int fd;
+    unsigned char *records;
+    size_t nrecords;
+};
+
+struct sketch {
+    uint64_t features[SKETCH_FEATURES];
+};
+
+struct sketch_entry {
+    unsigned char hash[HASH_LEN];
+    uint32_t depth;
+    struct sketch sketch;
+};
+
+struct sketch_index {
+    int fd;
+    int loaded;
+    struct sketch_entry *entries;
+    size_t nentries, alloc;
+    size_t *slots;
+    size_t nslots;
+};
+
+struct store;
+
+/*
+ * A backend implements how blocks of a store are laid out. Besides
+ * writing and reading blocks, which may fail with ENOENT for unknown
+ * blocks, backends report the size of blocks and a location which
+ * orders reading many blocks efficiently.
+ */
+struct store_backend {
+    const char *name;
+    int (*open)(struct store *store);
+    int (*close)(struct store *store);
+    int (*put)(size_t *stored, struct store *store, const struct hash *hash,
+            const unsigned char *data, size_t datalen, int srcfd, off_t srcoff);
+    ssize_t (*read)(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash);
+    int (*stat)(struct stat *out, struct store *store, const struct hash *hash);
+    int (*locate)(uint64_t *out, struct store *store, const struct hash *hash);
+    int (*sync)(struct store *store);
+};
+
 struct store {
+    const struct store_backend *backend;
+    void *backend_data;
+    int fd;
+    int catalogfd;
+    int catalog_appended;
+    int drop_cache;
+    int noclone;
+    unsigned tmpcounter;
+    struct store_config config;
+    struct store *cache;
+    uintmax_t cache_written;
+    struct pack *packs;
+    size_t npacks;
+    int packs_loaded;
+    struct sketch_index sketches;
+    int shardfds[STORE_SHARD_CACHE];
+    uint32_t shardids[STORE_SHARD_CACHE];
+};
+
+enum metric_counter {
+    METRIC_INPUT_BYTES,
+    METRIC_OUTPUT_BYTES,
+    METRIC_STORE_READ_BYTES,
+    METRIC_STORE_WRITTEN_BYTES,
+    METRIC_BLOCKS_NEW,
+    METRIC_BLOCKS_DEDUPLICATED,
+    METRIC_ERRORS,
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_CACHE_EVICTED_BYTES,
+    METRIC_STORE_CLONED_BYTES,
+    METRIC_BLOCKS_DELTA,
+    METRIC_COUNTER_MAX
+};
+
+enum metric_histogram {
+    METRIC_STORE_WRITE,
+    METRIC_STORE_READ,
+    METRIC_HASH,
+    METRIC_HISTOGRAM_MAX
+};
+
+enum throttle_kind {
+    THROTTLE_INPUT,
+    THROTTLE_STORE_WRITE,
+    THROTTLE_STORE_READ,
+    THROTTLE_MAX
+};
+
+struct reader_slot;
+
+struct reader {
+    int fd;
+    int direct;
+    int stop;
+    off_t offset;
+    struct reader_slot *slots;
+    size_t nslots;
+    pthread_t *threads;
+    size_t nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uintmax_t next_read, next_consume, eof_block;
+};
+
+struct block_cache_entry;
+
+struct block_cache {
+    struct block_cache_entry **buckets;
+    size_t nbuckets;
+    struct block_cache_entry *head, *tail;
+    size_t used, budget;
+    uintmax_t hits, misses;
+};
+
+struct index_writer {
+    int fd;
+    char *buf;
+    size_t len;
+};
+
+struct index_reader {
+    int fd;
+    int eof;
+    char *buf;
+    size_t start, end, alloc;
+};
+
+struct checkpoint {
     int fd;
-    int shardfds[256];
+    const char *path;
+    unsigned long interval;
+    struct index_writer index;
+    uintmax_t blocks;
+    uintmax_t bytes;
+    struct hash_state state;
+};
+
+struct plan_ref {
+    struct hash hash;
+    size_t output;
+    uint64_t offset;
+    size_t len;
+};
+
+struct plan_block {
+    const struct hash *hash;
+    size_t len;
+    uintmax_t order;
+    uint64_t location;
+    size_t first, nrefs;
 };
 
+struct restore_plan {
+    struct plan_ref *refs;
+    size_t nrefs, allocrefs;
+    struct plan_block *blocks;
+    size_t nblocks;
+};
+
+int gob_analyze(int argc, const char *argv[]);
+int gob_bundle(int argc, const char *argv[]);
 int gob_cat(int argc, const char *argv[]);
+int gob_cat_many(int argc, const char *argv[]);
+int gob_catalog(int argc, const char *argv[]);
 int gob_chunk(int argc, const char *argv[]);
+int gob_chunk_tree(int argc, const char *argv[]);
 int gob_fsck(int argc, const char *argv[]);
 int gob_init(int argc, const char *argv[]);
+int gob_repack(int argc, const char *argv[]);
+int gob_reshard(int argc, const char *argv[]);
+int gob_verify(int argc, const char *argv[]);
 
 void die(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
 void die_errno(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
 void warn(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
+int parse_size(size_t *out, const char *str);
+
 int try_close(int fd);
 int try_closedir(DIR *d);
 void close_stdout(void);
 
 ssize_t read_bytes(int fd, unsigned char *buf, size_t buflen);
 int write_bytes(int fd, const unsigned char *buf, size_t buflen);
+ssize_t pread_bytes(int fd, unsigned char *buf, size_t buflen, off_t offset);
+int pwrite_bytes(int fd, const unsigned char *buf, size_t buflen, off_t offset);
+int clone_range(int dst, int src, off_t offset, size_t len);
+int file_location(uint64_t *out, int fd);
+int sync_filesystem(int fd);
+
+void hex_encode(char *out, const unsigned char *in, size_t len);
+int hex_decode(unsigned char *out, const char *in, size_t len);
 
 int hash_from_bin(struct hash *out, const unsigned char *data, size_t len);
 int hash_from_str(struct hash *out, const char *str, size_t len);
@@ -69,9 +311,105 @@ int hash_compute(struct hash *out, const unsigned char *data, size_t len);
 int hash_state_init(struct hash_state *state);
 int hash_state_update(struct hash_state *state, const unsigned char *data, size_t len);
 int hash_state_final(struct hash *out, struct hash_state *state);
+void hash_state_save(unsigned char *out, const struct hash_state *state);
+int hash_state_load(struct hash_state *state, const unsigned char *in);
+
+void store_config_init(struct store_config *config);
+int store_config_validate(const struct store_config *config);
+int store_config_read(struct store_config *out, int storefd);
+int store_config_write(int storefd, const struct store_config *config);
+const struct store_backend *store_backend_find(const char *name);
+extern const struct store_backend files_backend;
+extern const struct store_backend memory_backend;
+const char *store_shard_path(char *out, const struct store_config *config, const struct hash *hash);
 
-int store_init(const char *path);
+int store_init(const char *path, const struct store_config *config);
 int store_open(struct store *out, const char *path);
+int store_open_for_reshard(struct store *out, const char *path);
 int store_close(struct store *store);
 int store_write(struct hash *out, struct store *store, const unsigned char *data, size_t datalen);
+int store_put(struct store *store, const struct hash *hash, const unsigned char *data, size_t datalen,
+        int srcfd, off_t srcoff);
 ssize_t store_read(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash);
+ssize_t store_read_uncached(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash);
+int store_stat(struct stat *out, struct store *store, const struct hash *hash);
+int store_locate(uint64_t *out, struct store *store, const struct hash *hash);
+int store_sync(struct store *store);
+
+int store_catalog_read(struct catalog_entry **out, size_t *nout, const struct store *store);
+int store_catalog_lock(struct store *store);
+int store_catalog_replace(struct store *store, const struct catalog_entry *entries, size_t n);
+int store_catalog_compact(struct store *store);
+int store_catalog_update(struct store *store, struct catalog_entry *entries, size_t n);
+int store_remove_loose(struct store *store, const struct hash *hash);
+
+void gear_init(uint64_t *table);
+void sketch_compute(struct sketch *out, const unsigned char *data, size_t len);
+int sketch_index_load(struct sketch_index *index, int storefd);
+int sketch_index_add(struct sketch_index *index, const struct hash *hash, uint32_t depth,
+        const struct sketch *sketch);
+int sketch_index_find(struct sketch_entry *out, const struct sketch_index *index,
+        const struct sketch *sketch, uint32_t maxdepth);
+void sketch_index_free(struct sketch_index *index);
+void delta_header_encode(unsigned char *out, const struct hash *base, uint32_t depth, uint32_t size);
+int delta_header_decode(struct hash *base, uint32_t *depth, uint32_t *size, const unsigned char *in, size_t len);
+ssize_t delta_encode(unsigned char *out, size_t outlen, const unsigned char *base, size_t baselen,
+        const unsigned char *data, size_t len);
+ssize_t delta_apply(unsigned char *out, size_t outlen, const unsigned char *base, size_t baselen,
+        const unsigned char *delta, size_t deltalen);
+
+int pack_name(char *out, size_t outlen, uint32_t id, const char *suffix);
+void pack_entry_at(struct pack_entry *out, const struct pack *pack, size_t i);
+int pack_lookup(struct pack_entry *out, const struct pack *pack, const struct hash *hash);
+int pack_write_index(int packsfd, uint32_t id, struct pack_entry *entries, size_t n);
+int store_packs_load(struct store *store);
+void store_packs_free(struct store *store);
+const struct pack *store_pack_find(struct pack_entry *out, struct store *store,
+        const struct hash *hash, int reload);
+ssize_t store_pack_read(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash);
+
+int metrics_enable(const char *path, const char *command);
+void metrics_add(enum metric_counter counter, uintmax_t value);
+void metrics_start(struct timespec *start);
+void metrics_observe(enum metric_histogram histogram, const struct timespec *start);
+
+int trace_enable(const char *path);
+void trace_start(struct timespec *start);
+void trace_span(const char *name, const struct hash *hash, const struct timespec *start);
+
+int throttle_set(const char *spec);
+int throttle_watch(const char *path);
+void throttle(enum throttle_kind kind, size_t bytes);
+
+int reader_init(struct reader *reader, int fd, size_t nthreads, int direct);
+ssize_t reader_next(struct reader *reader, const unsigned char **out);
+void reader_release(struct reader *reader);
+int reader_close(struct reader *reader);
+
+int block_cache_init(struct block_cache *cache, size_t budget);
+void block_cache_free(struct block_cache *cache);
+const unsigned char *block_cache_get(struct block_cache *cache, const struct hash *hash, size_t *len);
+void block_cache_put(struct block_cache *cache, const struct hash *hash, const unsigned char *data, size_t len);
+ssize_t block_cache_read(unsigned char *out, size_t outlen, struct block_cache *cache,
+        struct store *store, const struct hash *hash);
+
+int index_writer_init(struct index_writer *writer, int fd);
+int index_writer_add(struct index_writer *writer, const struct hash *hash);
+int index_writer_trailer(struct index_writer *writer, const struct hash *hash, uintmax_t len);
+int index_writer_flush(struct index_writer *writer);
+void index_writer_free(struct index_writer *writer);
+
+int index_reader_init(struct index_reader *reader, int fd);
+int index_reader_line(struct index_reader *reader, char **line, size_t *len);
+void index_reader_free(struct index_reader *reader);
+
+int checkpoint_open(struct checkpoint *checkpoint, const char *path, unsigned long interval, int resume);
+int checkpoint_replay(struct checkpoint *checkpoint, struct index_writer *index);
+int checkpoint_add(struct checkpoint *checkpoint, const struct hash *hash);
+int checkpoint_write(struct checkpoint *checkpoint, uintmax_t blocks, uintmax_t bytes, const struct hash_state *state);
+int checkpoint_remove(struct checkpoint *checkpoint);
+
+void plan_init(struct restore_plan *plan);
+int plan_add(struct restore_plan *plan, size_t output, const struct hash *hash, uint64_t offset, size_t len);
+int plan_finalize(struct restore_plan *plan, struct store *store);
+void plan_free(struct restore_plan *plan);
@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Blocks which are similar to an existing block can be stored as a
+ * delta against it. Similar blocks are found via sketches: a rolling
+ * hash is sampled at content-defined positions, and every feature
+ * of the sketch is the maximum of a different linear transformation
+ * of these samples. Blocks sharing features thus likely share most
+ * of their contents.
+ *
+ * A delta consists of a header followed by copy and insert
+ * operations:
+ *
+ *     header:  magic (8), base hash (HASH_LEN), depth (4), size (4)
+ *     copy:    'C', base offset (4), length (4)
+ *     insert:  'I', length (4), data
+ */
+
+#include "common.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SKETCH_SAMPLE_MASK 0x3f
+#define SKETCH_MAX_MATCHES 16
+#define DELTA_WINDOW 32
+#define DELTA_PRIME 0x100000001b3ULL
+
+static const uint64_t transforms[SKETCH_FEATURES][2] = {
+    { 0x9e3779b97f4a7c15ULL, 0x7f4a7c159e3779b9ULL },
+    { 0xbf58476d1ce4e5b9ULL, 0x1ce4e5b9bf58476dULL },
+    { 0x94d049bb133111ebULL, 0x133111eb94d049bbULL },
+    { 0xd6e8feb86659fd93ULL, 0x6659fd93d6e8feb8ULL },
+};
+
+void gear_init(uint64_t *table)
+{
+    uint64_t seed = 0;
+    size_t i;
+
+    /* splitmix64, so that fingerprints are reproducible */
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        table[i] = z ^ (z >> 31);
+    }
+}
+
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+static uint64_t gear[256];
+
+static void init_gear(void)
+{
+    gear_init(gear);
+}
+
+static void encode_u32(unsigned char *out, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(out, &value, 4);
+}
+
+static uint32_t decode_u32(const unsigned char *in)
+{
+    uint32_t value;
+    memcpy(&value, in, 4);
+    return ntohl(value);
+}
+
+static void encode_u64(unsigned char *out, uint64_t value)
+{
+    encode_u32(out, (uint32_t) (value >> 32));
+    encode_u32(out + 4, (uint32_t) value);
+}
+
+static uint64_t decode_u64(const unsigned char *in)
+{
+    return ((uint64_t) decode_u32(in) << 32) | decode_u32(in + 4);
+}
+
+void sketch_compute(struct sketch *out, const unsigned char *data, size_t len)
+{
+    uint64_t fingerprint = 0;
+    size_t i, k;
+
+    pthread_once(&gear_once, init_gear);
+
+    memset(out, 0, sizeof(*out));
+
+    for (i = 0; i < len; i++) {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (fingerprint & SKETCH_SAMPLE_MASK)
+            continue;
+
+        for (k = 0; k < SKETCH_FEATURES; k++) {
+            uint64_t value = transforms[k][0] * fingerprint + transforms[k][1];
+            if (value > out->features[k])
+                out->features[k] = value;
+        }
+    }
+}
+
+static size_t slot_of(const struct sketch_index *index, size_t feature, uint64_t value)
+{
+    uint64_t key = (value ^ transforms[feature][1]) * transforms[feature][0];
+    return (size_t) (key >> 32) & (index->nslots - 1);
+}
+
+static void insert_slots(struct sketch_index *index, size_t entry)
+{
+    size_t k, slot;
+
+    for (k = 0; k < SKETCH_FEATURES; k++) {
+        slot = slot_of(index, k, index->entries[entry].sketch.features[k]);
+        while (index->slots[slot])
+            slot = (slot + 1) & (index->nslots - 1);
+        index->slots[slot] = entry + 1;
+    }
+}
+
+static int add_entry(struct sketch_index *index, const unsigned char *hash, uint32_t depth,
+        const struct sketch *sketch)
+{
+    struct sketch_entry *entry;
+    size_t i;
+
+    if (index->nentries == index->alloc) {
+        size_t alloc = index->alloc ? index->alloc * 2 : 1024;
+        if ((entry = realloc(index->entries, alloc * sizeof(*entry))) == NULL)
+            return -1;
+        index->entries = entry;
+        index->alloc = alloc;
+    }
+
+    /* Keep the table at most half full, with one slot per feature. */
+    if ((index->nentries + 1) * SKETCH_FEATURES * 2 > index->nslots) {
+        size_t *slots, nslots = index->nslots ? index->nslots * 2 : 8192;
+
+        if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+            return -1;
+        free(index->slots);
+        index->slots = slots;
+        index->nslots = nslots;
+        for (i = 0; i < index->nentries; i++)
+            insert_slots(index, i);
+    }
+
+    entry = &index->entries[index->nentries];
+    memcpy(entry->hash, hash, HASH_LEN);
+    entry->depth = depth;
+    entry->sketch = *sketch;
+    insert_slots(index, index->nentries++);
+
+    return 0;
+}
+
+static void sketch_encode(unsigned char *out, const unsigned char *hash, uint32_t depth, const struct sketch *sketch)
+{
+    size_t k;
+
+    memcpy(out, hash, HASH_LEN);
+    encode_u32(out + HASH_LEN, depth);
+    for (k = 0; k < SKETCH_FEATURES; k++)
+        encode_u64(out + HASH_LEN + 4 + k * 8, sketch->features[k]);
+}
+
+/*
+ * Load all sketches of the store. The sketch file is only ever
+ * appended to, so a trailing partial record is caused by a concurrent
+ * or interrupted append and gets ignored.
+ */
+int sketch_index_load(struct sketch_index *index, int storefd)
+{
+    unsigned char *buf = NULL;
+    struct sketch sketch;
+    off_t offset = 0;
+    ssize_t bytes;
+    size_t i, k;
+
+    memset(index, 0, sizeof(*index));
+
+    if ((index->fd = openat(storefd, BLOCK_STORE_SKETCHES_FILE, O_RDWR|O_CREAT|O_APPEND, 0644)) < 0)
+        return -1;
+
+    if ((buf = malloc(INDEX_BUFFER_LEN)) == NULL)
+        goto err;
+
+    while ((bytes = pread_bytes(index->fd, buf, INDEX_BUFFER_LEN - INDEX_BUFFER_LEN % SKETCH_RECORD_LEN,
+                    offset)) >= SKETCH_RECORD_LEN) {
+        size_t records = (size_t) bytes / SKETCH_RECORD_LEN;
+
+        for (i = 0; i < records; i++) {
+            const unsigned char *record = buf + i * SKETCH_RECORD_LEN;
+
+            for (k = 0; k < SKETCH_FEATURES; k++)
+                sketch.features[k] = decode_u64(record + HASH_LEN + 4 + k * 8);
+            if (add_entry(index, record, decode_u32(record + HASH_LEN), &sketch) < 0)
+                goto err;
+        }
+
+        offset += (off_t) (records * SKETCH_RECORD_LEN);
+    }
+
+    if (bytes < 0)
+        goto err;
+
+    free(buf);
+    index->loaded = 1;
+    return 0;
+
+err:
+    free(buf);
+    close(index->fd);
+    free(index->entries);
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+    return -1;
+}
+
+int sketch_index_add(struct sketch_index *index, const struct hash *hash, uint32_t depth,
+        const struct sketch *sketch)
+{
+    unsigned char record[SKETCH_RECORD_LEN];
+
+    sketch_encode(record, hash->bin, depth, sketch);
+
+    if (write_bytes(index->fd, record, sizeof(record)) < 0)
+        return -1;
+
+    return add_entry(index, hash->bin, depth, sketch);
+}
+
+/*
+ * Find the entry sharing most features with the given sketch. Only
+ * entries whose depth is below the given maximum are considered, so
+ * that delta chains stay bounded.
+ */
+int sketch_index_find(struct sketch_entry *out, const struct sketch_index *index,
+        const struct sketch *sketch, uint32_t maxdepth)
+{
+    size_t candidates[SKETCH_FEATURES * SKETCH_MAX_MATCHES], scores[SKETCH_FEATURES * SKETCH_MAX_MATCHES];
+    size_t i, k, ncandidates = 0, best = 0;
+
+    if (!index->nentries)
+        return -1;
+
+    for (k = 0; k < SKETCH_FEATURES; k++) {
+        size_t slot = slot_of(index, k, sketch->features[k]), matches = 0;
+
+        if (!sketch->features[k])
+            continue;
+
+        for (; index->slots[slot] && matches < SKETCH_MAX_MATCHES; slot = (slot + 1) & (index->nslots - 1)) {
+            size_t entry = index->slots[slot] - 1;
+
+            if (index->entries[entry].sketch.features[k] != sketch->features[k] ||
+                    index->entries[entry].depth >= maxdepth)
+                continue;
+            matches++;
+
+            for (i = 0; i < ncandidates; i++)
+                if (candidates[i] == entry)
+                    break;
+            if (i == ncandidates) {
+                candidates[ncandidates] = entry;
+                scores[ncandidates++] = 0;
+            }
+            scores[i]++;
+        }
+    }
+
+    if (!ncandidates)
+        return -1;
+
+    for (i = 1; i < ncandidates; i++)
+        if (scores[i] > scores[best] || (scores[i] == scores[best] && candidates[i] > candidates[best]))
+            best = i;
+
+    *out = index->entries[candidates[best]];
+    return 0;
+}
+
+void sketch_index_free(struct sketch_index *index)
+{
+    if (index->loaded)
+        close(index->fd);
+    free(index->entries);
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+void delta_header_encode(unsigned char *out, const struct hash *base, uint32_t depth, uint32_t size)
+{
+    memcpy(out, DELTA_MAGIC, 8);
+    memcpy(out + 8, base->bin, HASH_LEN);
+    encode_u32(out + 8 + HASH_LEN, depth);
+    encode_u32(out + 12 + HASH_LEN, size);
+}
+
+int delta_header_decode(struct hash *base, uint32_t *depth, uint32_t *size, const unsigned char *in, size_t len)
+{
+    if (len < DELTA_HEADER_LEN || memcmp(in, DELTA_MAGIC, 8) ||
+            hash_from_bin(base, in + 8, HASH_LEN) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *depth = decode_u32(in + 8 + HASH_LEN);
+    *size = decode_u32(in + 12 + HASH_LEN);
+
+    return 0;
+}
+
+static uint64_t window_hash(const unsigned char *data)
+{
+    uint64_t hash = 0;
+    size_t i;
+
+    for (i = 0; i < DELTA_WINDOW; i++)
+        hash = hash * DELTA_PRIME + data[i];
+
+    return hash;
+}
+
+static int emit_insert(unsigned char *out, size_t outlen, size_t *pos, const unsigned char *data, size_t len)
+{
+    if (!len)
+        return 0;
+    if (*pos + 5 + len > outlen)
+        return -1;
+
+    out[*pos] = 'I';
+    encode_u32(out + *pos + 1, (uint32_t) len);
+    memcpy(out + *pos + 5, data, len);
+    *pos += 5 + len;
+
+    return 0;
+}
+
+/*
+ * Encode data as operations against the base. Windows of the base at
+ * aligned offsets are indexed by their hash, and matches found for a
+ * rolling hash over the data are extended in both directions. Fails
+ * if the delta does not fit into outlen bytes.
+ */
+ssize_t delta_encode(unsigned char *out, size_t outlen, const unsigned char *base, size_t baselen,
+        const unsigned char *data, size_t len)
+{
+    size_t *table, nslots = 1, mask, i, pending = 0, pos = 0;
+    uint64_t hash = 0, power = 1;
+    int rehash = 1;
+
+    while (nslots < 2 * (baselen / DELTA_WINDOW + 1))
+        nslots *= 2;
+    mask = nslots - 1;
+
+    if ((table = calloc(nslots, sizeof(*table))) == NULL)
+        return -1;
+
+    for (i = 0; i + DELTA_WINDOW <= baselen; i += DELTA_WINDOW)
+        table[window_hash(base + i) & mask] = i + 1;
+    for (i = 1; i < DELTA_WINDOW; i++)
+        power *= DELTA_PRIME;
+
+    for (i = 0; i + DELTA_WINDOW <= len;) {
+        size_t candidate, start, matched = DELTA_WINDOW;
+
+        if (rehash)
+            hash = window_hash(data + i);
+        rehash = 0;
+
+        if ((candidate = table[hash & mask]) == 0 ||
+                memcmp(base + candidate - 1, data + i, DELTA_WINDOW)) {
+            if (i + DELTA_WINDOW < len)
+                hash = (hash - data[i] * power) * DELTA_PRIME + data[i + DELTA_WINDOW];
+            i++;
+            continue;
+        }
+
+        start = candidate - 1;
+        while (i > pending && start > 0 && base[start - 1] == data[i - 1]) {
+            start--;
+            i--;
+            matched++;
+        }
+        while (i + matched < len && start + matched < baselen && base[start + matched] == data[i + matched])
+            matched++;
+
+        if (emit_insert(out, outlen, &pos, data + pending, i - pending) < 0 || pos + 9 > outlen)
+            goto err;
+        out[pos] = 'C';
+        encode_u32(out + pos + 1, (uint32_t) start);
+        encode_u32(out + pos + 5, (uint32_t) matched);
+        pos += 9;
+
+        i += matched;
+        pending = i;
+        rehash = 1;
+    }
+
+    if (emit_insert(out, outlen, &pos, data + pending, len - pending) < 0)
+        goto err;
+
+    free(table);
+    return (ssize_t) pos;
+
+err:
+    free(table);
+    errno = EFBIG;
+    return -1;
+}
+
+ssize_t delta_apply(unsigned char *out, size_t outlen, const unsigned char *base, size_t baselen,
+        const unsigned char *delta, size_t deltalen)
+{
+    size_t pos = 0, len = 0;
+
+    while (pos < deltalen) {
+        uint32_t offset, n;
+
+        if (delta[pos] == 'C' && deltalen - pos >= 9) {
+            offset = decode_u32(delta + pos + 1);
+            n = decode_u32(delta + pos + 5);
+            if (offset > baselen || n > baselen - offset || n > outlen - len)
+                goto invalid;
+            memcpy(out + len, base + offset, n);
+            pos += 9;
+        } else if (delta[pos] == 'I' && deltalen - pos >= 5) {
+            n = decode_u32(delta + pos + 1);
+            if (n > deltalen - pos - 5 || n > outlen - len)
+                goto invalid;
+            memcpy(out + len, delta + pos + 5, n);
+            pos += 5 + n;
+        } else {
+            goto invalid;
+        }
+        len += n;
+    }
+
+    return (ssize_t) len;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <sys/ioctl.h>
+
+#ifdef HAVE_FIEMAP
+# include <linux/fs.h>
+# include <linux/fiemap.h>
+#endif
+
+/*
+ * Determine the physical position of the start of the given file on
+ * its device. This fails for filesystems which do not support FIEMAP
+ * and for files whose data has not been allocated yet.
+ */
+int file_location(uint64_t *out, int fd)
+{
+#ifdef HAVE_FIEMAP
+    struct fiemap *map;
+    int err = -1;
+
+    if ((map = calloc(1, sizeof(*map) + sizeof(struct fiemap_extent))) == NULL)
+        return -1;
+
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0) {
+        if (map->fm_mapped_extents == 1 &&
+                !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_DELALLOC))) {
+            *out = map->fm_extents[0].fe_physical;
+            err = 0;
+        } else {
+            errno = ENODATA;
+        }
+    }
+
+    free(map);
+    return err;
+#else
+    (void) out;
+    (void) fd;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
@@ -26,15 +26,28 @@
 
 static unsigned char *block;
 
-static int scan_shard(int storefd, const char *shard)
+static int is_shard_name(const struct store_config *config, const char *name)
+{
+    return strlen(name) == config->shard_width &&
+        strspn(name, HEXCHARS) == config->shard_width;
+}
+
+static int scan_shard(struct store *store, const char *shard)
 {
     struct hash computed_hash, expected_hash;
     struct dirent *ent = NULL;
-    char filehash[HASH_LEN * 2 + 1];
+    char filehash[HASH_LEN * 2 + 1], prefix[STORE_SHARD_PATH_MAX];
+    size_t i, j, namelen, suffixlen = strlen(BLOCK_STORE_DELTA_SUFFIX);
     DIR *sharddir = NULL;
     int shardfd = -1, err = 0;
 
-    if ((shardfd = openat(storefd, shard, O_RDONLY)) < 0) {
+    for (i = 0, j = 0; shard[i]; i++)
+        if (shard[i] != '/')
+            prefix[j++] = shard[i];
+    prefix[j] = '\0';
+    namelen = HASH_LEN * 2 - j;
+
+    if ((shardfd = openat(store->fd, shard, O_RDONLY)) < 0) {
         warn("Unable to open shard");
         err = -1;
         goto out;
@@ -50,6 +63,7 @@ static int scan_shard(int storefd, const char *shard)
         struct stat stat;
         int blockfd = -1;
         ssize_t bytes;
+        int delta;
 
         if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
             continue;
@@ -66,13 +80,33 @@ static int scan_shard(int storefd, const char *shard)
             goto next;
         }
 
-        if (strlen(ent->d_name) != (HASH_LEN * 2 - 2) ||
-                strspn(ent->d_name, HEXCHARS) != (HASH_LEN * 2 - 2)) {
-            warn("invalid entry name '%s/%s' %lu %d", shard, ent->d_name, strspn(ent->d_name, HEXCHARS), HASH_LEN * 2 - 2);
+        delta = strlen(ent->d_name) == namelen + suffixlen &&
+            !strcmp(ent->d_name + namelen, BLOCK_STORE_DELTA_SUFFIX);
+
+        if ((strlen(ent->d_name) != namelen && !delta) || strspn(ent->d_name, HEXCHARS) != namelen) {
+            warn("invalid entry name '%s/%s'", shard, ent->d_name);
             err = -1;
             goto next;
         }
 
+        if (snprintf(filehash, sizeof(filehash), "%s%.*s",
+                    prefix, (int) namelen, ent->d_name) != HASH_LEN * 2 ||
+            hash_from_str(&expected_hash, filehash, sizeof(filehash) - 1) < 0)
+        {
+            warn("File name is not a valid hash");
+            err = -1;
+            goto next;
+        }
+
+        /* Deltas are verified by reconstructing them from their bases. */
+        if (delta) {
+            if (store_read_uncached(block, BLOCK_LEN, store, &expected_hash) < 0) {
+                warn("unable to reconstruct delta %s: %s", filehash, strerror(errno));
+                err = -1;
+            }
+            goto next;
+        }
+
         if ((blockfd = openat(shardfd, ent->d_name, O_RDONLY)) < 0) {
             warn("unable to open block");
             err = -1;
@@ -84,6 +118,7 @@ static int scan_shard(int storefd, const char *shard)
             err = -1;
             goto next;
         }
+        metrics_add(METRIC_STORE_READ_BYTES, (uintmax_t) bytes);
 
         if (hash_compute(&computed_hash, block, (size_t) bytes) < 0) {
             warn("Unable to hash block");
@@ -91,94 +126,182 @@ static int scan_shard(int storefd, const char *shard)
             goto next;
         }
 
-        if (snprintf(filehash, sizeof(filehash), "%s%s",
-                    shard, ent->d_name) != HASH_LEN * 2 ||
-            hash_from_str(&expected_hash, filehash, sizeof(filehash) - 1) < 0)
-        {
-            warn("File name is not a valid hash");
-            err = -1;
-            goto next;
-        }
-
         if (!hash_eq(&computed_hash, &expected_hash)) {
-            warn("Hash mismatch for block %s%s", shard, ent->d_name);
+            warn("Hash mismatch for block %s", filehash);
             err = -1;
             goto next;
         }
 
 next:
         if (blockfd >= 0 && try_close(blockfd) < 0) {
-            warn("Failed closing block %s%s", shard, ent->d_name);
+            warn("Failed closing block %s/%s", shard, ent->d_name);
             err = -1;
         }
     }
 
 out:
-    if ((sharddir ? try_closedir(sharddir) : shardfd ? try_close(shardfd) : 0) < 0)
-            warn("failed closing shard directory %s%s", shard, ent ? ent->d_name : "");
+    if ((sharddir ? try_closedir(sharddir) : shardfd >= 0 ? try_close(shardfd) : 0) < 0)
+            warn("failed closing shard directory %s", shard);
     return err;
 }
 
-int gob_fsck(int argc, const char *argv[])
+/*
+ * Scan all sharding directories below the given path, which is
+ * located at the given level of the sharding hierarchy. The store
+ * itself is at level zero, while blocks are stored in directories
+ * at level "shard-depth".
+ */
+static int scan_level(struct store *store, const char *path, unsigned level)
 {
-    struct store store;
     struct dirent *ent;
-    DIR *storedir;
-    int storefd, err = 0;
-
-    if (argc != 2)
-        die("USAGE: %s fsck <DIR>", argv[0]);
-
-    atexit(close_stdout);
-
-    if ((block = malloc(BLOCK_LEN)) == NULL)
-        die_errno("Unable to allocate block");
+    DIR *dir;
+    int fd, err = 0;
+
+    if ((fd = level ? openat(store->fd, path, O_RDONLY) : dup(store->fd)) < 0 ||
+            (dir = fdopendir(fd)) == NULL) {
+        warn("unable to open sharding directory '%s'", path);
+        if (fd >= 0)
+            try_close(fd);
+        return -1;
+    }
 
-    if (store_open(&store, argv[1]) < 0)
-        die_errno("Unable to open store");
+    while ((ent = readdir(dir)) != NULL) {
+        char subpath[STORE_SHARD_PATH_MAX];
+        struct stat stat;
 
-    if ((storefd = dup(store.fd)) < 0 || (storedir = fdopendir(storefd)) == NULL)
-        die_errno("Unable to open store directory");
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
 
-    while ((ent = readdir(storedir)) != NULL) {
-        struct stat stat;
+        if (!level && (!strcmp(ent->d_name, BLOCK_STORE_VERSION_FILE) ||
+                    !strcmp(ent->d_name, BLOCK_STORE_CONFIG_FILE) ||
+                    !strcmp(ent->d_name, BLOCK_STORE_CATALOG_FILE) ||
+                    !strcmp(ent->d_name, BLOCK_STORE_SKETCHES_FILE) ||
+                    !strcmp(ent->d_name, BLOCK_STORE_PACKS_DIR)))
+            continue;
 
-        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") || !strcmp(ent->d_name, "version"))
+        if (!is_shard_name(&store->config, ent->d_name)) {
+            warn("invalid sharding directory '%s/%s'", path, ent->d_name);
+            err = -1;
             continue;
+        }
 
-        if (fstatat(store.fd, ent->d_name, &stat, 0) < 0) {
-            warn("unable to stat shard '%s'", ent->d_name);
+        if (level)
+            snprintf(subpath, sizeof(subpath), "%s/%s", path, ent->d_name);
+        else
+            snprintf(subpath, sizeof(subpath), "%s", ent->d_name);
+
+        if (fstatat(store->fd, subpath, &stat, 0) < 0) {
+            warn("unable to stat shard '%s'", subpath);
             err = -1;
             continue;
         }
 
         if (!S_ISDIR(stat.st_mode)) {
-            warn("invalid shard '%s/%s'", argv[1], ent->d_name);
+            warn("invalid shard '%s/%s'", path, ent->d_name);
             err = -1;
             continue;
         }
 
-        if (strlen(ent->d_name) != 2 ||
-            !strchr(HEXCHARS, ent->d_name[0]) ||
-            !strchr(HEXCHARS, ent->d_name[1]))
-        {
-            warn("invalid sharding directory '%s/%s'", argv[1], ent->d_name);
+        if ((level + 1 == store->config.shard_depth ?
+                    scan_shard(store, subpath) :
+                    scan_level(store, subpath, level + 1)) < 0) {
+            warn("invalid sharding directory '%s/%s'", path, ent->d_name);
             err = -1;
             continue;
         }
+    }
 
-        if (scan_shard(store.fd, ent->d_name) < 0) {
-            warn("invalid sharding directory '%s/%s'", argv[1], ent->d_name);
+    if (try_closedir(dir) < 0) {
+        warn("could not close directory '%s'", path);
+        err = -1;
+    }
+
+    return err;
+}
+
+/* Verify that every block of every pack is intact. */
+static int scan_packs(struct store *store)
+{
+    struct hash computed_hash, expected_hash;
+    struct pack_entry entry;
+    struct stat st;
+    size_t i, j;
+    int err = 0;
+
+    if (store_packs_load(store) < 0) {
+        warn("unable to load packs: %s", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < store->npacks; i++) {
+        const struct pack *pack = &store->packs[i];
+
+        if (fstat(pack->fd, &st) < 0) {
+            warn("unable to stat pack %08"PRIx32, pack->id);
             err = -1;
             continue;
         }
+
+        for (j = 0; j < pack->nrecords; j++) {
+            ssize_t bytes;
+
+            pack_entry_at(&entry, pack, j);
+            hash_from_bin(&expected_hash, entry.hash, HASH_LEN);
+
+            if (entry.size > BLOCK_LEN || entry.offset + entry.size > (uint64_t) st.st_size) {
+                warn("invalid extent for block %s in pack %08"PRIx32, expected_hash.hex, pack->id);
+                err = -1;
+                continue;
+            }
+
+            if ((bytes = pread_bytes(pack->fd, block, entry.size, (off_t) entry.offset)) != (ssize_t) entry.size) {
+                warn("unable to read block %s from pack %08"PRIx32, expected_hash.hex, pack->id);
+                err = -1;
+                continue;
+            }
+            metrics_add(METRIC_STORE_READ_BYTES, (uintmax_t) bytes);
+
+            if (hash_compute(&computed_hash, block, entry.size) < 0 ||
+                    !hash_eq(&computed_hash, &expected_hash)) {
+                warn("Hash mismatch for block %s in pack %08"PRIx32, expected_hash.hex, pack->id);
+                err = -1;
+            }
+        }
     }
 
-    if (try_closedir(storedir) < 0) {
-        warn("could not close store directory");
-        err = -1;
+    return err;
+}
+
+int gob_fsck(int argc, const char *argv[])
+{
+    struct store store;
+    int i, err = 0;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            if (metrics_enable(argv[++i], "fsck") < 0)
+                die_errno("Unable to write metrics to '%s'", argv[i]);
+        } else
+            die("Unknown option '%s'", argv[i]);
     }
 
+    if (argc - i != 1)
+        die("USAGE: %s fsck [--metrics <FILE>] <DIR>", argv[0]);
+
+    atexit(close_stdout);
+
+    if ((block = malloc(BLOCK_LEN)) == NULL)
+        die_errno("Unable to allocate block");
+
+    if (store_open(&store, argv[i]) < 0)
+        die("Unable to open store");
+
+    if (scan_level(&store, argv[i], 0) < 0)
+        err = -1;
+
+    if (scan_packs(&store) < 0)
+        err = -1;
+
     if (store_close(&store) < 0) {
         warn("could not close store");
         err = -1;
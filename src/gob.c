@@ -24,10 +24,18 @@ static struct {
     const char *name;
     const char *description;
 } commands[] = {
+    { gob_analyze, "analyze", "Estimate deduplication of chunking parameters" },
+    { gob_bundle, "bundle", "Export or import a bundle of blocks" },
     { gob_cat,   "cat",   "Concatenate chunks" },
+    { gob_cat_many, "cat-many", "Restore multiple indices at once" },
+    { gob_catalog, "catalog", "Maintain the block catalog of a store" },
     { gob_chunk, "chunk", "Chunk and store data" },
+    { gob_chunk_tree, "chunk-tree", "Chunk and store a directory tree" },
     { gob_fsck,  "fsck",  "Check consistency of a store"  },
     { gob_init,  "init",  "Initialize a new store"  },
+    { gob_repack, "repack", "Rewrite blocks of indices into contiguous packs" },
+    { gob_reshard, "reshard", "Change the sharding layout of a store" },
+    { gob_verify, "verify", "Check that an index can be restored" },
 };
 
 int main(int argc, const char *argv[])
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#ifdef HAVE_SSSE3
+# include <tmmintrin.h>
+#endif
+
+static const char to_hex[] = "0123456789abcdef";
+
+static const signed char from_hex[] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 00 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 10 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 20 */
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1, /* 30 */
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 40 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 50 */
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 60 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 70 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 80 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 90 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* a0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* b0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* c0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* d0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* e0 */
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* f0 */
+};
+
+static void hex_encode_scalar(char *out, const unsigned char *in, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        *out++ = to_hex[((unsigned int) in[i]) >> 4];
+        *out++ = to_hex[((unsigned int) in[i]) & 0xf];
+    }
+}
+
+static int hex_decode_scalar(unsigned char *out, const char *in, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i += 2) {
+        signed char hi = from_hex[(unsigned char) in[i]];
+        signed char lo = from_hex[(unsigned char) in[i + 1]];
+        if (hi < 0 || lo < 0)
+            return -1;
+        *out++ = (unsigned char) ((hi << 4) | lo);
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_SSSE3
+
+/*
+ * Both nibbles of every byte are used as indices into a shuffle
+ * table holding the hex alphabet, and the results are interleaved
+ * to give 32 characters per 16 input bytes.
+ */
+__attribute__((target("ssse3")))
+static size_t hex_encode_ssse3(char *out, const unsigned char *in, size_t len)
+{
+    const __m128i alphabet = _mm_loadu_si128((const __m128i *) to_hex);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+        __m128i hi = _mm_shuffle_epi8(alphabet, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(alphabet, _mm_and_si128(v, mask));
+
+        _mm_storeu_si128((__m128i *) (out + i * 2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *) (out + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+
+    return i;
+}
+
+/*
+ * Characters are classified as digits or letters with signed
+ * compares, which also reject all non-ASCII bytes as these compare
+ * as negative. Pairs of nibbles are then combined into bytes via a
+ * multiply-add with 16 and 1.
+ */
+__attribute__((target("ssse3")))
+static __m128i hex_decode_nibbles(__m128i c, int *valid)
+{
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+    if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff)
+        *valid = 0;
+
+    return _mm_or_si128(
+            _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+            _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+}
+
+__attribute__((target("ssse3")))
+static int hex_decode_ssse3(unsigned char *out, const char *in, size_t len, size_t *decoded)
+{
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    size_t i;
+    int valid = 1;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m128i a = hex_decode_nibbles(_mm_loadu_si128((const __m128i *) (in + i)), &valid);
+        __m128i b = hex_decode_nibbles(_mm_loadu_si128((const __m128i *) (in + i + 16)), &valid);
+
+        if (!valid)
+            return -1;
+
+        _mm_storeu_si128((__m128i *) (out + i / 2),
+                _mm_packus_epi16(_mm_maddubs_epi16(a, weights), _mm_maddubs_epi16(b, weights)));
+    }
+
+    *decoded = i;
+    return 0;
+}
+
+#endif
+
+void hex_encode(char *out, const unsigned char *in, size_t len)
+{
+    size_t done = 0;
+
+#ifdef HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3"))
+        done = hex_encode_ssse3(out, in, len);
+#endif
+
+    hex_encode_scalar(out + done * 2, in + done, len - done);
+}
+
+int hex_decode(unsigned char *out, const char *in, size_t len)
+{
+    size_t done = 0;
+
+    if (len % 2)
+        return -1;
+
+#ifdef HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3") && hex_decode_ssse3(out, in, len, &done) < 0)
+        return -1;
+#endif
+
+    return hex_decode_scalar(out + done / 2, in + done, len - done);
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+
+int index_writer_init(struct index_writer *writer, int fd)
+{
+    writer->fd = fd;
+    writer->len = 0;
+    if ((writer->buf = malloc(INDEX_BUFFER_LEN)) == NULL)
+        return -1;
+    return 0;
+}
+
+int index_writer_flush(struct index_writer *writer)
+{
+    if (writer->len && write_bytes(writer->fd, (unsigned char *) writer->buf, writer->len) < 0)
+        return -1;
+    writer->len = 0;
+    return 0;
+}
+
+int index_writer_add(struct index_writer *writer, const struct hash *hash)
+{
+    if (writer->len + HASH_LEN * 2 + 1 > INDEX_BUFFER_LEN && index_writer_flush(writer) < 0)
+        return -1;
+
+    memcpy(writer->buf + writer->len, hash->hex, HASH_LEN * 2);
+    writer->buf[writer->len + HASH_LEN * 2] = '\n';
+    writer->len += HASH_LEN * 2 + 1;
+
+    return 0;
+}
+
+int index_writer_trailer(struct index_writer *writer, const struct hash *hash, uintmax_t len)
+{
+    char trailer[HASH_LEN * 2 + 64];
+    int n;
+
+    n = snprintf(trailer, sizeof(trailer), ">%s %"PRIuMAX"\n", hash->hex, len);
+
+    if (writer->len + (size_t) n > INDEX_BUFFER_LEN && index_writer_flush(writer) < 0)
+        return -1;
+
+    memcpy(writer->buf + writer->len, trailer, (size_t) n);
+    writer->len += (size_t) n;
+
+    return index_writer_flush(writer);
+}
+
+void index_writer_free(struct index_writer *writer)
+{
+    free(writer->buf);
+    writer->buf = NULL;
+}
+
+int index_reader_init(struct index_reader *reader, int fd)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->alloc = INDEX_BUFFER_LEN;
+    if ((reader->buf = malloc(reader->alloc)) == NULL)
+        return -1;
+    return 0;
+}
+
+/*
+ * Lines are returned in place. The buffer always keeps one byte of
+ * slack so that a last line without trailing newline can be
+ * terminated, too.
+ */
+int index_reader_line(struct index_reader *reader, char **line, size_t *len)
+{
+    char *newline;
+    ssize_t bytes;
+
+    while ((newline = memchr(reader->buf + reader->start, '\n', reader->end - reader->start)) == NULL) {
+        if (reader->eof) {
+            if (reader->start == reader->end)
+                return 0;
+            newline = reader->buf + reader->end;
+            break;
+        }
+
+        if (reader->start) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+
+        if (reader->end + 1 >= reader->alloc) {
+            char *buf;
+            if ((buf = realloc(reader->buf, reader->alloc * 2)) == NULL)
+                return -1;
+            reader->buf = buf;
+            reader->alloc *= 2;
+        }
+
+        if ((bytes = read(reader->fd, reader->buf + reader->end, reader->alloc - reader->end - 1)) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+
+        if (bytes == 0)
+            reader->eof = 1;
+        reader->end += (size_t) bytes;
+    }
+
+    *newline = '\0';
+    *line = reader->buf + reader->start;
+    *len = (size_t) (newline - *line);
+
+    reader->start += *len;
+    if (reader->start < reader->end)
+        reader->start++;
+
+    return 1;
+}
+
+void index_reader_free(struct index_reader *reader)
+{
+    free(reader->buf);
+    reader->buf = NULL;
+}
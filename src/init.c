@@ -19,12 +19,41 @@
 
 int gob_init(int argc, const char *argv[])
 {
-    if (argc != 2)
-        die("USAGE: %s init <DIR>", argv[0]);
+    struct store_config config;
+    int i;
+
+    store_config_init(&config);
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--shard-depth") && i + 1 < argc)
+            config.shard_depth = (unsigned) strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--shard-width") && i + 1 < argc)
+            config.shard_width = (unsigned) strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+            if (!*argv[++i] || strlen(argv[i]) >= sizeof(config.cache))
+                die("Invalid cache store '%s'", argv[i]);
+            strcpy(config.cache, argv[i]);
+        } else if (!strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+            if (parse_size(&config.cache_size, argv[++i]) < 0)
+                die("Invalid cache size '%s'", argv[i]);
+        } else if (!strcmp(argv[i], "--delta-depth") && i + 1 < argc) {
+            config.delta_depth = (unsigned) strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--backend") && i + 1 < argc) {
+            if (strlen(argv[++i]) >= sizeof(config.backend) || store_backend_find(argv[i]) == NULL)
+                die("Unknown backend '%s'", argv[i]);
+            if (store_backend_find(argv[i]) == &memory_backend)
+                die("Backend '%s' is only available to benchmarks", argv[i]);
+            strcpy(config.backend, argv[i]);
+        } else
+            die("Unknown option '%s'", argv[i]);
+    }
+
+    if (argc - i != 1 || (config.cache_size && !config.cache[0]))
+        die("USAGE: %s init [--shard-depth <N>] [--shard-width <N>] [--cache <DIR> [--cache-size <SIZE>]] [--delta-depth <N>] [--backend <NAME>] <DIR>", argv[0]);
 
     atexit(close_stdout);
 
-    if (store_init(argv[1]) < 0)
+    if (store_init(argv[i], &config) < 0)
         die("Unable to initialize store");
 
     return 0;
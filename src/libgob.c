@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "libgob.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define GOB_DEFAULT_CACHE_SIZE (16 * BLOCK_LEN)
+
+struct gob_store {
+    struct store store;
+};
+
+struct gob_index {
+    struct gob_store *store;
+    struct hash *hashes;
+    size_t nhashes;
+    uint64_t size;
+    struct block_cache cache;
+    unsigned char *block;
+    struct gob_stats stats;
+};
+
+int gob_store_open(struct gob_store **out, const char *path)
+{
+    struct gob_store *store;
+
+    if ((store = malloc(sizeof(*store))) == NULL)
+        return -1;
+
+    if (store_open(&store->store, path) < 0) {
+        free(store);
+        return -1;
+    }
+
+    *out = store;
+    return 0;
+}
+
+void gob_store_close(struct gob_store *store)
+{
+    if (!store)
+        return;
+    store_close(&store->store);
+    free(store);
+}
+
+static int parse_index(struct gob_index *index, int fd)
+{
+    struct index_reader reader;
+    size_t linelen, alloc = 0;
+    char *line, *end;
+    int err;
+
+    if (index_reader_init(&reader, fd) < 0)
+        return -1;
+
+    while ((err = index_reader_line(&reader, &line, &linelen)) > 0 && *line != '>') {
+        if (index->nhashes == alloc) {
+            struct hash *hashes;
+
+            alloc = alloc ? alloc * 2 : 1024;
+            if ((hashes = realloc(index->hashes, alloc * sizeof(*hashes))) == NULL) {
+                err = -1;
+                goto out;
+            }
+            index->hashes = hashes;
+        }
+
+        if (hash_from_str(&index->hashes[index->nhashes], line, linelen) < 0) {
+            errno = EINVAL;
+            err = -1;
+            goto out;
+        }
+        index->nhashes++;
+    }
+
+    if (err < 0)
+        goto out;
+
+    if (err == 0 || linelen < HASH_LEN * 2 + 3 || line[HASH_LEN * 2 + 1] != ' ') {
+        errno = EINVAL;
+        err = -1;
+        goto out;
+    }
+
+    index->size = (uint64_t) strtoumax(line + HASH_LEN * 2 + 2, &end, 10);
+    if (*end || (index->size + BLOCK_LEN - 1) / BLOCK_LEN != index->nhashes) {
+        errno = EINVAL;
+        err = -1;
+        goto out;
+    }
+
+    err = 0;
+
+out:
+    index_reader_free(&reader);
+    return err;
+}
+
+int gob_index_open(struct gob_index **out, struct gob_store *store,
+        const char *path, size_t cache_size)
+{
+    struct gob_index *index;
+    int fd = -1, saved_errno;
+
+    if ((index = calloc(1, sizeof(*index))) == NULL)
+        return -1;
+    index->store = store;
+
+    if (block_cache_init(&index->cache, cache_size ? cache_size : GOB_DEFAULT_CACHE_SIZE) < 0) {
+        free(index);
+        return -1;
+    }
+
+    if ((index->block = malloc(BLOCK_LEN)) == NULL ||
+            (fd = open(path, O_RDONLY)) < 0 ||
+            parse_index(index, fd) < 0 ||
+            try_close(fd) < 0) {
+        saved_errno = errno;
+        if (fd >= 0)
+            close(fd);
+        gob_index_close(index);
+        errno = saved_errno;
+        return -1;
+    }
+
+    *out = index;
+    return 0;
+}
+
+void gob_index_close(struct gob_index *index)
+{
+    if (!index)
+        return;
+    block_cache_free(&index->cache);
+    free(index->hashes);
+    free(index->block);
+    free(index);
+}
+
+uint64_t gob_index_size(const struct gob_index *index)
+{
+    return index->size;
+}
+
+/*
+ * Return the data of the given block, which stays valid until the
+ * next block is loaded. As the hash of a block also covers its
+ * length, blocks only need to be verified when read from the store.
+ */
+static const unsigned char *load_block(struct gob_index *index, size_t blocknr, size_t *len)
+{
+    const struct hash *hash = &index->hashes[blocknr];
+    const unsigned char *data;
+    struct hash computed;
+    ssize_t bytes;
+
+    if ((data = block_cache_get(&index->cache, hash, len)) != NULL)
+        return data;
+
+    if ((bytes = store_read(index->block, BLOCK_LEN, &index->store->store, hash)) < 0)
+        return NULL;
+
+    if (hash_compute(&computed, index->block, (size_t) bytes) < 0 || !hash_eq(&computed, hash)) {
+        errno = EIO;
+        return NULL;
+    }
+
+    block_cache_put(&index->cache, hash, index->block, (size_t) bytes);
+
+    *len = (size_t) bytes;
+    return index->block;
+}
+
+ssize_t gob_index_pread(struct gob_index *index, void *buf, size_t len, uint64_t offset)
+{
+    unsigned char *out = buf;
+    size_t total = 0;
+
+    if (len > SSIZE_MAX)
+        len = SSIZE_MAX;
+
+    index->stats.reads++;
+
+    while (total < len && offset < index->size) {
+        size_t blocknr = (size_t) (offset / BLOCK_LEN), blockoff = (size_t) (offset % BLOCK_LEN);
+        const unsigned char *data;
+        size_t blocklen, n;
+
+        if ((data = load_block(index, blocknr, &blocklen)) == NULL)
+            return -1;
+
+        if (blockoff >= blocklen) {
+            errno = EIO;
+            return -1;
+        }
+
+        n = blocklen - blockoff;
+        if (n > len - total)
+            n = len - total;
+
+        memcpy(out + total, data + blockoff, n);
+        total += n;
+        offset += n;
+    }
+
+    index->stats.bytes_read += total;
+
+    return (ssize_t) total;
+}
+
+void gob_index_stats(const struct gob_index *index, struct gob_stats *out)
+{
+    *out = index->stats;
+    out->cache_hits = index->cache.hits;
+    out->cache_misses = index->cache.misses;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBGOB_H
+#define LIBGOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+# define GOB_EXTERN __attribute__((visibility("default")))
+#else
+# define GOB_EXTERN
+#endif
+
+/*
+ * libgob provides in-process random access to data backed up with
+ * gob-chunk(1). All functions return a negative value and set errno
+ * on failure.
+ *
+ * A store may be shared by multiple indices, but neither stores nor
+ * indices may be used from multiple threads at the same time.
+ */
+
+struct gob_store;
+struct gob_index;
+
+struct gob_stats {
+    uint64_t reads;
+    uint64_t bytes_read;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+};
+
+GOB_EXTERN int gob_store_open(struct gob_store **out, const char *path);
+GOB_EXTERN void gob_store_close(struct gob_store *store);
+
+/*
+ * Open the index at the given path. Up to "cache_size" bytes of
+ * recently read blocks are kept in memory, where 0 selects a default.
+ */
+GOB_EXTERN int gob_index_open(struct gob_index **out, struct gob_store *store,
+        const char *path, size_t cache_size);
+GOB_EXTERN void gob_index_close(struct gob_index *index);
+
+/* Returns the length of the data described by the index. */
+GOB_EXTERN uint64_t gob_index_size(const struct gob_index *index);
+
+/*
+ * Read up to "len" bytes starting at "offset". Every block is
+ * checked against its hash when being read from the store. Returns
+ * the number of bytes read, which is only short at the end of data.
+ */
+GOB_EXTERN ssize_t gob_index_pread(struct gob_index *index, void *buf, size_t len, uint64_t offset);
+
+GOB_EXTERN void gob_index_stats(const struct gob_index *index, struct gob_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
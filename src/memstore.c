@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* S_IFREG is only part of the X/Open System Interfaces. */
+#define _XOPEN_SOURCE 700
+
+#include "common.h"
+
+#include <sys/stat.h>
+
+/*
+ * The memory backend keeps blocks in a hash table which is shared by
+ * all opened instances of the same store within a process, so that
+ * e.g. multiple jobs can read blocks written before. Blocks are lost
+ * once the last instance has been closed. This allows measuring the
+ * cost of chunking and restoring without any filesystem involved.
+ */
+
+struct memory_block {
+    unsigned char hash[HASH_LEN];
+    unsigned char *data;
+    size_t len;
+    uint64_t seq;
+};
+
+struct memory_store {
+    struct memory_store *next;
+    dev_t dev;
+    ino_t ino;
+    unsigned refs;
+    pthread_mutex_t lock;
+    struct memory_block *blocks;
+    size_t nblocks, nslots;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct memory_store *registry;
+
+static size_t slot_of(const struct memory_store *ms, const unsigned char *hash)
+{
+    size_t slot = 0, i;
+
+    for (i = 0; i < sizeof(slot); i++)
+        slot = (slot << 8) | hash[i];
+
+    return slot & (ms->nslots - 1);
+}
+
+/* Return the slot of the given block or the empty slot it belongs to. */
+static struct memory_block *lookup(const struct memory_store *ms, const unsigned char *hash)
+{
+    size_t slot = slot_of(ms, hash);
+
+    while (ms->blocks[slot].data && memcmp(ms->blocks[slot].hash, hash, HASH_LEN))
+        slot = (slot + 1) & (ms->nslots - 1);
+
+    return &ms->blocks[slot];
+}
+
+static int grow(struct memory_store *ms)
+{
+    struct memory_block *old = ms->blocks;
+    size_t i, nslots = ms->nslots;
+
+    if ((ms->blocks = calloc(nslots * 2, sizeof(*ms->blocks))) == NULL) {
+        ms->blocks = old;
+        return -1;
+    }
+    ms->nslots = nslots * 2;
+
+    for (i = 0; i < nslots; i++)
+        if (old[i].data)
+            *lookup(ms, old[i].hash) = old[i];
+
+    free(old);
+    return 0;
+}
+
+static int memory_open(struct store *store)
+{
+    struct memory_store *ms;
+    struct stat st;
+    int err = 0;
+
+    if (fstat(store->fd, &st) < 0)
+        return -1;
+
+    if ((err = pthread_mutex_lock(&registry_lock)) != 0) {
+        errno = err;
+        return -1;
+    }
+
+    for (ms = registry; ms; ms = ms->next)
+        if (ms->dev == st.st_dev && ms->ino == st.st_ino)
+            break;
+
+    if (ms == NULL) {
+        if ((ms = calloc(1, sizeof(*ms))) == NULL ||
+                (ms->blocks = calloc(1024, sizeof(*ms->blocks))) == NULL ||
+                (err = pthread_mutex_init(&ms->lock, NULL)) != 0) {
+            if (ms)
+                free(ms->blocks);
+            free(ms);
+            if (err)
+                errno = err;
+            err = -1;
+            goto out;
+        }
+        ms->dev = st.st_dev;
+        ms->ino = st.st_ino;
+        ms->nslots = 1024;
+        ms->next = registry;
+        registry = ms;
+    }
+
+    ms->refs++;
+    store->backend_data = ms;
+
+out:
+    pthread_mutex_unlock(&registry_lock);
+    return err;
+}
+
+static int memory_close(struct store *store)
+{
+    struct memory_store *ms = store->backend_data, **prev;
+    size_t i;
+
+    pthread_mutex_lock(&registry_lock);
+
+    if (--ms->refs) {
+        pthread_mutex_unlock(&registry_lock);
+        return 0;
+    }
+
+    for (prev = &registry; *prev != ms; prev = &(*prev)->next);
+    *prev = ms->next;
+
+    pthread_mutex_unlock(&registry_lock);
+
+    for (i = 0; i < ms->nslots; i++)
+        free(ms->blocks[i].data);
+    free(ms->blocks);
+    pthread_mutex_destroy(&ms->lock);
+    free(ms);
+
+    return 0;
+}
+
+static int memory_put(size_t *stored, struct store *store, const struct hash *hash,
+        const unsigned char *data, size_t datalen, int srcfd, off_t srcoff)
+{
+    struct memory_store *ms = store->backend_data;
+    struct memory_block *block;
+    int written = -1;
+
+    (void) srcfd;
+    (void) srcoff;
+
+    pthread_mutex_lock(&ms->lock);
+
+    if ((block = lookup(ms, hash->bin))->data) {
+        written = 0;
+        goto out;
+    }
+
+    if ((ms->nblocks + 1) * 2 > ms->nslots) {
+        if (grow(ms) < 0)
+            goto out;
+        block = lookup(ms, hash->bin);
+    }
+
+    /* Empty blocks still need a non-NULL pointer to mark their slot. */
+    if ((block->data = malloc(datalen ? datalen : 1)) == NULL)
+        goto out;
+    memcpy(block->data, data, datalen);
+    memcpy(block->hash, hash->bin, HASH_LEN);
+    block->len = datalen;
+    block->seq = ms->nblocks++;
+
+    *stored = datalen;
+    written = 1;
+
+out:
+    pthread_mutex_unlock(&ms->lock);
+    return written;
+}
+
+static ssize_t memory_read(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash)
+{
+    struct memory_store *ms = store->backend_data;
+    const struct memory_block *block;
+    ssize_t len = -1;
+
+    pthread_mutex_lock(&ms->lock);
+
+    if ((block = lookup(ms, hash->bin))->data == NULL) {
+        errno = ENOENT;
+        goto out;
+    }
+
+    len = (ssize_t) (block->len < outlen ? block->len : outlen);
+    memcpy(out, block->data, (size_t) len);
+
+out:
+    pthread_mutex_unlock(&ms->lock);
+    return len;
+}
+
+static int memory_stat(struct stat *out, struct store *store, const struct hash *hash)
+{
+    struct memory_store *ms = store->backend_data;
+    const struct memory_block *block;
+    int err = 0;
+
+    pthread_mutex_lock(&ms->lock);
+
+    if ((block = lookup(ms, hash->bin))->data == NULL) {
+        errno = ENOENT;
+        err = -1;
+    } else {
+        memset(out, 0, sizeof(*out));
+        out->st_mode = S_IFREG | 0444;
+        out->st_nlink = 1;
+        out->st_size = (off_t) block->len;
+    }
+
+    pthread_mutex_unlock(&ms->lock);
+    return err;
+}
+
+/* Blocks are located in the order they have been written. */
+static int memory_locate(uint64_t *out, struct store *store, const struct hash *hash)
+{
+    struct memory_store *ms = store->backend_data;
+    const struct memory_block *block;
+    int err = 0;
+
+    pthread_mutex_lock(&ms->lock);
+
+    if ((block = lookup(ms, hash->bin))->data == NULL) {
+        errno = ENOENT;
+        err = -1;
+    } else {
+        *out = block->seq;
+    }
+
+    pthread_mutex_unlock(&ms->lock);
+    return err;
+}
+
+const struct store_backend memory_backend = {
+    "memory",
+    memory_open,
+    memory_close,
+    memory_put,
+    memory_read,
+    memory_stat,
+    memory_locate,
+    NULL
+};
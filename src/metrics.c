@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#define METRICS_INTERVAL 5
+
+static const char *counter_names[METRIC_COUNTER_MAX] = {
+    "gob_input_bytes_total",
+    "gob_output_bytes_total",
+    "gob_store_read_bytes_total",
+    "gob_store_written_bytes_total",
+    "gob_blocks_new_total",
+    "gob_blocks_deduplicated_total",
+    "gob_errors_total",
+    "gob_cache_hits_total",
+    "gob_cache_misses_total",
+    "gob_cache_evicted_bytes_total",
+    "gob_store_cloned_bytes_total",
+    "gob_blocks_delta_total",
+};
+
+static const char *histogram_names[METRIC_HISTOGRAM_MAX] = {
+    "gob_store_write_seconds",
+    "gob_store_read_seconds",
+    "gob_hash_seconds",
+};
+
+static const double bounds[] = {
+    0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5
+};
+#define NBOUNDS (sizeof(bounds) / sizeof(*bounds))
+
+struct histogram {
+    uintmax_t buckets[NBOUNDS];
+    uintmax_t count;
+    double sum;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uintmax_t counters[METRIC_COUNTER_MAX];
+static struct histogram histograms[METRIC_HISTOGRAM_MAX];
+static const char *metrics_path;
+static const char *metrics_command;
+static time_t last_write;
+static int enabled;
+
+/* Needs to be called with the lock held. */
+static int write_metrics(void)
+{
+    char tmp[4096];
+    size_t i, j;
+    FILE *f;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", metrics_path, (long) getpid()) >= (int) sizeof(tmp) ||
+            (f = fopen(tmp, "w")) == NULL)
+        return -1;
+
+    for (i = 0; i < METRIC_COUNTER_MAX; i++) {
+        fprintf(f, "# TYPE %s counter\n", counter_names[i]);
+        fprintf(f, "%s{command=\"%s\"} %"PRIuMAX"\n", counter_names[i], metrics_command, counters[i]);
+    }
+
+    for (i = 0; i < METRIC_HISTOGRAM_MAX; i++) {
+        const struct histogram *h = &histograms[i];
+
+        fprintf(f, "# TYPE %s histogram\n", histogram_names[i]);
+        for (j = 0; j < NBOUNDS; j++)
+            fprintf(f, "%s_bucket{command=\"%s\",le=\"%g\"} %"PRIuMAX"\n",
+                    histogram_names[i], metrics_command, bounds[j], h->buckets[j]);
+        fprintf(f, "%s_bucket{command=\"%s\",le=\"+Inf\"} %"PRIuMAX"\n",
+                histogram_names[i], metrics_command, h->count);
+        fprintf(f, "%s_sum{command=\"%s\"} %f\n", histogram_names[i], metrics_command, h->sum);
+        fprintf(f, "%s_count{command=\"%s\"} %"PRIuMAX"\n", histogram_names[i], metrics_command, h->count);
+    }
+
+    last_write = time(NULL);
+    fprintf(f, "# TYPE gob_last_update_timestamp_seconds gauge\n");
+    fprintf(f, "gob_last_update_timestamp_seconds{command=\"%s\"} %ld\n", metrics_command, (long) last_write);
+
+    if (ferror(f)) {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+
+    if (fclose(f) != 0 || rename(tmp, metrics_path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Needs to be called with the lock held. */
+static void maybe_write_metrics(void)
+{
+    /* We cannot use warn() here, as it would try to count the error itself. */
+    if (time(NULL) - last_write >= METRICS_INTERVAL && write_metrics() < 0) {
+        fprintf(stderr, "Unable to write metrics to '%s'\n", metrics_path);
+        counters[METRIC_ERRORS]++;
+    }
+}
+
+static void flush_metrics(void)
+{
+    pthread_mutex_lock(&lock);
+    if (write_metrics() < 0)
+        fprintf(stderr, "Unable to write metrics to '%s'\n", metrics_path);
+    pthread_mutex_unlock(&lock);
+}
+
+int metrics_enable(const char *path, const char *command)
+{
+    metrics_path = path;
+    metrics_command = command;
+    enabled = 1;
+
+    pthread_mutex_lock(&lock);
+    if (write_metrics() < 0) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return atexit(flush_metrics);
+}
+
+void metrics_add(enum metric_counter counter, uintmax_t value)
+{
+    if (!enabled)
+        return;
+
+    pthread_mutex_lock(&lock);
+    counters[counter] += value;
+    maybe_write_metrics();
+    pthread_mutex_unlock(&lock);
+}
+
+void metrics_start(struct timespec *start)
+{
+    if (enabled)
+        clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+void metrics_observe(enum metric_histogram histogram, const struct timespec *start)
+{
+    struct histogram *h = &histograms[histogram];
+    struct timespec now;
+    double seconds;
+    size_t i;
+
+    if (!enabled)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < NBOUNDS; i++)
+        if (seconds <= bounds[i])
+            h->buckets[i]++;
+    h->count++;
+    h->sum += seconds;
+    maybe_write_metrics();
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Packs hold blocks which have been rewritten contiguously by
+ * gob-repack(1). Every pack consists of a data file with the
+ * concatenated blocks and an index file with one record per block,
+ * sorted by hash:
+ *
+ *     header:  magic (8), version (4), record length (4)
+ *     record:  hash (HASH_LEN), offset (8), size (4)
+ *
+ * A pack only becomes visible once its index has been renamed into
+ * place, which happens after all of its data has been synced.
+ */
+
+#include "common.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static void encode_u32(unsigned char *out, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(out, &value, 4);
+}
+
+static uint32_t decode_u32(const unsigned char *in)
+{
+    uint32_t value;
+    memcpy(&value, in, 4);
+    return ntohl(value);
+}
+
+static void pack_encode(unsigned char *out, const struct pack_entry *entry)
+{
+    memcpy(out, entry->hash, HASH_LEN);
+    encode_u32(out + HASH_LEN, (uint32_t) (entry->offset >> 32));
+    encode_u32(out + HASH_LEN + 4, (uint32_t) entry->offset);
+    encode_u32(out + HASH_LEN + 8, entry->size);
+}
+
+static void pack_decode(struct pack_entry *out, const unsigned char *in)
+{
+    memcpy(out->hash, in, HASH_LEN);
+    out->offset = ((uint64_t) decode_u32(in + HASH_LEN) << 32) | decode_u32(in + HASH_LEN + 4);
+    out->size = decode_u32(in + HASH_LEN + 8);
+}
+
+void pack_entry_at(struct pack_entry *out, const struct pack *pack, size_t i)
+{
+    pack_decode(out, pack->records + i * PACK_RECORD_LEN);
+}
+
+int pack_name(char *out, size_t outlen, uint32_t id, const char *suffix)
+{
+    int len = snprintf(out, outlen, "%08"PRIx32".%s", id, suffix);
+    if (len < 0 || (size_t) len >= outlen) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_index_name(uint32_t *out, const char *name)
+{
+    if (strlen(name) != 12 || strspn(name, "0123456789abcdef") != 8 || strcmp(name + 8, ".idx"))
+        return -1;
+
+    *out = (uint32_t) strtoul(name, NULL, 16);
+    return 0;
+}
+
+static int load_pack(struct pack *out, int packsfd, uint32_t id)
+{
+    unsigned char header[PACK_HEADER_LEN];
+    char name[32];
+    struct stat st;
+    size_t len;
+    int fd;
+
+    memset(out, 0, sizeof(*out));
+    out->id = id;
+    out->fd = -1;
+
+    if (pack_name(name, sizeof(name), id, "idx") < 0 || (fd = openat(packsfd, name, O_RDONLY)) < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || st.st_size < PACK_HEADER_LEN ||
+            (st.st_size - PACK_HEADER_LEN) % PACK_RECORD_LEN ||
+            pread_bytes(fd, header, sizeof(header), 0) != sizeof(header))
+        goto err;
+
+    if (memcmp(header, PACK_MAGIC, 8) || decode_u32(header + 8) != PACK_VERSION ||
+            decode_u32(header + 12) != PACK_RECORD_LEN) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    len = (size_t) st.st_size - PACK_HEADER_LEN;
+    out->nrecords = len / PACK_RECORD_LEN;
+    if ((out->records = malloc(len ? len : 1)) == NULL ||
+            pread_bytes(fd, out->records, len, PACK_HEADER_LEN) != (ssize_t) len)
+        goto err;
+
+    if (try_close(fd) < 0) {
+        fd = -1;
+        goto err;
+    }
+    fd = -1;
+
+    if (pack_name(name, sizeof(name), id, "pack") < 0 || (out->fd = openat(packsfd, name, O_RDONLY)) < 0)
+        goto err;
+
+    return 0;
+
+err:
+    if (fd >= 0)
+        close(fd);
+    free(out->records);
+    out->records = NULL;
+    return -1;
+}
+
+static int pack_cmp(const void *a, const void *b)
+{
+    const struct pack *x = a, *y = b;
+    return x->id < y->id ? 1 : x->id > y->id ? -1 : 0;
+}
+
+/*
+ * Load all packs which have not been loaded yet. Packs are ordered
+ * by descending ID, so that blocks are looked up in the most recent
+ * pack first.
+ */
+int store_packs_load(struct store *store)
+{
+    struct dirent *ent;
+    size_t i;
+    DIR *dir;
+    int fd;
+
+    store->packs_loaded = 1;
+
+    if ((fd = openat(store->fd, BLOCK_STORE_PACKS_DIR, O_RDONLY)) < 0)
+        return errno == ENOENT ? 0 : -1;
+    if ((dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    while ((errno = 0, ent = readdir(dir)) != NULL) {
+        struct pack *packs;
+        uint32_t id;
+
+        if (parse_index_name(&id, ent->d_name) < 0)
+            continue;
+        for (i = 0; i < store->npacks; i++)
+            if (store->packs[i].id == id)
+                break;
+        if (i < store->npacks)
+            continue;
+
+        if ((packs = realloc(store->packs, (store->npacks + 1) * sizeof(*packs))) == NULL)
+            goto err;
+        store->packs = packs;
+
+        /* The pack may have been superseded and removed concurrently. */
+        if (load_pack(&store->packs[store->npacks], dirfd(dir), id) < 0) {
+            if (errno == ENOENT)
+                continue;
+            goto err;
+        }
+        store->npacks++;
+    }
+    if (errno)
+        goto err;
+
+    qsort(store->packs, store->npacks, sizeof(*store->packs), pack_cmp);
+
+    return try_closedir(dir);
+
+err:
+    closedir(dir);
+    return -1;
+}
+
+void store_packs_free(struct store *store)
+{
+    size_t i;
+
+    for (i = 0; i < store->npacks; i++) {
+        close(store->packs[i].fd);
+        free(store->packs[i].records);
+    }
+    free(store->packs);
+    store->packs = NULL;
+    store->npacks = 0;
+    store->packs_loaded = 0;
+}
+
+int pack_lookup(struct pack_entry *out, const struct pack *pack, const struct hash *hash)
+{
+    size_t lo = 0, hi = pack->nrecords;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const unsigned char *record = pack->records + mid * PACK_RECORD_LEN;
+        int cmp = memcmp(hash->bin, record, HASH_LEN);
+
+        if (!cmp) {
+            pack_decode(out, record);
+            return 0;
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return -1;
+}
+
+static const struct pack *find_in_packs(struct pack_entry *out, const struct store *store,
+        const struct hash *hash)
+{
+    size_t i;
+
+    for (i = 0; i < store->npacks; i++)
+        if (pack_lookup(out, &store->packs[i], hash) == 0)
+            return &store->packs[i];
+
+    return NULL;
+}
+
+/*
+ * Look up a block in the packs. If reload is set and the block is
+ * not found, packs which have been created since they were loaded
+ * are loaded and searched as well.
+ */
+const struct pack *store_pack_find(struct pack_entry *out, struct store *store,
+        const struct hash *hash, int reload)
+{
+    const struct pack *pack;
+    int loaded = store->packs_loaded;
+    size_t npacks;
+
+    if (!loaded && store_packs_load(store) < 0)
+        return NULL;
+    if ((pack = find_in_packs(out, store, hash)) != NULL)
+        return pack;
+
+    if (reload && loaded) {
+        npacks = store->npacks;
+        if (store_packs_load(store) < 0)
+            return NULL;
+        if (store->npacks != npacks && (pack = find_in_packs(out, store, hash)) != NULL)
+            return pack;
+    }
+
+    errno = ENOENT;
+    return NULL;
+}
+
+ssize_t store_pack_read(unsigned char *out, size_t outlen, struct store *store, const struct hash *hash)
+{
+    struct pack_entry entry;
+    const struct pack *pack;
+
+    if ((pack = store_pack_find(&entry, store, hash, 1)) == NULL)
+        return -1;
+
+    if (entry.size > outlen) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    return pread_bytes(pack->fd, out, entry.size, (off_t) entry.offset);
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct pack_entry *x = a, *y = b;
+    return memcmp(x->hash, y->hash, HASH_LEN);
+}
+
+/*
+ * Write the index of a pack whose data has been written and synced
+ * already, making the pack visible to readers.
+ */
+int pack_write_index(int packsfd, uint32_t id, struct pack_entry *entries, size_t n)
+{
+    unsigned char *buf;
+    char name[32], tmp[40];
+    size_t i, len = PACK_HEADER_LEN;
+    int fd;
+
+    if (pack_name(name, sizeof(name), id, "idx") < 0 || pack_name(tmp, sizeof(tmp), id, "idx.tmp") < 0)
+        return -1;
+
+    qsort(entries, n, sizeof(*entries), entry_cmp);
+
+    if ((buf = malloc(PACK_HEADER_LEN + n * PACK_RECORD_LEN)) == NULL)
+        return -1;
+
+    memcpy(buf, PACK_MAGIC, 8);
+    encode_u32(buf + 8, PACK_VERSION);
+    encode_u32(buf + 12, PACK_RECORD_LEN);
+    for (i = 0; i < n; i++, len += PACK_RECORD_LEN)
+        pack_encode(buf + len, &entries[i]);
+
+    if ((fd = openat(packsfd, tmp, O_CREAT|O_TRUNC|O_WRONLY, 0644)) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    if (write_bytes(fd, buf, len) < 0 || fsync(fd) < 0) {
+        free(buf);
+        close(fd);
+        unlinkat(packsfd, tmp, 0);
+        return -1;
+    }
+    free(buf);
+
+    if (try_close(fd) < 0 || renameat(packsfd, tmp, packsfd, name) < 0) {
+        unlinkat(packsfd, tmp, 0);
+        return -1;
+    }
+
+    return fsync(packsfd);
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+void plan_init(struct restore_plan *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+}
+
+int plan_add(struct restore_plan *plan, size_t output, const struct hash *hash, uint64_t offset, size_t len)
+{
+    struct plan_ref *ref;
+
+    if (plan->nrefs == plan->allocrefs) {
+        size_t alloc = plan->allocrefs ? plan->allocrefs * 2 : 1024;
+        if ((ref = realloc(plan->refs, alloc * sizeof(*ref))) == NULL)
+            return -1;
+        plan->refs = ref;
+        plan->allocrefs = alloc;
+    }
+
+    ref = &plan->refs[plan->nrefs++];
+    memcpy(&ref->hash, hash, sizeof(*hash));
+    ref->output = output;
+    ref->offset = offset;
+    ref->len = len;
+
+    return 0;
+}
+
+static int ref_cmp(const void *a, const void *b)
+{
+    const struct plan_ref *x = a, *y = b;
+    int cmp = memcmp(x->hash.bin, y->hash.bin, HASH_LEN);
+    if (cmp)
+        return cmp;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int block_cmp(const void *a, const void *b)
+{
+    const struct plan_block *x = a, *y = b;
+    if (x->order != y->order)
+        return x->order < y->order ? -1 : 1;
+    return x->location < y->location ? -1 : x->location > y->location;
+}
+
+/*
+ * Group references by their block so that every block only needs
+ * to be read once, and sort blocks by their on-disk location. If the
+ * location cannot be determined for all blocks, they are sorted by
+ * their inode number instead. Blocks are usually written in the order
+ * they were created, so this approximates their on-disk order. Blocks
+ * sharing a pack are sorted by their first offset in the output.
+ */
+int plan_finalize(struct restore_plan *plan, struct store *store)
+{
+    size_t i;
+    int located = 1;
+
+    qsort(plan->refs, plan->nrefs, sizeof(*plan->refs), ref_cmp);
+
+    for (i = 0; i < plan->nrefs; i++) {
+        struct plan_block *block;
+        struct stat st;
+
+        if (i && hash_eq(&plan->refs[i].hash, &plan->refs[i - 1].hash)) {
+            plan->blocks[plan->nblocks - 1].nrefs++;
+            continue;
+        }
+
+        if ((plan->nblocks % 1024) == 0) {
+            if ((block = realloc(plan->blocks, (plan->nblocks + 1024) * sizeof(*block))) == NULL)
+                return -1;
+            plan->blocks = block;
+        }
+
+        if (store_stat(&st, store, &plan->refs[i].hash) < 0) {
+            warn("Unable to stat block '%s': %s", plan->refs[i].hash.hex, strerror(errno));
+            return -1;
+        }
+
+        block = &plan->blocks[plan->nblocks++];
+        block->hash = &plan->refs[i].hash;
+        block->len = plan->refs[i].len;
+        block->order = (uintmax_t) st.st_ino;
+        block->first = i;
+        block->nrefs = 1;
+
+        if (located && store_locate(&block->location, store, block->hash) < 0)
+            located = 0;
+    }
+
+    for (i = 0; i < plan->nblocks; i++) {
+        if (located)
+            plan->blocks[i].order = (uintmax_t) plan->blocks[i].location;
+        else
+            plan->blocks[i].location = plan->refs[plan->blocks[i].first].offset;
+    }
+
+    qsort(plan->blocks, plan->nblocks, sizeof(*plan->blocks), block_cmp);
+
+    return 0;
+}
+
+void plan_free(struct restore_plan *plan)
+{
+    free(plan->refs);
+    free(plan->blocks);
+}
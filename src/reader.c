@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* O_DIRECT and MADV_HUGEPAGE are not part of POSIX. */
+#define _GNU_SOURCE
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define READER_ALIGNMENT (2 * 1024 * 1024)
+#define DIRECT_ALIGNMENT 4096
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_READING,
+    SLOT_READY
+};
+
+struct reader_slot {
+    unsigned char *buf;
+    ssize_t len;
+    int error;
+    enum slot_state state;
+};
+
+/*
+ * Reads with O_DIRECT must start at aligned offsets, so we cannot
+ * continue after a short read that did not end on an alignment
+ * boundary. Such a short read can only be caused by hitting the end
+ * of the input.
+ */
+static ssize_t read_block(struct reader *reader, unsigned char *buf, off_t offset)
+{
+    size_t total = 0;
+
+    while (total != BLOCK_LEN) {
+        ssize_t bytes = pread(reader->fd, buf + total, BLOCK_LEN - total, offset + (off_t) total);
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (bytes < 0)
+            return -1;
+        if (bytes == 0)
+            break;
+        total += (size_t) bytes;
+        if (reader->direct && total % DIRECT_ALIGNMENT)
+            break;
+    }
+
+    /* Without O_DIRECT, the kernel can at least drop what we have read. */
+    if (!reader->direct && total)
+        posix_fadvise(reader->fd, offset, (off_t) total, POSIX_FADV_DONTNEED);
+
+    return (ssize_t) total;
+}
+
+static void *read_blocks(void *payload)
+{
+    struct reader *reader = payload;
+
+    pthread_mutex_lock(&reader->lock);
+
+    while (1) {
+        struct reader_slot *slot;
+        uintmax_t blocknr;
+        ssize_t len;
+
+        while (!reader->stop && reader->next_read <= reader->eof_block &&
+                reader->slots[reader->next_read % reader->nslots].state != SLOT_FREE)
+            pthread_cond_wait(&reader->cond, &reader->lock);
+        if (reader->stop || reader->next_read > reader->eof_block)
+            break;
+
+        blocknr = reader->next_read++;
+        slot = &reader->slots[blocknr % reader->nslots];
+        slot->state = SLOT_READING;
+
+        pthread_mutex_unlock(&reader->lock);
+        len = read_block(reader, slot->buf, reader->offset + (off_t) (blocknr * BLOCK_LEN));
+        pthread_mutex_lock(&reader->lock);
+
+        slot->error = len < 0 ? errno : 0;
+        slot->len = len;
+        slot->state = SLOT_READY;
+        if (len >= 0 && len < BLOCK_LEN && blocknr < reader->eof_block)
+            reader->eof_block = blocknr;
+        pthread_cond_broadcast(&reader->cond);
+    }
+
+    pthread_mutex_unlock(&reader->lock);
+
+    return NULL;
+}
+
+int reader_init(struct reader *reader, int fd, size_t nthreads, int direct)
+{
+    size_t i;
+    int error;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->eof_block = UINTMAX_MAX;
+    reader->nthreads = nthreads;
+    reader->nslots = nthreads * 2;
+
+    if ((reader->offset = lseek(fd, 0, SEEK_CUR)) < 0)
+        return -1;
+
+    if (direct) {
+#ifdef O_DIRECT
+        char path[64];
+        int directfd;
+
+        if (reader->offset % DIRECT_ALIGNMENT) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /*
+         * The file status flags are shared by everyone using the same
+         * open file description, e.g. the shell that passed us stdin,
+         * so O_DIRECT is only set on a description of our own.
+         */
+        sprintf(path, "/dev/fd/%d", fd);
+        if ((directfd = open(path, O_RDONLY|O_DIRECT)) >= 0) {
+            reader->fd = directfd;
+            reader->direct = 1;
+        } else {
+            warn("Input does not support direct I/O, falling back to buffered reads");
+        }
+#else
+        warn("Direct I/O is not supported, falling back to buffered reads");
+#endif
+    }
+
+    if ((reader->slots = calloc(reader->nslots, sizeof(*reader->slots))) == NULL ||
+            (reader->threads = calloc(nthreads, sizeof(*reader->threads))) == NULL)
+        return -1;
+
+    for (i = 0; i < reader->nslots; i++) {
+        if ((errno = posix_memalign((void **) &reader->slots[i].buf, READER_ALIGNMENT, BLOCK_LEN)) != 0)
+            return -1;
+#ifdef MADV_HUGEPAGE
+        madvise(reader->slots[i].buf, BLOCK_LEN, MADV_HUGEPAGE);
+#endif
+    }
+
+    if ((errno = pthread_mutex_init(&reader->lock, NULL)) != 0 ||
+            (errno = pthread_cond_init(&reader->cond, NULL)) != 0)
+        return -1;
+
+    for (i = 0; i < nthreads; i++) {
+        if ((error = pthread_create(&reader->threads[i], NULL, read_blocks, reader)) != 0) {
+            errno = error;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+ssize_t reader_next(struct reader *reader, const unsigned char **out)
+{
+    struct reader_slot *slot = &reader->slots[reader->next_consume % reader->nslots];
+    ssize_t len;
+
+    pthread_mutex_lock(&reader->lock);
+    while (slot->state != SLOT_READY && reader->next_consume <= reader->eof_block)
+        pthread_cond_wait(&reader->cond, &reader->lock);
+    if (slot->state != SLOT_READY) {
+        pthread_mutex_unlock(&reader->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    if ((len = slot->len) < 0)
+        errno = slot->error;
+    *out = slot->buf;
+
+    return len;
+}
+
+void reader_release(struct reader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->slots[reader->next_consume++ % reader->nslots].state = SLOT_FREE;
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+int reader_close(struct reader *reader)
+{
+    size_t i;
+    int err = 0;
+
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = 1;
+    pthread_cond_broadcast(&reader->cond);
+    pthread_mutex_unlock(&reader->lock);
+
+    for (i = 0; i < reader->nthreads; i++)
+        if (pthread_join(reader->threads[i], NULL) != 0)
+            err = -1;
+
+    for (i = 0; i < reader->nslots; i++)
+        free(reader->slots[i].buf);
+    free(reader->slots);
+    free(reader->threads);
+
+    pthread_cond_destroy(&reader->cond);
+    pthread_mutex_destroy(&reader->lock);
+
+    if (reader->direct && try_close(reader->fd) < 0)
+        err = -1;
+
+    return err;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct repack_block {
+    struct hash hash;
+    size_t seq;
+};
+
+static void read_index(struct repack_block **blocks, size_t *nblocks, size_t *alloc, const char *path)
+{
+    struct index_reader index;
+    size_t linelen;
+    char *line;
+    int fd, err;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        die_errno("Unable to open index '%s'", path);
+
+    if (index_reader_init(&index, fd) < 0)
+        die_errno("Unable to allocate index buffer");
+
+    while ((err = index_reader_line(&index, &line, &linelen)) > 0) {
+        if (*line == '>')
+            break;
+
+        if (*nblocks == *alloc) {
+            *alloc = *alloc ? *alloc * 2 : 1024;
+            if ((*blocks = realloc(*blocks, *alloc * sizeof(**blocks))) == NULL)
+                die_errno("Unable to allocate blocks");
+        }
+
+        if (hash_from_str(&(*blocks)[*nblocks].hash, line, linelen) < 0)
+            die("Invalid index hash '%s' in '%s'", line, path);
+        (*blocks)[*nblocks].seq = *nblocks;
+        (*nblocks)++;
+    }
+
+    if (err < 0)
+        die_errno("Unable to read index '%s'", path);
+    if (err == 0)
+        die("Index '%s' has no trailer", path);
+
+    index_reader_free(&index);
+    if (try_close(fd) < 0)
+        die_errno("Unable to close index '%s'", path);
+}
+
+static int hash_seq_cmp(const void *a, const void *b)
+{
+    const struct repack_block *x = a, *y = b;
+    int cmp = memcmp(x->hash.bin, y->hash.bin, HASH_LEN);
+    if (cmp)
+        return cmp;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int seq_cmp(const void *a, const void *b)
+{
+    const struct repack_block *x = a, *y = b;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Only keep the first reference of every block, in index order. */
+static void deduplicate(struct repack_block *blocks, size_t *nblocks)
+{
+    size_t i, n = 0;
+
+    qsort(blocks, *nblocks, sizeof(*blocks), hash_seq_cmp);
+    for (i = 0; i < *nblocks; i++)
+        if (!n || !hash_eq(&blocks[i].hash, &blocks[n - 1].hash))
+            blocks[n++] = blocks[i];
+    qsort(blocks, n, sizeof(*blocks), seq_cmp);
+
+    *nblocks = n;
+}
+
+/*
+ * Reserve the next free pack ID by exclusively creating its data
+ * file. IDs start at one, as zero denotes loose blocks in the catalog.
+ */
+static int create_pack(uint32_t *id, struct store *store, int packsfd)
+{
+    char name[32];
+    size_t i;
+    int fd;
+
+    *id = 1;
+    for (i = 0; i < store->npacks; i++)
+        if (store->packs[i].id >= *id)
+            *id = store->packs[i].id + 1;
+
+    while (pack_name(name, sizeof(name), *id, "pack") == 0) {
+        if ((fd = openat(packsfd, name, O_CREAT|O_EXCL|O_WRONLY, 0644)) >= 0 || errno != EEXIST)
+            return fd;
+        (*id)++;
+    }
+
+    return -1;
+}
+
+/*
+ * Remove packs all of whose blocks are contained in the new pack. The
+ * index is removed first, so that the pack becomes invisible before
+ * its data goes away.
+ */
+static void remove_superseded(struct store *store, int packsfd, uint32_t id)
+{
+    const struct pack *pack = NULL;
+    struct pack_entry entry;
+    struct hash hash;
+    char name[32];
+    size_t i, j;
+
+    for (i = 0; i < store->npacks; i++)
+        if (store->packs[i].id == id)
+            pack = &store->packs[i];
+    if (!pack)
+        die("Unable to find new pack");
+
+    for (i = 0; i < store->npacks; i++) {
+        const struct pack *old = &store->packs[i];
+
+        if (old->id == id)
+            continue;
+
+        for (j = 0; j < old->nrecords; j++) {
+            pack_entry_at(&entry, old, j);
+            if (hash_from_bin(&hash, entry.hash, HASH_LEN) < 0 || pack_lookup(&entry, pack, &hash) < 0)
+                break;
+        }
+        if (j < old->nrecords)
+            continue;
+
+        if (pack_name(name, sizeof(name), old->id, "idx") < 0 || unlinkat(packsfd, name, 0) < 0 ||
+                pack_name(name, sizeof(name), old->id, "pack") < 0 || unlinkat(packsfd, name, 0) < 0)
+            die_errno("Unable to remove superseded pack %08"PRIx32, old->id);
+    }
+}
+
+int gob_repack(int argc, const char *argv[])
+{
+    struct repack_block *blocks = NULL;
+    struct pack_entry *entries;
+    struct catalog_entry *catalog;
+    struct store store;
+    unsigned char *block;
+    uint64_t offset = 0;
+    size_t j, nblocks = 0, alloc = 0;
+    uint32_t id;
+    int i, fd, packsfd, verbose = 0;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--verbose"))
+            verbose = 1;
+        else
+            die("Unknown option '%s'", argv[i]);
+    }
+
+    if (argc - i < 2)
+        die("USAGE: %s repack [--verbose] <DIR> <INDEX>...", argv[0]);
+
+    atexit(close_stdout);
+
+    for (j = (size_t) i + 1; j < (size_t) argc; j++)
+        read_index(&blocks, &nblocks, &alloc, argv[j]);
+    deduplicate(blocks, &nblocks);
+
+    if (store_open(&store, argv[i]) < 0)
+        die("Unable to open store");
+    if (store.backend != &files_backend)
+        die("Store does not use the files backend");
+    if (store_packs_load(&store) < 0)
+        die_errno("Unable to load packs");
+
+    if ((block = malloc(BLOCK_LEN)) == NULL ||
+            (entries = malloc((nblocks ? nblocks : 1) * sizeof(*entries))) == NULL ||
+            (catalog = calloc(nblocks ? nblocks : 1, sizeof(*catalog))) == NULL)
+        die_errno("Unable to allocate blocks");
+
+    if (mkdirat(store.fd, BLOCK_STORE_PACKS_DIR, 0755) < 0 && errno != EEXIST)
+        die_errno("Unable to create packs directory");
+    if ((packsfd = openat(store.fd, BLOCK_STORE_PACKS_DIR, O_RDONLY)) < 0)
+        die_errno("Unable to open packs directory");
+
+    if ((fd = create_pack(&id, &store, packsfd)) < 0)
+        die_errno("Unable to create pack");
+
+    /*
+     * Blocks are written in the order they are first referenced by
+     * the indices, so that restoring them reads the pack sequentially.
+     * They may be read from older packs, which get superseded.
+     */
+    for (j = 0; j < nblocks; j++) {
+        const struct hash *hash = &blocks[j].hash;
+        struct hash computed;
+        ssize_t bytes;
+
+        if ((bytes = store_read(block, BLOCK_LEN, &store, hash)) < 0)
+            die_errno("Unable to read block '%s'", hash->hex);
+        if (hash_compute(&computed, block, (size_t) bytes) < 0 || !hash_eq(&computed, hash))
+            die("Hash mismatch for block '%s'", hash->hex);
+
+        if (write_bytes(fd, block, (size_t) bytes) < 0)
+            die_errno("Unable to write pack");
+
+        memcpy(entries[j].hash, hash->bin, HASH_LEN);
+        entries[j].offset = offset;
+        entries[j].size = (uint32_t) bytes;
+        memcpy(catalog[j].hash, hash->bin, HASH_LEN);
+        catalog[j].size = (uint32_t) bytes;
+        catalog[j].location = id;
+        offset += (uint64_t) bytes;
+    }
+
+    if (fsync(fd) < 0 || try_close(fd) < 0)
+        die_errno("Unable to sync pack");
+
+    /* Writing the index atomically switches lookups to the pack. */
+    if (pack_write_index(packsfd, id, entries, nblocks) < 0)
+        die_errno("Unable to write pack index");
+
+    if (store.catalogfd >= 0 && store_catalog_update(&store, catalog, nblocks) < 0)
+        die_errno("Unable to update catalog");
+
+    for (j = 0; j < nblocks; j++)
+        if (store_remove_loose(&store, &blocks[j].hash) < 0)
+            die_errno("Unable to remove loose block '%s'", blocks[j].hash.hex);
+
+    if (store_packs_load(&store) < 0)
+        die_errno("Unable to load packs");
+    remove_superseded(&store, packsfd, id);
+
+    if (try_close(packsfd) < 0)
+        die_errno("Unable to close packs directory");
+
+    if (verbose)
+        fprintf(stderr, "%lu blocks with %"PRIuMAX" bytes written into pack %08"PRIx32"\n",
+                (unsigned long) nblocks, (uintmax_t) offset, id);
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    free(catalog);
+    free(entries);
+    free(blocks);
+    free(block);
+
+    return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#define HEXCHARS "0123456789abcdef"
+
+struct reshard_state {
+    int storefd;
+    struct store_config from;
+    struct store_config to;
+    uintmax_t moved;
+};
+
+static int is_hex(const char *name, size_t len)
+{
+    return strlen(name) == len && strspn(name, HEXCHARS) == len;
+}
+
+static int is_delta(const char *name, size_t len)
+{
+    return strlen(name) == len + strlen(BLOCK_STORE_DELTA_SUFFIX) && strspn(name, HEXCHARS) == len &&
+        !strcmp(name + len, BLOCK_STORE_DELTA_SUFFIX);
+}
+
+/* Deltas keep their suffix when being moved. */
+static void move_block(struct reshard_state *state, const char *shard, const char *prefix,
+        const char *name, size_t namelen)
+{
+    char from[STORE_SHARD_PATH_MAX + DELTA_NAME_MAX + 1], to[sizeof(from)];
+    char hex[HASH_LEN * 2 + 1], newshard[STORE_SHARD_PATH_MAX];
+    const char *newname;
+    struct hash hash;
+    unsigned level;
+
+    if (snprintf(hex, sizeof(hex), "%s%.*s", prefix, (int) namelen, name) != HASH_LEN * 2 ||
+            hash_from_str(&hash, hex, HASH_LEN * 2) < 0)
+        die("Invalid block name '%s/%s'", shard, name);
+
+    newname = store_shard_path(newshard, &state->to, &hash);
+
+    for (level = 1; level <= state->to.shard_depth; level++) {
+        size_t len = level * (state->to.shard_width + 1) - 1;
+        char c = newshard[len];
+
+        newshard[len] = '\0';
+        if (mkdirat(state->storefd, newshard, 0755) < 0 && errno != EEXIST)
+            die_errno("Unable to create sharding directory '%s'", newshard);
+        newshard[len] = c;
+    }
+
+    snprintf(from, sizeof(from), "%s/%s", shard, name);
+    snprintf(to, sizeof(to), "%s/%s%s", newshard, newname, name + namelen);
+
+    if (renameat(state->storefd, from, state->storefd, to) < 0)
+        die_errno("Unable to move block '%s' to '%s'", from, to);
+
+    state->moved++;
+}
+
+/*
+ * Walk the old sharding hierarchy and move every block into its new
+ * location. As both hierarchies may share directories while the
+ * migration is in progress, entries are only considered if both
+ * their type and name length match the old layout.
+ */
+static void reshard_level(struct reshard_state *state, const char *path, const char *prefix, unsigned level)
+{
+    size_t namelen = level == state->from.shard_depth ?
+        HASH_LEN * 2 - state->from.shard_depth * state->from.shard_width :
+        state->from.shard_width;
+    struct dirent *ent;
+    char **names = NULL;
+    size_t i, nnames = 0, alloc = 0;
+    DIR *dir;
+    int fd;
+
+    if ((fd = level ? openat(state->storefd, path, O_RDONLY) : dup(state->storefd)) < 0 ||
+            (dir = fdopendir(fd)) == NULL)
+        die_errno("Unable to open sharding directory '%s'", path);
+
+    /*
+     * Collect names first, as we are going to modify the directory
+     * we are iterating over.
+     */
+    while ((errno = 0, ent = readdir(dir)) != NULL) {
+        if (!is_hex(ent->d_name, namelen) &&
+                (level != state->from.shard_depth || !is_delta(ent->d_name, namelen)))
+            continue;
+        if (nnames == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            if ((names = realloc(names, alloc * sizeof(*names))) == NULL)
+                die_errno("Unable to allocate directory entries");
+        }
+        if ((names[nnames++] = strdup(ent->d_name)) == NULL)
+            die_errno("Unable to allocate directory entry");
+    }
+    if (errno)
+        die_errno("Unable to read sharding directory '%s'", path);
+
+    for (i = 0; i < nnames; i++) {
+        char subpath[STORE_SHARD_PATH_MAX + DELTA_NAME_MAX + 1], subprefix[STORE_SHARD_PATH_MAX];
+        struct stat st;
+
+        if (level)
+            snprintf(subpath, sizeof(subpath), "%s/%s", path, names[i]);
+        else
+            snprintf(subpath, sizeof(subpath), "%s", names[i]);
+
+        if (fstatat(state->storefd, subpath, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            die_errno("Unable to stat '%s'", subpath);
+
+        if (level == state->from.shard_depth && S_ISREG(st.st_mode)) {
+            move_block(state, path, prefix, names[i], namelen);
+        } else if (level != state->from.shard_depth && S_ISDIR(st.st_mode)) {
+            snprintf(subprefix, sizeof(subprefix), "%s%s", prefix, names[i]);
+            reshard_level(state, subpath, subprefix, level + 1);
+
+            if (unlinkat(state->storefd, subpath, AT_REMOVEDIR) < 0 &&
+                    errno != ENOTEMPTY && errno != EEXIST)
+                die_errno("Unable to remove sharding directory '%s'", subpath);
+        }
+
+        free(names[i]);
+    }
+
+    if (try_closedir(dir) < 0)
+        die_errno("Unable to close sharding directory '%s'", path);
+
+    free(names);
+}
+
+/*
+ * Stores with a configuration file cannot be handled by older versions.
+ * The version file is replaced atomically, as stores without a valid
+ * version cannot be opened at all.
+ */
+static void upgrade_version(int storefd)
+{
+    uint32_t version = htonl(BLOCK_STORE_VERSION);
+    int fd;
+
+    if ((fd = openat(storefd, BLOCK_STORE_VERSION_FILE ".tmp", O_CREAT|O_TRUNC|O_WRONLY, 0666)) < 0)
+        die_errno("Unable to update store version");
+
+    if (write_bytes(fd, (unsigned char *) &version, sizeof(version)) < 0 || fsync(fd) < 0) {
+        try_close(fd);
+        unlinkat(storefd, BLOCK_STORE_VERSION_FILE ".tmp", 0);
+        die_errno("Unable to update store version");
+    }
+
+    if (try_close(fd) < 0 ||
+            renameat(storefd, BLOCK_STORE_VERSION_FILE ".tmp", storefd, BLOCK_STORE_VERSION_FILE) < 0) {
+        unlinkat(storefd, BLOCK_STORE_VERSION_FILE ".tmp", 0);
+        die_errno("Unable to update store version");
+    }
+}
+
+int gob_reshard(int argc, const char *argv[])
+{
+    struct reshard_state state;
+    struct store_config config;
+    struct store store;
+    unsigned depth = 0, width = 0;
+    int i, verbose = 0;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--shard-depth") && i + 1 < argc)
+            depth = (unsigned) strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--shard-width") && i + 1 < argc)
+            width = (unsigned) strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--verbose"))
+            verbose = 1;
+        else
+            die("Unknown option '%s'", argv[i]);
+    }
+
+    if (argc - i != 1)
+        die("USAGE: %s reshard [--shard-depth <N>] [--shard-width <N>] [--verbose] <DIR>", argv[0]);
+
+    atexit(close_stdout);
+
+    if (store_open_for_reshard(&store, argv[i]) < 0)
+        die("Unable to open store");
+    if (store.backend != &files_backend)
+        die("Store does not use the files backend");
+
+    config = store.config;
+
+    /*
+     * The old layout is recorded in the configuration before moving
+     * any blocks so that an interrupted migration can be resumed.
+     */
+    if (config.reshard_depth) {
+        if ((depth && depth != config.shard_depth) || (width && width != config.shard_width))
+            die("Store is already being resharded to depth %u and width %u",
+                    config.shard_depth, config.shard_width);
+    } else {
+        config.reshard_depth = config.shard_depth;
+        config.reshard_width = config.shard_width;
+        if (depth)
+            config.shard_depth = depth;
+        if (width)
+            config.shard_width = width;
+
+        if (store_config_validate(&config) < 0)
+            die("Invalid sharding layout");
+
+        if (config.shard_depth == config.reshard_depth &&
+                config.shard_width == config.reshard_width)
+            goto out;
+
+        upgrade_version(store.fd);
+
+        if (store_config_write(store.fd, &config) < 0)
+            die_errno("Unable to write store configuration");
+    }
+
+    state.storefd = store.fd;
+    state.moved = 0;
+    state.to = config;
+    store_config_init(&state.from);
+    state.from.shard_depth = config.reshard_depth;
+    state.from.shard_width = config.reshard_width;
+
+    reshard_level(&state, ".", "", 0);
+
+    config.reshard_depth = 0;
+    config.reshard_width = 0;
+    if (store_config_write(store.fd, &config) < 0)
+        die_errno("Unable to write store configuration");
+
+    if (verbose)
+        fprintf(stderr, "Moved %"PRIuMAX" blocks\n", state.moved);
+
+out:
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    return 0;
+}
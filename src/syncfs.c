@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* syncfs() is not part of POSIX. */
+#define _GNU_SOURCE
+
+#include "common.h"
+
+#include <unistd.h>
+
+/*
+ * Write back all data and metadata of the filesystem containing fd.
+ * Without syncfs(), all filesystems are written back instead.
+ */
+int sync_filesystem(int fd)
+{
+#ifdef HAVE_SYNCFS
+    return syncfs(fd);
+#else
+    (void) fd;
+    sync();
+    return 0;
+#endif
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <signal.h>
+#include <time.h>
+
+/*
+ * Each limit is a token bucket which refills at the configured rate
+ * and holds at most one second worth of tokens. Requests always get
+ * their tokens immediately, possibly driving the bucket into debt,
+ * and then sleep until the debt would have been paid off. This allows
+ * requests larger than the bucket itself, e.g. complete blocks.
+ */
+struct bucket {
+    double rate;
+    double tokens;
+    struct timespec last;
+};
+
+static struct {
+    const char *name;
+    struct bucket bytes;
+    struct bucket ops;
+} limits[THROTTLE_MAX] = {
+    { "input",       { 0, 0, { 0, 0 } }, { 0, 0, { 0, 0 } } },
+    { "store-write", { 0, 0, { 0, 0 } }, { 0, 0, { 0, 0 } } },
+    { "store-read",  { 0, 0, { 0, 0 } }, { 0, 0, { 0, 0 } } },
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t reload_requested;
+static const char *control_file;
+static int enabled;
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+    return (double) (to->tv_sec - from->tv_sec) + (double) (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static double bucket_take(struct bucket *bucket, const struct timespec *now, double amount)
+{
+    if (bucket->rate <= 0)
+        return 0;
+
+    bucket->tokens += elapsed(&bucket->last, now) * bucket->rate;
+    if (bucket->tokens > bucket->rate)
+        bucket->tokens = bucket->rate;
+    bucket->last = *now;
+
+    bucket->tokens -= amount;
+    if (bucket->tokens >= 0)
+        return 0;
+
+    return -bucket->tokens / bucket->rate;
+}
+
+static void bucket_set(struct bucket *bucket, double rate)
+{
+    if (bucket->rate != rate) {
+        clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+        bucket->tokens = rate;
+        bucket->rate = rate;
+    }
+}
+
+static int apply_limit(const char *spec)
+{
+    char key[32];
+    const char *value;
+    size_t i, keylen, rate;
+    int ops = 0;
+
+    if ((value = strchr(spec, '=')) == NULL || (keylen = (size_t) (value - spec)) >= sizeof(key))
+        return -1;
+    memcpy(key, spec, keylen);
+    key[keylen] = '\0';
+    value++;
+
+    if (keylen > 4 && !strcmp(key + keylen - 4, "-ops")) {
+        key[keylen - 4] = '\0';
+        ops = 1;
+    }
+
+    if (parse_size(&rate, value) < 0)
+        return -1;
+
+    for (i = 0; i < THROTTLE_MAX; i++) {
+        if (strcmp(limits[i].name, key))
+            continue;
+
+        bucket_set(ops ? &limits[i].ops : &limits[i].bytes, (double) rate);
+        enabled = 1;
+
+        return 0;
+    }
+
+    return -1;
+}
+
+int throttle_set(const char *spec)
+{
+    int err;
+
+    pthread_mutex_lock(&lock);
+    err = apply_limit(spec);
+    pthread_mutex_unlock(&lock);
+
+    return err;
+}
+
+/* Needs to be called with the lock held. */
+static int throttle_load(const char *path)
+{
+    char *line = NULL, *p, *q;
+    size_t n = 0;
+    ssize_t linelen;
+    FILE *f;
+    int err = 0;
+
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+
+    while ((linelen = getline(&line, &n, f)) > 0) {
+        /* Strip all whitespace so that "key = value" becomes "key=value". */
+        for (p = q = line; *p; p++)
+            if (*p != ' ' && *p != '\t' && *p != '\n')
+                *q++ = *p;
+        *q = '\0';
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        if (apply_limit(line) < 0) {
+            warn("Invalid limit '%s' in '%s'", line, path);
+            err = -1;
+        }
+    }
+
+    if (ferror(f))
+        err = -1;
+
+    free(line);
+    fclose(f);
+
+    return err;
+}
+
+static void request_reload(int signo)
+{
+    (void) signo;
+    reload_requested = 1;
+}
+
+int throttle_watch(const char *path)
+{
+    struct sigaction sa;
+    int err;
+
+    pthread_mutex_lock(&lock);
+    if ((err = throttle_load(path)) == 0) {
+        control_file = path;
+        enabled = 1;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (err < 0)
+        return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_reload;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    return sigaction(SIGHUP, &sa, NULL);
+}
+
+void throttle(enum throttle_kind kind, size_t bytes)
+{
+    struct timespec now, delay;
+    double wait, opswait;
+
+    if (!enabled)
+        return;
+
+    pthread_mutex_lock(&lock);
+
+    if (reload_requested && control_file) {
+        reload_requested = 0;
+        if (throttle_load(control_file) < 0)
+            warn("Unable to reload limits from '%s'", control_file);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wait = bucket_take(&limits[kind].bytes, &now, (double) bytes);
+    opswait = bucket_take(&limits[kind].ops, &now, 1);
+    if (opswait > wait)
+        wait = opswait;
+
+    pthread_mutex_unlock(&lock);
+
+    if (wait <= 0)
+        return;
+
+    delay.tv_sec = (time_t) wait;
+    delay.tv_nsec = (long) ((wait - (double) delay.tv_sec) * 1e9);
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+        ;
+}
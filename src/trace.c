@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Spans are written as complete events of the Chrome trace event
+ * format, which can be loaded into chrome://tracing or Perfetto.
+ * Events are written as a JSON array, which the viewers accept even
+ * when the process died before terminating it.
+ */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tid_key;
+static unsigned long next_tid;
+static struct timespec epoch;
+static const char *trace_path;
+static FILE *trace;
+static int events;
+static int enabled;
+
+static double micros_since_epoch(const struct timespec *ts)
+{
+    return (double) (ts->tv_sec - epoch.tv_sec) * 1e6 + (double) (ts->tv_nsec - epoch.tv_nsec) / 1e3;
+}
+
+/*
+ * Threads are numbered in the order they emit their first span, as
+ * thread IDs of pthreads cannot be printed portably.
+ */
+static unsigned long thread_id(void)
+{
+    unsigned long *tid;
+
+    if ((tid = pthread_getspecific(tid_key)) != NULL)
+        return *tid;
+    if ((tid = malloc(sizeof(*tid))) == NULL)
+        return 0;
+
+    pthread_mutex_lock(&lock);
+    *tid = ++next_tid;
+    pthread_mutex_unlock(&lock);
+
+    pthread_setspecific(tid_key, tid);
+    return *tid;
+}
+
+static void close_trace(void)
+{
+    pthread_mutex_lock(&lock);
+    fprintf(trace, "\n]\n");
+    if (fclose(trace) != 0)
+        fprintf(stderr, "Unable to write trace to '%s'\n", trace_path);
+    enabled = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+int trace_enable(const char *path)
+{
+    int error;
+
+    if ((error = pthread_key_create(&tid_key, free)) != 0) {
+        errno = error;
+        return -1;
+    }
+    if ((trace = fopen(path, "w")) == NULL)
+        return -1;
+
+    trace_path = path;
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    fprintf(trace, "[");
+    enabled = 1;
+
+    return atexit(close_trace);
+}
+
+void trace_start(struct timespec *start)
+{
+    if (enabled)
+        clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/*
+ * Record a span from the given start until now, annotated with the
+ * block it operated on if known.
+ */
+void trace_span(const char *name, const struct hash *hash, const struct timespec *start)
+{
+    unsigned long tid;
+    struct timespec now;
+    double ts;
+
+    if (!enabled)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ts = micros_since_epoch(start);
+    tid = thread_id();
+
+    pthread_mutex_lock(&lock);
+    if (enabled) {
+        fprintf(trace, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%lu",
+                events++ ? "," : "", name, ts, micros_since_epoch(&now) - ts, (long) getpid(), tid);
+        if (hash)
+            fprintf(trace, ",\"args\":{\"block\":\"%s\"}", hash->hex);
+        fprintf(trace, "}");
+    }
+    pthread_mutex_unlock(&lock);
+}
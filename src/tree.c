@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * The metadata cache maps a file's identity and change times to the
+ * list of blocks it has been chunked into by a previous run. Each
+ * file is represented by a header line
+ *
+ *   <dev> <ino> <size> <mtime> <ctime> <filehash> <nblocks>
+ *
+ * followed by one line per block hash. Entries are kept sorted by
+ * device and inode so that lookups can use a binary search.
+ */
+struct cache_entry {
+    uintmax_t dev;
+    uintmax_t ino;
+    uintmax_t size;
+    intmax_t mtime_sec, ctime_sec;
+    long mtime_nsec, ctime_nsec;
+    struct hash hash;
+    size_t first, nblocks;
+};
+
+struct tree_cache {
+    struct cache_entry *entries;
+    size_t nentries, alloc;
+    struct hash *blocks;
+    size_t nblocks, blocks_alloc;
+    FILE *out;
+};
+
+struct tree_stats {
+    uintmax_t files, cached, bytes_read;
+};
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+    const struct cache_entry *x = a, *y = b;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return 0;
+}
+
+static void cache_add_block(struct tree_cache *cache, const struct hash *hash)
+{
+    if (cache->nblocks == cache->blocks_alloc) {
+        cache->blocks_alloc = cache->blocks_alloc ? cache->blocks_alloc * 2 : 1024;
+        cache->blocks = realloc(cache->blocks, cache->blocks_alloc * sizeof(*cache->blocks));
+        if (cache->blocks == NULL)
+            die_errno("Unable to allocate cache blocks");
+    }
+    memcpy(&cache->blocks[cache->nblocks++], hash, sizeof(*hash));
+}
+
+static void cache_load(struct tree_cache *cache, const char *path)
+{
+    char *line = NULL, filehash[HASH_LEN * 2 + 1];
+    size_t n = 0;
+    ssize_t linelen;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        if (errno == ENOENT)
+            return;
+        die_errno("Unable to open cache '%s'", path);
+    }
+
+    while ((linelen = getline(&line, &n, f)) > 0) {
+        struct cache_entry *entry;
+        unsigned long nblocks, i;
+
+        if (cache->nentries == cache->alloc) {
+            cache->alloc = cache->alloc ? cache->alloc * 2 : 1024;
+            cache->entries = realloc(cache->entries, cache->alloc * sizeof(*cache->entries));
+            if (cache->entries == NULL)
+                die_errno("Unable to allocate cache entries");
+        }
+        entry = &cache->entries[cache->nentries];
+
+        if (sscanf(line, "%"SCNuMAX" %"SCNuMAX" %"SCNuMAX" %"SCNdMAX".%ld %"SCNdMAX".%ld %32s %lu",
+                    &entry->dev, &entry->ino, &entry->size,
+                    &entry->mtime_sec, &entry->mtime_nsec,
+                    &entry->ctime_sec, &entry->ctime_nsec,
+                    filehash, &nblocks) != 9 ||
+                hash_from_str(&entry->hash, filehash, strlen(filehash)) < 0)
+            die("Corrupt cache entry in '%s'", path);
+
+        entry->first = cache->nblocks;
+        entry->nblocks = nblocks;
+
+        for (i = 0; i < nblocks; i++) {
+            struct hash hash;
+
+            if ((linelen = getline(&line, &n, f)) <= 0)
+                die("Truncated cache entry in '%s'", path);
+            if (line[linelen - 1] == '\n')
+                line[--linelen] = '\0';
+            if (hash_from_str(&hash, line, (size_t) linelen) < 0)
+                die("Corrupt cache block in '%s'", path);
+
+            cache_add_block(cache, &hash);
+        }
+
+        cache->nentries++;
+    }
+
+    if (linelen < 0 && !feof(f))
+        die_errno("Unable to read cache '%s'", path);
+
+    qsort(cache->entries, cache->nentries, sizeof(*cache->entries), cache_entry_cmp);
+
+    free(line);
+    fclose(f);
+}
+
+static const struct cache_entry *cache_lookup(const struct tree_cache *cache, const struct stat *st)
+{
+    const struct cache_entry *entry;
+    struct cache_entry key;
+
+    if (!cache->nentries)
+        return NULL;
+
+    key.dev = (uintmax_t) st->st_dev;
+    key.ino = (uintmax_t) st->st_ino;
+
+    entry = bsearch(&key, cache->entries, cache->nentries, sizeof(key), cache_entry_cmp);
+    if (entry == NULL ||
+            entry->size != (uintmax_t) st->st_size ||
+            entry->mtime_sec != (intmax_t) st->st_mtim.tv_sec ||
+            entry->mtime_nsec != st->st_mtim.tv_nsec ||
+            entry->ctime_sec != (intmax_t) st->st_ctim.tv_sec ||
+            entry->ctime_nsec != st->st_ctim.tv_nsec)
+        return NULL;
+
+    return entry;
+}
+
+static void cache_record(struct tree_cache *cache, const struct stat *st,
+        const struct hash *filehash, const struct hash *blocks, size_t nblocks)
+{
+    size_t i;
+
+    if (!cache->out)
+        return;
+
+    fprintf(cache->out, "%"PRIuMAX" %"PRIuMAX" %"PRIuMAX" %"PRIdMAX".%09ld %"PRIdMAX".%09ld %s %lu\n",
+            (uintmax_t) st->st_dev, (uintmax_t) st->st_ino, (uintmax_t) st->st_size,
+            (intmax_t) st->st_mtim.tv_sec, (long) st->st_mtim.tv_nsec,
+            (intmax_t) st->st_ctim.tv_sec, (long) st->st_ctim.tv_nsec,
+            filehash->hex, (unsigned long) nblocks);
+    for (i = 0; i < nblocks; i++)
+        fprintf(cache->out, "%s\n", blocks[i].hex);
+}
+
+/*
+ * Paths are written with whitespace and backslashes escaped as octal
+ * sequences, similar to fstab(5), so that every entry fits on a
+ * single line.
+ */
+static void print_escaped(const char *str)
+{
+    for (; *str; str++) {
+        if (*str == ' ' || *str == '\t' || *str == '\n' || *str == '\\')
+            printf("\\%03o", (unsigned int) (unsigned char) *str);
+        else
+            putchar(*str);
+    }
+}
+
+static void print_entry(char type, const struct stat *st, const char *path)
+{
+    printf("%c %04o %"PRIuMAX" %"PRIuMAX" %"PRIdMAX".%09ld ", type,
+            (unsigned int) (st->st_mode & 07777),
+            (uintmax_t) st->st_uid, (uintmax_t) st->st_gid,
+            (intmax_t) st->st_mtim.tv_sec, (long) st->st_mtim.tv_nsec);
+    print_escaped(path);
+}
+
+static void chunk_file(struct store *store, struct tree_cache *cache, struct tree_stats *stats,
+        unsigned char *block, int dirfd, const char *name, const struct stat *st)
+{
+    const struct cache_entry *cached;
+    struct hash_state state;
+    struct hash filehash, *blocks = NULL;
+    size_t i, nblocks = 0, alloc = 0;
+    uintmax_t total = 0;
+    struct stat after;
+    ssize_t bytes;
+    int fd;
+
+    stats->files++;
+
+    if ((cached = cache_lookup(cache, st)) != NULL) {
+        for (i = 0; i < cached->nblocks; i++)
+            puts(cache->blocks[cached->first + i].hex);
+        printf(">%s %"PRIuMAX"\n", cached->hash.hex, cached->size);
+        cache_record(cache, st, &cached->hash, &cache->blocks[cached->first], cached->nblocks);
+        stats->cached++;
+        return;
+    }
+
+    if ((fd = openat(dirfd, name, O_RDONLY|O_NOFOLLOW)) < 0)
+        die_errno("Unable to open file '%s'", name);
+
+    if (hash_state_init(&state) < 0)
+        die("Unable to initialize hashing state");
+
+    while ((bytes = read_bytes(fd, block, BLOCK_LEN)) > 0) {
+        if (nblocks == alloc) {
+            alloc = alloc ? alloc * 2 : 16;
+            if ((blocks = realloc(blocks, alloc * sizeof(*blocks))) == NULL)
+                die_errno("Unable to allocate block list");
+        }
+
+        if (hash_state_update(&state, block, (size_t) bytes) < 0)
+            die("Unable to update hash");
+        if (store_write(&blocks[nblocks], store, block, (size_t) bytes) < 0)
+            die("Unable to store block");
+        puts(blocks[nblocks++].hex);
+
+        total += (uintmax_t) bytes;
+    }
+
+    if (bytes < 0)
+        die_errno("Unable to read file '%s'", name);
+
+    if (hash_state_final(&filehash, &state) < 0)
+        die("Unable to finalize hash");
+
+    printf(">%s %"PRIuMAX"\n", filehash.hex, total);
+    stats->bytes_read += total;
+
+    /*
+     * Only remember files which have not been modified while we were
+     * reading them, as otherwise the cached block list may not match
+     * the metadata we would key it by.
+     */
+    if (fstat(fd, &after) < 0)
+        die_errno("Unable to stat file '%s'", name);
+    if ((uintmax_t) after.st_size != total ||
+            after.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+            after.st_mtim.tv_nsec != st->st_mtim.tv_nsec ||
+            after.st_ctim.tv_sec != st->st_ctim.tv_sec ||
+            after.st_ctim.tv_nsec != st->st_ctim.tv_nsec)
+        warn("File '%s' changed while reading it", name);
+    else
+        cache_record(cache, st, &filehash, blocks, nblocks);
+
+    if (try_close(fd) < 0)
+        die_errno("Unable to close file '%s'", name);
+
+    free(blocks);
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void chunk_dir(struct store *store, struct tree_cache *cache, struct tree_stats *stats,
+        unsigned char *block, int dirfd, const char *path)
+{
+    struct dirent *ent;
+    char **names = NULL;
+    size_t i, nnames = 0, alloc = 0;
+    DIR *dir;
+    int fd;
+
+    if ((fd = dup(dirfd)) < 0 || (dir = fdopendir(fd)) == NULL)
+        die_errno("Unable to open directory '%s'", path);
+
+    /*
+     * Entries are sorted by name to make the resulting tree index
+     * independent of the order the file system returns them in.
+     */
+    while ((errno = 0, ent = readdir(dir)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        if (nnames == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            if ((names = realloc(names, alloc * sizeof(*names))) == NULL)
+                die_errno("Unable to allocate directory entries");
+        }
+        if ((names[nnames++] = strdup(ent->d_name)) == NULL)
+            die_errno("Unable to allocate directory entry");
+    }
+    if (errno)
+        die_errno("Unable to read directory '%s'", path);
+
+    if (try_closedir(dir) < 0)
+        die_errno("Unable to close directory '%s'", path);
+
+    qsort(names, nnames, sizeof(*names), name_cmp);
+
+    for (i = 0; i < nnames; i++) {
+        char *subpath, target[4096];
+        struct stat st;
+        ssize_t len;
+        int subfd;
+
+        if ((subpath = malloc(strlen(path) + strlen(names[i]) + 2)) == NULL)
+            die_errno("Unable to allocate path");
+        if (!strcmp(path, "."))
+            strcpy(subpath, names[i]);
+        else
+            sprintf(subpath, "%s/%s", path, names[i]);
+
+        if (fstatat(dirfd, names[i], &st, AT_SYMLINK_NOFOLLOW) < 0)
+            die_errno("Unable to stat '%s'", subpath);
+
+        if (S_ISDIR(st.st_mode)) {
+            print_entry('d', &st, subpath);
+            putchar('\n');
+            if ((subfd = openat(dirfd, names[i], O_RDONLY|O_DIRECTORY|O_NOFOLLOW)) < 0)
+                die_errno("Unable to open directory '%s'", subpath);
+            chunk_dir(store, cache, stats, block, subfd, subpath);
+            if (try_close(subfd) < 0)
+                die_errno("Unable to close directory '%s'", subpath);
+        } else if (S_ISREG(st.st_mode)) {
+            print_entry('f', &st, subpath);
+            putchar('\n');
+            chunk_file(store, cache, stats, block, dirfd, names[i], &st);
+        } else if (S_ISLNK(st.st_mode)) {
+            if ((len = readlinkat(dirfd, names[i], target, sizeof(target) - 1)) < 0)
+                die_errno("Unable to read symbolic link '%s'", subpath);
+            target[len] = '\0';
+            print_entry('l', &st, subpath);
+            putchar(' ');
+            print_escaped(target);
+            putchar('\n');
+        } else {
+            warn("Skipping special file '%s'", subpath);
+        }
+
+        free(subpath);
+        free(names[i]);
+    }
+
+    free(names);
+}
+
+int gob_chunk_tree(int argc, const char *argv[])
+{
+    struct tree_cache cache;
+    struct tree_stats stats;
+    struct store store;
+    struct stat st;
+    const char *cache_path = NULL;
+    char *cache_tmp = NULL;
+    unsigned char *block;
+    int i, rootfd, verbose = 0;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--cache") && i + 1 < argc)
+            cache_path = argv[++i];
+        else if (!strcmp(argv[i], "--verbose"))
+            verbose = 1;
+        else
+            die("Unknown option '%s'", argv[i]);
+    }
+
+    if (argc - i != 2)
+        die("USAGE: %s chunk-tree [--cache <FILE>] [--verbose] <DIR> <PATH>", argv[0]);
+
+    atexit(close_stdout);
+
+    memset(&cache, 0, sizeof(cache));
+    memset(&stats, 0, sizeof(stats));
+
+    if ((block = malloc(BLOCK_LEN)) == NULL)
+        die_errno("Unable to allocate block");
+
+    if (store_open(&store, argv[i]) < 0)
+        die("Unable to open store");
+
+    if ((rootfd = open(argv[i + 1], O_RDONLY|O_DIRECTORY)) < 0 || fstat(rootfd, &st) < 0)
+        die_errno("Unable to open directory '%s'", argv[i + 1]);
+
+    if (cache_path) {
+        cache_load(&cache, cache_path);
+
+        if ((cache_tmp = malloc(strlen(cache_path) + 5)) == NULL)
+            die_errno("Unable to allocate cache path");
+        sprintf(cache_tmp, "%s.tmp", cache_path);
+
+        if ((cache.out = fopen(cache_tmp, "w")) == NULL)
+            die_errno("Unable to create cache '%s'", cache_tmp);
+    }
+
+    print_entry('d', &st, ".");
+    putchar('\n');
+    chunk_dir(&store, &cache, &stats, block, rootfd, ".");
+
+    if (try_close(rootfd) < 0)
+        die_errno("Unable to close directory '%s'", argv[i + 1]);
+
+    if (cache.out) {
+        if (fclose(cache.out) != 0 || rename(cache_tmp, cache_path) < 0)
+            die_errno("Unable to update cache '%s'", cache_path);
+    }
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    if (verbose)
+        fprintf(stderr, "%"PRIuMAX" files, %"PRIuMAX" unchanged, %"PRIuMAX" bytes read\n",
+                stats.files, stats.cached, stats.bytes_read);
+
+    free(cache.entries);
+    free(cache.blocks);
+    free(cache_tmp);
+    free(block);
+
+    return 0;
+}
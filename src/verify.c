@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct verify_job {
+    pthread_t thread;
+    struct store store;
+    unsigned char *block;
+    const struct hash *hashes;
+    const unsigned char *full;
+    size_t first, stride, nhashes, datalen;
+    uintmax_t checked, hashed, failed;
+};
+
+static void read_index(struct hash **hashes, size_t *nhashes, size_t *datalen_out, const char *path)
+{
+    struct index_reader index;
+    size_t linelen, alloc = 0;
+    char *line;
+    int fd, err;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        die_errno("Unable to open index '%s'", path);
+
+    if (index_reader_init(&index, fd) < 0)
+        die_errno("Unable to allocate index buffer");
+
+    while ((err = index_reader_line(&index, &line, &linelen)) > 0) {
+        if (*line == '>')
+            break;
+
+        if (*nhashes == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            if ((*hashes = realloc(*hashes, alloc * sizeof(**hashes))) == NULL)
+                die_errno("Unable to allocate index");
+        }
+
+        if (hash_from_str(&(*hashes)[*nhashes], line, linelen) < 0)
+            die("Invalid index hash '%s' in '%s'", line, path);
+        (*nhashes)++;
+    }
+
+    if (err < 0)
+        die_errno("Unable to read index '%s'", path);
+    if (err == 0 || *line != '>' || linelen < HASH_LEN * 2 + 3 || line[HASH_LEN * 2 + 1] != ' ')
+        die("Index '%s' has no valid trailer", path);
+
+    *datalen_out = strtoul(line + HASH_LEN * 2 + 2, NULL, 10);
+    if ((*datalen_out + BLOCK_LEN - 1) / BLOCK_LEN != *nhashes)
+        die("Index '%s' has an invalid length", path);
+
+    index_reader_free(&index);
+    if (try_close(fd) < 0)
+        die_errno("Unable to close index '%s'", path);
+}
+
+/*
+ * Every block but the last one is of maximum length, so we can check
+ * block sizes without reading any data.
+ */
+static size_t expected_length(const struct verify_job *job, size_t i)
+{
+    return i + 1 < job->nhashes ? BLOCK_LEN : job->datalen - i * BLOCK_LEN;
+}
+
+static void *verify_blocks(void *payload)
+{
+    struct verify_job *job = payload;
+    size_t i;
+
+    for (i = job->first; i < job->nhashes; i += job->stride) {
+        const struct hash *hash = &job->hashes[i];
+        size_t len = expected_length(job, i);
+        struct hash computed;
+        struct stat st;
+        ssize_t bytes;
+
+        job->checked++;
+
+        if (store_stat(&st, &job->store, hash) < 0 || !S_ISREG(st.st_mode)) {
+            warn("Block %s is missing", hash->hex);
+            job->failed++;
+            continue;
+        }
+
+        if ((size_t) st.st_size != len) {
+            warn("Block %s has size %"PRIuMAX", expected %"PRIuMAX,
+                    hash->hex, (uintmax_t) st.st_size, (uintmax_t) len);
+            job->failed++;
+            continue;
+        }
+
+        if (!job->full[i])
+            continue;
+
+        if ((bytes = store_read_uncached(job->block, BLOCK_LEN, &job->store, hash)) < 0) {
+            warn("Unable to read block %s: %s", hash->hex, strerror(errno));
+            job->failed++;
+            continue;
+        }
+        if (hash_compute(&computed, job->block, (size_t) bytes) < 0)
+            die("Unable to hash block %s", hash->hex);
+        job->hashed++;
+
+        if (!hash_eq(&computed, hash)) {
+            warn("Hash mismatch for block %s", hash->hex);
+            job->failed++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Pick "count" distinct blocks with equal probability by walking the
+ * index once and selecting each block with probability
+ * needed / remaining.
+ */
+static void select_sample(unsigned char *full, size_t nhashes, size_t count)
+{
+    size_t i;
+
+    srand((unsigned) time(NULL) ^ (unsigned) getpid());
+
+    for (i = 0; i < nhashes && count; i++) {
+        if ((double) rand() / ((double) RAND_MAX + 1) * (double) (nhashes - i) < (double) count) {
+            full[i] = 1;
+            count--;
+        }
+    }
+}
+
+int gob_verify(int argc, const char *argv[])
+{
+    struct verify_job *jobs;
+    struct hash *hashes = NULL;
+    unsigned char *full;
+    uintmax_t checked = 0, hashed = 0, failed = 0;
+    size_t j, nhashes = 0, datalen, sample = 0;
+    unsigned long njobs = 4;
+    int i, error, all = 0, verbose = 0;
+
+    for (i = 1; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--full"))
+            all = 1;
+        else if (!strcmp(argv[i], "--sample") && i + 1 < argc)
+            sample = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+            njobs = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--verbose"))
+            verbose = 1;
+        else
+            die("Unknown option '%s'", argv[i]);
+    }
+
+    if (argc - i != 2 || !njobs || (all && sample))
+        die("USAGE: %s verify [--full | --sample <N>] [--jobs <N>] [--verbose] <DIR> <INDEX>", argv[0]);
+
+    atexit(close_stdout);
+
+    read_index(&hashes, &nhashes, &datalen, argv[i + 1]);
+
+    if ((full = calloc(nhashes ? nhashes : 1, 1)) == NULL)
+        die_errno("Unable to allocate sample");
+    if (all)
+        memset(full, 1, nhashes);
+    else if (sample)
+        select_sample(full, nhashes, sample);
+
+    if (njobs > nhashes)
+        njobs = nhashes ? nhashes : 1;
+
+    if ((jobs = calloc(njobs, sizeof(*jobs))) == NULL)
+        die_errno("Unable to allocate jobs");
+
+    for (j = 0; j < njobs; j++) {
+        if ((jobs[j].block = malloc(BLOCK_LEN)) == NULL)
+            die_errno("Unable to allocate block");
+        if (store_open(&jobs[j].store, argv[i]) < 0)
+            die("Unable to open store");
+        jobs[j].hashes = hashes;
+        jobs[j].full = full;
+        jobs[j].first = j;
+        jobs[j].stride = njobs;
+        jobs[j].nhashes = nhashes;
+        jobs[j].datalen = datalen;
+
+        if ((error = pthread_create(&jobs[j].thread, NULL, verify_blocks, &jobs[j])) != 0) {
+            errno = error;
+            die_errno("Unable to create thread");
+        }
+    }
+
+    for (j = 0; j < njobs; j++) {
+        if ((error = pthread_join(jobs[j].thread, NULL)) != 0) {
+            errno = error;
+            die_errno("Unable to join thread");
+        }
+        checked += jobs[j].checked;
+        hashed += jobs[j].hashed;
+        failed += jobs[j].failed;
+
+        if (store_close(&jobs[j].store) < 0)
+            die("Unable to close store");
+        free(jobs[j].block);
+    }
+
+    if (verbose)
+        fprintf(stderr, "%"PRIuMAX" blocks checked, %"PRIuMAX" hashed, %"PRIuMAX" failed\n",
+                checked, hashed, failed);
+
+    free(jobs);
+    free(full);
+    free(hashes);
+
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measure how many index lines per second can be written and parsed
+ * again, including encoding and decoding of hashes.
+ */
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BENCH_LINES (4 * 1024 * 1024)
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, const char *argv[])
+{
+    char path[] = "/tmp/gob-bench-index-XXXXXX", *line;
+    unsigned char bin[HASH_LEN];
+    struct index_writer writer;
+    struct index_reader reader;
+    struct timespec start;
+    struct hash hash;
+    size_t i, j, linelen, nlines = BENCH_LINES;
+    int fd, err;
+
+    if (argc > 1)
+        nlines = strtoul(argv[1], NULL, 10);
+
+    if ((fd = mkstemp(path)) < 0)
+        die_errno("Unable to create temporary index");
+    unlink(path);
+
+    if (index_writer_init(&writer, fd) < 0)
+        die_errno("Unable to set up index writer");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nlines; i++) {
+        for (j = 0; j < HASH_LEN; j++)
+            bin[j] = (unsigned char) ((i >> (j % sizeof(size_t) * 8)) + j);
+        if (hash_from_bin(&hash, bin, HASH_LEN) < 0 || index_writer_add(&writer, &hash) < 0)
+            die_errno("Unable to write index");
+    }
+    if (index_writer_trailer(&writer, &hash, 0) < 0)
+        die_errno("Unable to write index");
+    printf("write: %.0f lines/s\n", (double) nlines / seconds_since(&start));
+
+    if (lseek(fd, 0, SEEK_SET) < 0 || index_reader_init(&reader, fd) < 0)
+        die_errno("Unable to set up index reader");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; (err = index_reader_line(&reader, &line, &linelen)) > 0 && *line != '>'; i++)
+        if (hash_from_str(&hash, line, linelen) < 0)
+            die("Invalid index hash '%s'", line);
+    if (err < 0 || i != nlines)
+        die("Unable to read index");
+    printf("read: %.0f lines/s\n", (double) nlines / seconds_since(&start));
+
+    index_writer_free(&writer);
+    index_reader_free(&reader);
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measure how many bytes per second can be chunked into a store and
+ * restored from it again, including hashing of blocks. Unless a store
+ * is given, blocks are kept by the memory backend so that results are
+ * not skewed by the filesystem.
+ */
+
+#include "common.h"
+
+#include <unistd.h>
+
+#define BENCH_BLOCKS 32
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void remove_store(const char *path)
+{
+    struct dirent *ent;
+    DIR *dir;
+
+    if ((dir = opendir(path)) == NULL)
+        die_errno("Unable to open temporary store");
+    while ((ent = readdir(dir)) != NULL)
+        if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..") && unlinkat(dirfd(dir), ent->d_name, 0) < 0)
+            die_errno("Unable to remove '%s'", ent->d_name);
+    closedir(dir);
+
+    if (rmdir(path) < 0)
+        die_errno("Unable to remove temporary store");
+}
+
+int main(int argc, const char *argv[])
+{
+    char tmpdir[] = "/tmp/gob-bench-store-XXXXXX", path[sizeof(tmpdir) + 8];
+    const char *storepath = path;
+    struct store_config config;
+    struct timespec start;
+    struct store store;
+    struct hash *hashes, computed;
+    unsigned char *data, *block;
+    size_t i, j, nblocks = BENCH_BLOCKS;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    ssize_t len;
+
+    if (argc > 1)
+        nblocks = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        storepath = argv[2];
+
+    if ((data = malloc(nblocks * BLOCK_LEN)) == NULL || (block = malloc(BLOCK_LEN)) == NULL ||
+            (hashes = malloc(nblocks * sizeof(*hashes))) == NULL)
+        die_errno("Unable to allocate blocks");
+
+    /* Blocks are pseudo-random so that none of them get deduplicated. */
+    for (i = 0; i < nblocks * BLOCK_LEN; i += 8) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        for (j = 0; j < 8; j++)
+            data[i + j] = (unsigned char) (state >> (j * 8));
+    }
+
+    if (storepath == path) {
+        if (mkdtemp(tmpdir) == NULL)
+            die_errno("Unable to create temporary directory");
+        sprintf(path, "%s/store", tmpdir);
+
+        store_config_init(&config);
+        strcpy(config.backend, "memory");
+        store_init(path, &config);
+    }
+
+    if (store_open(&store, storepath) < 0)
+        die("Unable to open store");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nblocks; i++)
+        store_write(&hashes[i], &store, data + i * BLOCK_LEN, BLOCK_LEN);
+    printf("chunk: %.0f MB/s\n", (double) (nblocks * BLOCK_LEN) / 1e6 / seconds_since(&start));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nblocks; i++) {
+        if ((len = store_read(block, BLOCK_LEN, &store, &hashes[i])) < 0)
+            die_errno("Unable to read block '%s'", hashes[i].hex);
+        if (hash_compute(&computed, block, (size_t) len) < 0 || !hash_eq(&computed, &hashes[i]))
+            die("Hash mismatch for block '%s'", hashes[i].hex);
+    }
+    printf("cat: %.0f MB/s\n", (double) (nblocks * BLOCK_LEN) / 1e6 / seconds_since(&start));
+
+    if (store_close(&store) < 0)
+        die("Unable to close store");
+
+    if (storepath == path) {
+        remove_store(path);
+        if (rmdir(tmpdir) < 0)
+            die_errno("Unable to remove temporary directory");
+    }
+
+    free(hashes);
+    free(block);
+    free(data);
+
+    return 0;
+}
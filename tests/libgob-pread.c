@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2019 Patrick Steinhardt
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Read a range of data via libgob and write it to stdout, followed
+ * by the total size and read statistics on stderr.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libgob.h"
+
+int main(int argc, const char *argv[])
+{
+    struct gob_store *store;
+    struct gob_index *index;
+    struct gob_stats stats;
+    unsigned long offset, len;
+    char *buf;
+    ssize_t bytes;
+
+    if (argc != 5) {
+        fprintf(stderr, "USAGE: %s <DIR> <INDEX> <OFFSET> <LENGTH>\n", argv[0]);
+        return 1;
+    }
+
+    offset = strtoul(argv[3], NULL, 10);
+    len = strtoul(argv[4], NULL, 10);
+
+    if (gob_store_open(&store, argv[1]) < 0 ||
+            gob_index_open(&index, store, argv[2], 0) < 0) {
+        fprintf(stderr, "Unable to open index: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if ((buf = malloc(len ? len : 1)) == NULL ||
+            (bytes = gob_index_pread(index, buf, len, offset)) < 0) {
+        fprintf(stderr, "Unable to read: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (fwrite(buf, 1, (size_t) bytes, stdout) != (size_t) bytes || fflush(stdout) != 0)
+        return 1;
+
+    gob_index_stats(index, &stats);
+    fprintf(stderr, "size %lu, %lu bytes read, %lu cache misses\n",
+            (unsigned long) gob_index_size(index), (unsigned long) stats.bytes_read,
+            (unsigned long) stats.cache_misses);
+
+    gob_index_close(index);
+    gob_store_close(store);
+    free(buf);
+
+    return 0;
+}
@@ -13,7 +13,7 @@
 # You should have received a copy of the GNU General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-PATH="$(pwd)/src:${PATH}"
+PATH="$(pwd)/src:$(pwd)/tests:${PATH}"
 TEST_NUM=0
 TEST_DIR=$(mktemp -d /tmp/gob-tests-XXXXXXXX)
 FAILED=0
@@ -247,6 +247,888 @@ test_expect_success 'fsck with corrupted store file fails' '
 	assert_failure gob fsck blocks
 '
 
+test_expect_success 'bundle roundtrip restores all blocks' '
+	test_store blocks &&
+	test_when_finished rm -rf blocks imported &&
+	assert_success gob init imported &&
+	assert_success dd if=/dev/urandom bs=1048576 count=9 >expected &&
+	assert_success gob chunk blocks <expected >index &&
+	assert_success gob bundle create blocks index index >bundle &&
+	assert_success gob bundle import imported <bundle &&
+	assert_success gob fsck imported &&
+	assert_success gob cat imported <index >actual &&
+	assert_equal actual expected
+'
+
+test_expect_success 'bundle contains duplicate blocks once' '
+	test_store blocks &&
+	assert_success "dd if=/dev/zero bs=4194304 count=3 >zeroes" &&
+	assert_success gob chunk blocks <zeroes >index &&
+	assert_success gob bundle create blocks index >bundle &&
+	assert_success test $(wc -c <bundle) -eq 4194400
+'
+
+test_expect_success 'bundle import with truncated bundle fails' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success gob bundle create blocks index >bundle &&
+	assert_success head -c 40 <bundle >truncated &&
+	assert_failure gob bundle import blocks <truncated
+'
+
+test_expect_success 'bundle import with corrupted block fails' '
+	test_when_finished rm -rf blocks imported &&
+	assert_success gob init blocks &&
+	assert_success gob init imported &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success gob bundle create blocks index >bundle &&
+	assert_success "sed s/foobar/foobaz/ <bundle >corrupted" &&
+	assert_failure gob bundle import blocks <corrupted &&
+	assert_failure gob bundle import imported <corrupted &&
+	assert_success "test \"$(find imported -type f -path imported/\?\?/\* | wc -l)\" -eq 0"
+'
+
+test_expect_success 'bundle with missing blocks fails' '
+	test_store blocks &&
+	cat >index <<-EOF &&
+		00000000000000000000000000000000
+		>00000000000000000000000000000000 7
+	EOF
+	assert_failure gob bundle create blocks index
+'
+
+test_expect_success 'chunk-tree writes tree index' '
+	test_store blocks &&
+	test_when_finished rm -rf blocks tree &&
+	assert_success mkdir -p tree/sub &&
+	assert_success echo test >tree/sub/file &&
+	assert_success "echo foobar >\"tree/with space\"" &&
+	assert_success ln -s file tree/sub/link &&
+	assert_success gob chunk-tree blocks tree >index &&
+	assert_success "cut -d\" \" -f1,6- <index >actual" &&
+	cat >expected <<-EOF &&
+		d .
+		d sub
+		f sub/file
+		21ebd7636fdde0f4929e0ed3c0beaf55
+		>21ebd7636fdde0f4929e0ed3c0beaf55
+		l sub/link file
+		f with\040space
+		d6d45901dec53e65d2b55fb6e2ab67b0
+		>d6d45901dec53e65d2b55fb6e2ab67b0
+	EOF
+	assert_equal actual expected
+'
+
+test_expect_success 'chunk-tree file entries can be restored with cat' '
+	test_store blocks &&
+	test_when_finished rm -rf blocks tree &&
+	assert_success mkdir tree &&
+	assert_success dd if=/dev/urandom bs=1048576 count=5 >tree/file &&
+	assert_success gob chunk-tree blocks tree >index &&
+	assert_success "sed -n \"/^f /,/^>/p\" <index | sed 1d >file-index" &&
+	assert_success gob cat blocks <file-index >actual &&
+	assert_equal actual tree/file
+'
+
+test_expect_success 'chunk-tree reuses cached block lists' '
+	test_store blocks &&
+	test_when_finished rm -rf blocks tree &&
+	assert_success mkdir tree &&
+	assert_success echo unchanged >tree/a &&
+	assert_success echo changed >tree/b &&
+	assert_success gob chunk-tree --cache cache blocks tree >expected &&
+	assert_success gob chunk-tree --cache cache --verbose blocks tree >actual 2>stats &&
+	assert_equal actual expected &&
+	assert_success "grep -q \"^2 files, 2 unchanged, 0 bytes read\" stats" &&
+	assert_success echo modified >>tree/b &&
+	assert_success gob chunk-tree --cache cache --verbose blocks tree >actual 2>stats &&
+	assert_success "grep -q \"^2 files, 1 unchanged, 17 bytes read\" stats"
+'
+
+test_expect_success 'cat to target creates target' '
+	test_store blocks &&
+	assert_success dd if=/dev/urandom bs=1048576 count=9 >expected &&
+	assert_success gob chunk blocks <expected >index &&
+	assert_success gob cat --target actual blocks <index &&
+	assert_equal actual expected
+'
+
+test_expect_success 'cat to target only writes differing blocks' '
+	test_store blocks &&
+	assert_success dd if=/dev/urandom bs=1048576 count=13 >expected &&
+	assert_success gob chunk blocks <expected >index &&
+	assert_success cp expected actual &&
+	assert_success "printf foobar | dd of=actual bs=1 seek=5000000 conv=notrunc" &&
+	assert_success gob cat --target actual --jobs 2 --verbose blocks <index 2>stats &&
+	assert_equal actual expected &&
+	assert_success "grep -q \"^1 of 4 blocks written\" stats"
+'
+
+test_expect_success 'cat to target truncates longer target' '
+	test_store blocks &&
+	assert_success dd if=/dev/urandom bs=1048576 count=5 >expected &&
+	assert_success gob chunk blocks <expected >index &&
+	assert_success dd if=/dev/zero bs=1048576 count=11 >actual &&
+	assert_success gob cat --target actual blocks <index &&
+	assert_equal actual expected
+'
+
+test_expect_success 'cat to target with invalid trailer hash fails' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success sed s|>....|>0000| <index >invalid &&
+	assert_failure gob cat --target actual blocks <invalid
+'
+
+test_expect_success 'cat to target does not write corrupt blocks' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success "echo fooxyz >blocks/d6/d45901dec53e65d2b55fb6e2ab67b0" &&
+	assert_success "echo foobaz >actual" &&
+	assert_success "echo foobaz >expected" &&
+	assert_failure gob cat --target actual blocks <index &&
+	assert_equal actual expected
+'
+
+test_expect_success 'cat serves repeated blocks from cache' '
+	test_store blocks &&
+	assert_success "dd if=/dev/zero bs=4194304 count=4 >expected" &&
+	assert_success gob chunk blocks <expected >index &&
+	assert_success gob cat --verbose blocks <index >actual 2>stats &&
+	assert_equal actual expected &&
+	assert_success "grep -q \"^3 cache hits, 1 cache misses\" stats"
+'
+
+test_expect_success 'cat with disabled cache succeeds' '
+	test_store blocks &&
+	assert_success "dd if=/dev/zero bs=4194304 count=2 >expected" &&
+	assert_success gob chunk blocks <expected >index &&
+	assert_success gob cat --cache-size 0 --verbose blocks <index >actual 2>stats &&
+	assert_equal actual expected &&
+	assert_success "grep -q \"^0 cache hits, 2 cache misses\" stats"
+'
+
+test_expect_success 'cat with invalid cache size fails' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_failure gob cat --cache-size 12X blocks <index
+'
+
+test_expect_success 'chunking with multi-level sharding succeeds' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init --shard-depth 2 blocks &&
+	assert_success echo test >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success test -e blocks/21/eb/d7636fdde0f4929e0ed3c0beaf55 &&
+	assert_success gob cat blocks <index >actual &&
+	assert_equal actual input &&
+	assert_success gob fsck blocks
+'
+
+test_expect_success 'chunking with wide sharding succeeds' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init --shard-width 3 blocks &&
+	assert_success echo test >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success test -e blocks/21e/bd7636fdde0f4929e0ed3c0beaf55 &&
+	assert_success gob fsck blocks
+'
+
+test_expect_success 'initializing with invalid sharding fails' '
+	test_when_finished rm -rf blocks &&
+	assert_failure gob init --shard-depth 3 --shard-width 3 blocks &&
+	assert_failure test -e blocks
+'
+
+test_expect_success 'store with unknown configuration fails' '
+	test_store blocks &&
+	assert_success "echo \"foo = bar\" >>blocks/config" &&
+	assert_success echo test >input &&
+	assert_failure gob chunk blocks <input
+'
+
+test_expect_success 'version 1 store without configuration can be used' '
+	test_store blocks &&
+	assert_success rm blocks/config &&
+	assert_success "printf \"\\000\\000\\000\\001\" >blocks/version" &&
+	assert_success echo test >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success test -e blocks/21/ebd7636fdde0f4929e0ed3c0beaf55 &&
+	assert_success gob fsck blocks
+'
+
+test_expect_success 'reshard moves blocks into new layout' '
+	test_store blocks &&
+	assert_success dd if=/dev/urandom bs=1048576 count=9 >expected &&
+	assert_success gob chunk blocks <expected >index &&
+	assert_success gob reshard --shard-depth 2 --verbose blocks 2>stats &&
+	assert_success "grep -q \"^Moved 3 blocks\" stats" &&
+	assert_success gob fsck blocks &&
+	assert_success gob cat blocks <index >actual &&
+	assert_equal actual expected &&
+	assert_success gob reshard --shard-depth 1 --shard-width 3 blocks &&
+	assert_success gob fsck blocks &&
+	assert_success gob cat blocks <index >actual &&
+	assert_equal actual expected &&
+	assert_success "grep -q \"shard-width = 3\" blocks/config"
+'
+
+test_expect_success 'interrupted reshard can be resumed' '
+	test_store blocks &&
+	assert_success echo test >input &&
+	assert_success gob chunk blocks <input >index &&
+	cat >blocks/config <<-EOF &&
+		shard-depth = 2
+		shard-width = 2
+		reshard-from-depth = 1
+		reshard-from-width = 2
+	EOF
+	assert_failure gob cat blocks <index &&
+	assert_success gob reshard blocks &&
+	assert_success test -e blocks/21/eb/d7636fdde0f4929e0ed3c0beaf55 &&
+	assert_success gob cat blocks <index >actual &&
+	assert_equal actual input
+'
+
+test_expect_success 'concurrent chunking into the same store succeeds' '
+	test_store blocks &&
+	assert_success dd if=/dev/urandom bs=1048576 count=20 >shared &&
+	assert_success dd if=/dev/urandom bs=1048576 count=6 >other &&
+	assert_success gob chunk blocks <other >expected-other &&
+	assert_success rm -rf blocks &&
+	assert_success gob init --shard-width 1 blocks &&
+	PIDS= &&
+	for i in 1 2 3 4 5 6 7 8 other
+	do
+		if test $i = other
+		then
+			gob chunk blocks <other >index-other &
+		else
+			gob chunk blocks <shared >index-$i &
+		fi
+		PIDS="$PIDS $!"
+	done &&
+	for pid in $PIDS
+	do
+		wait $pid || exit 1
+	done &&
+	for i in 2 3 4 5 6 7 8
+	do
+		assert_equal index-1 index-$i || exit 1
+	done &&
+	assert_equal index-other expected-other &&
+	assert_success gob fsck blocks &&
+	assert_success gob cat blocks <index-1 >actual &&
+	assert_equal actual shared &&
+	assert_success "test -z \"$(find blocks -name \*.tmp)\""
+'
+
+test_expect_success 'chunking with direct input matches buffered chunking' '
+	test_store blocks &&
+	assert_success dd if=/dev/urandom bs=1000000 count=23 >input &&
+	assert_success gob chunk blocks <input >expected &&
+	assert_success gob chunk --direct --readahead 3 blocks <input >actual &&
+	assert_equal actual expected &&
+	assert_success gob cat blocks <actual >output &&
+	assert_equal output input
+'
+
+test_expect_success 'chunking with direct input of block multiple succeeds' '
+	test_store blocks &&
+	assert_success "dd if=/dev/zero bs=4194304 count=2 >input" &&
+	assert_success gob chunk blocks <input >expected &&
+	assert_success gob chunk --direct blocks <input >actual &&
+	assert_equal actual expected
+'
+
+test_expect_success 'chunking with direct input leaves input flags alone' '
+	test_store blocks &&
+	assert_success "yes abc | head -c 8192 >input" &&
+	assert_success "{ gob chunk --direct blocks >index && dd bs=1 count=1 of=first; } <input" &&
+	assert_success "printf a >expected" &&
+	assert_equal first expected
+'
+
+test_expect_success 'chunking with direct input from pipe fails' '
+	test_store blocks &&
+	assert_failure "echo foobar | gob chunk --direct blocks"
+'
+
+test_expect_success 'chunking with input limit is throttled' '
+	test_store blocks &&
+	assert_success "dd if=/dev/zero bs=4194304 count=2 >input" &&
+	echo "input = 2M" >limits &&
+	START=$(date +%s) &&
+	assert_success gob chunk --limit-file limits blocks <input >index &&
+	END=$(date +%s) &&
+	assert_success test $(($END - $START)) -ge 2
+'
+
+test_expect_success 'cat with store read limit succeeds' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success gob cat --limit store-read=1M --limit store-read-ops=10 blocks <index >actual &&
+	assert_equal actual input
+'
+
+test_expect_success 'chunking with invalid limit fails' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_failure gob chunk --limit foobar=1M blocks <input &&
+	assert_failure gob chunk --limit input=fast blocks <input
+'
+
+test_expect_success 'chunking with metrics writes counters' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk --metrics metrics blocks <input >index &&
+	assert_success "grep -q \"^gob_input_bytes_total{command=.chunk.} 7$\" metrics" &&
+	assert_success "grep -q \"^gob_blocks_new_total{command=.chunk.} 1$\" metrics" &&
+	assert_success gob chunk --metrics metrics blocks <input >index &&
+	assert_success "grep -q \"^gob_blocks_deduplicated_total{command=.chunk.} 1$\" metrics" &&
+	assert_success "grep -q \"^gob_store_write_seconds_count{command=.chunk.} 1$\" metrics"
+'
+
+test_expect_success 'cat and fsck with metrics write counters' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success gob cat --metrics metrics blocks <index >actual &&
+	assert_success "grep -q \"^gob_output_bytes_total{command=.cat.} 7$\" metrics" &&
+	assert_success gob fsck --metrics metrics blocks &&
+	assert_success "grep -q \"^gob_store_read_bytes_total{command=.fsck.} 7$\" metrics" &&
+	assert_success "grep -q \"^gob_errors_total{command=.fsck.} 0$\" metrics"
+'
+
+test_expect_success 'verify succeeds for complete index' '
+	test_store blocks &&
+	assert_success "dd if=/dev/urandom bs=1048576 count=9 >input" &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success gob verify blocks index &&
+	assert_success gob verify --sample 2 blocks index &&
+	assert_success gob verify --full --jobs 2 --verbose blocks index 2>stats &&
+	assert_success "grep -q \"^3 blocks checked, 3 hashed, 0 failed\" stats"
+'
+
+test_expect_success 'verify detects missing and truncated blocks' '
+	test_store blocks &&
+	assert_success "dd if=/dev/urandom bs=1048576 count=9 >input" &&
+	assert_success gob chunk blocks <input >index &&
+	BLOCK=$(sed -n 1p index) &&
+	assert_success "truncate -s 10 blocks/$(echo $BLOCK | cut -c1-2)/$(echo $BLOCK | cut -c3-)" &&
+	assert_failure gob verify blocks index &&
+	assert_success "rm blocks/$(echo $BLOCK | cut -c1-2)/$(echo $BLOCK | cut -c3-)" &&
+	assert_failure gob verify blocks index
+'
+
+test_expect_success 'verify with full hashing detects corrupt blocks' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	BLOCK=$(sed -n 1p index) &&
+	assert_success "echo barfoo >blocks/$(echo $BLOCK | cut -c1-2)/$(echo $BLOCK | cut -c3-)" &&
+	assert_success gob verify blocks index &&
+	assert_failure gob verify --full blocks index
+'
+
+test_expect_success 'verify with full hashing bypasses cache store' '
+	test_when_finished rm -rf blocks ssd &&
+	assert_success gob init ssd &&
+	assert_success gob init --cache ../ssd blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success test -f ssd/d6/d45901dec53e65d2b55fb6e2ab67b0 &&
+	assert_success "echo barfoo >blocks/d6/d45901dec53e65d2b55fb6e2ab67b0" &&
+	assert_failure gob verify --full blocks index
+'
+
+test_expect_success 'libgob reads ranges across blocks' '
+	test_store blocks &&
+	assert_success "dd if=/dev/urandom bs=1048576 count=9 >input" &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success "libgob-pread blocks index 4194000 1000 >actual 2>stats" &&
+	assert_success "tail -c +4194001 input | head -c 1000 >expected" &&
+	assert_equal actual expected &&
+	assert_success "grep -q \"^size 9437184, 1000 bytes read, 2 cache misses\" stats" &&
+	assert_success "libgob-pread blocks index 9437000 1000 >actual" &&
+	assert_success "tail -c 184 input >expected" &&
+	assert_equal actual expected &&
+	assert_success "libgob-pread blocks index 9437184 1000 >actual" &&
+	assert_success test ! -s actual
+'
+
+test_expect_success 'libgob detects corrupt blocks' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success "echo barfoo >blocks/d6/d45901dec53e65d2b55fb6e2ab67b0" &&
+	assert_failure libgob-pread blocks index 0 7
+'
+
+test_expect_success 'cat-many restores multiple indices' '
+	test_store blocks &&
+	assert_success "dd if=/dev/urandom bs=1048576 count=9 >base" &&
+	assert_success "cat base base >first" &&
+	assert_success "cat base >second && echo foobar >>second" &&
+	assert_success gob chunk blocks <first >first.index &&
+	assert_success gob chunk blocks <second >second.index &&
+	assert_success gob cat-many --verbose blocks first.index:first.out second.index:second.out 2>stats &&
+	assert_equal first.out first &&
+	assert_equal second.out second &&
+	assert_success "grep -q \"^6 unique blocks read for 8 blocks written\" stats"
+'
+
+test_expect_success 'cat-many truncates existing outputs' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success "dd if=/dev/urandom bs=1048576 count=1 >output" &&
+	assert_success gob cat-many blocks index:output &&
+	assert_equal output input
+'
+
+test_expect_success 'cat-many with missing block fails' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success rm blocks/d6/d45901dec53e65d2b55fb6e2ab67b0 &&
+	assert_failure gob cat-many blocks index:output &&
+	assert_failure gob cat-many blocks index
+'
+
+test_expect_success 'catalog lists written blocks' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success gob catalog list blocks >catalog &&
+	assert_success "grep -q \"^d6d45901dec53e65d2b55fb6e2ab67b0 7$\" catalog" &&
+	assert_success gob catalog check blocks &&
+	assert_success gob fsck blocks
+'
+
+test_expect_success 'catalog check detects missing blocks and entries' '
+	test_store blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success rm blocks/d6/d45901dec53e65d2b55fb6e2ab67b0 &&
+	assert_failure gob catalog check blocks &&
+	assert_success gob catalog rebuild blocks &&
+	assert_success gob catalog check blocks &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success "echo foo >blocks/d6/d45901dec53e65d2b55fb6e2ab67b0" &&
+	assert_failure gob catalog check blocks
+'
+
+test_expect_success 'catalog can be rebuilt for store without catalog' '
+	test_store blocks &&
+	assert_success rm blocks/catalog &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_failure gob catalog check blocks &&
+	assert_success gob catalog rebuild blocks &&
+	assert_success gob catalog check blocks &&
+	assert_success gob catalog list blocks >catalog &&
+	assert_success "grep -q \"^d6d45901dec53e65d2b55fb6e2ab67b0 7$\" catalog"
+'
+
+test_expect_success 'catalog compaction keeps entries' '
+	test_store blocks &&
+	assert_success "dd if=/dev/urandom bs=1048576 count=9 >input" &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success gob catalog list blocks >expected &&
+	assert_success gob catalog compact blocks &&
+	assert_success gob catalog list blocks >actual &&
+	assert_equal actual expected &&
+	assert_success test "$(stat -c %s blocks/catalog)" -eq $((24 + 3 * 24)) &&
+	assert_success gob catalog check blocks
+'
+
+test_expect_success 'interrupted chunking can be resumed' '
+	test_store blocks &&
+	assert_success "(yes a | head -c 4194304; yes b | head -c 4194304; yes c | head -c 1048576) >input" &&
+	assert_success touch blocks/c5 &&
+	assert_failure gob chunk --checkpoint checkpoint --checkpoint-interval 1 blocks <input >index &&
+	assert_success test -f checkpoint &&
+	assert_success rm blocks/c5 blocks/af/dcd333413d19a7838df6525660164a &&
+	assert_failure gob chunk --resume blocks <input &&
+	assert_success "cat input | gob chunk --checkpoint checkpoint --resume blocks >index" &&
+	assert_failure test -e checkpoint &&
+	assert_failure test -e blocks/af/dcd333413d19a7838df6525660164a &&
+	assert_success test -f blocks/c5/0026e83fbfb1cafb3ea8ceea39b6cf &&
+	assert_success "test \"$(wc -l <index)\" -eq 4" &&
+	assert_success "grep -q \"^>c39394cd73615956ec9af5e8591c22db 9437184$\" index"
+'
+
+test_expect_success 'interrupted cat can be resumed' '
+	test_store blocks &&
+	assert_success "(yes a | head -c 4194304; yes b | head -c 4194304; yes c | head -c 1048576) >input" &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success mv blocks/c5/0026e83fbfb1cafb3ea8ceea39b6cf block &&
+	assert_failure gob cat --checkpoint checkpoint --checkpoint-interval 1 blocks <index >output &&
+	assert_success test -f checkpoint &&
+	assert_success mv block blocks/c5/0026e83fbfb1cafb3ea8ceea39b6cf &&
+	assert_success rm blocks/af/dcd333413d19a7838df6525660164a &&
+	assert_success "gob cat --checkpoint checkpoint --resume blocks <index >>output" &&
+	assert_equal output input &&
+	assert_failure test -e checkpoint
+'
+
+test_expect_success 'resuming cat into truncated output fails' '
+	test_store blocks &&
+	assert_success "(yes a | head -c 4194304; yes b | head -c 4194304; yes c | head -c 1048576) >input" &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success mv blocks/c5/0026e83fbfb1cafb3ea8ceea39b6cf block &&
+	assert_failure gob cat --checkpoint checkpoint --checkpoint-interval 1 blocks <index >output &&
+	assert_success mv block blocks/c5/0026e83fbfb1cafb3ea8ceea39b6cf &&
+	assert_failure "gob cat --checkpoint checkpoint --resume blocks <index >output" &&
+	assert_success test -f checkpoint
+'
+
+test_expect_success 'interrupted restore onto target can be resumed' '
+	test_store blocks &&
+	assert_success rm -f target &&
+	assert_success "(yes a | head -c 4194304; yes b | head -c 4194304; yes c | head -c 1048576) >input" &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success mv blocks/c5/0026e83fbfb1cafb3ea8ceea39b6cf block &&
+	assert_failure gob cat --target target --jobs 1 --checkpoint checkpoint --checkpoint-interval 1 blocks <index &&
+	assert_success test -f checkpoint &&
+	assert_success mv block blocks/c5/0026e83fbfb1cafb3ea8ceea39b6cf &&
+	assert_success rm blocks/af/dcd333413d19a7838df6525660164a &&
+	assert_success gob cat --target target --jobs 1 --checkpoint checkpoint --resume blocks <index &&
+	assert_equal target input &&
+	assert_failure test -e checkpoint
+'
+
+test_expect_success 'analyze reports deduplication of fixed chunking' '
+	assert_success "dd if=/dev/urandom bs=1048576 count=9 >base" &&
+	assert_success "cat base base >input" &&
+	assert_success "gob analyze --fixed 1M --fixed 4M <input >analysis" &&
+	assert_success "grep -q \"^fixed 1048576 18 9437184 2.00 637$\" analysis" &&
+	assert_success "grep -q \"^fixed 4194304 5 18874368 1.00 208$\" analysis"
+'
+
+test_expect_success 'analyze detects shifted duplicates with content-defined chunking' '
+	assert_success "dd if=/dev/urandom bs=1048576 count=9 >base" &&
+	assert_success "(cat base; echo x; cat base) >input" &&
+	assert_success "gob analyze --fixed 1M --cdc 64K <input >analysis" &&
+	assert_success "grep -q \"^fixed 1048576 19 18874370 1.00 \" analysis" &&
+	assert_success "awk \"/^cdc 65536 / { exit !(\\\$5 > 1.9) }\" analysis"
+'
+
+test_expect_success 'analyze compares with existing store' '
+	test_store blocks &&
+	assert_success "dd if=/dev/urandom bs=1048576 count=9 >base" &&
+	assert_success gob chunk blocks <base >index &&
+	assert_success "cat base base >input" &&
+	assert_success "gob analyze --store blocks --fixed 4M --fixed 1M <input >analysis" &&
+	assert_success "grep -q \" new-bytes$\" analysis" &&
+	assert_success "grep -q \"^fixed 4194304 .* 10485760$\" analysis" &&
+	assert_success "grep -q \"^fixed 1048576 .* -$\" analysis"
+'
+
+test_expect_success 'analyze with invalid chunk size fails' '
+	assert_success echo foobar >input &&
+	assert_failure gob analyze --cdc 16 <input &&
+	assert_failure gob analyze --fixed 0 <input &&
+	assert_failure gob analyze --sample 0 <input
+'
+
+test_expect_success 'tiered store writes blocks through to cache' '
+	test_when_finished rm -rf blocks ssd &&
+	assert_success gob init ssd &&
+	assert_success gob init --cache "$(pwd)/ssd" --cache-size 1G blocks &&
+	assert_success "grep -q \"^cache = \" blocks/config" &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success test -f blocks/d6/d45901dec53e65d2b55fb6e2ab67b0 &&
+	assert_success test -f ssd/d6/d45901dec53e65d2b55fb6e2ab67b0
+'
+
+test_expect_success 'tiered store populates cache on read' '
+	test_when_finished rm -rf blocks ssd &&
+	assert_success gob init ssd &&
+	assert_success gob init --cache ../ssd blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success rm ssd/d6/d45901dec53e65d2b55fb6e2ab67b0 &&
+	assert_success gob catalog rebuild ssd &&
+	assert_success gob cat --metrics metrics blocks <index >output &&
+	assert_equal output input &&
+	assert_success "grep -q \"^gob_cache_misses_total{command=.cat.} 1$\" metrics" &&
+	assert_success test -f ssd/d6/d45901dec53e65d2b55fb6e2ab67b0 &&
+	assert_success rm blocks/d6/d45901dec53e65d2b55fb6e2ab67b0 &&
+	assert_success gob cat --metrics metrics blocks <index >output &&
+	assert_equal output input &&
+	assert_success "grep -q \"^gob_cache_hits_total{command=.cat.} 1$\" metrics"
+'
+
+test_expect_success 'tiered store replaces corrupt cached blocks' '
+	test_when_finished rm -rf blocks ssd &&
+	assert_success gob init ssd &&
+	assert_success gob init --cache ../ssd blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success "echo foobaz >ssd/d6/d45901dec53e65d2b55fb6e2ab67b0" &&
+	assert_success gob cat --metrics metrics blocks <index >output &&
+	assert_equal output input &&
+	assert_success "grep -q \"^gob_cache_misses_total{command=.cat.} 1$\" metrics" &&
+	assert_equal ssd/d6/d45901dec53e65d2b55fb6e2ab67b0 input
+'
+
+test_expect_success 'tiered store evicts least recently used blocks' '
+	test_when_finished rm -rf blocks ssd &&
+	assert_success gob init ssd &&
+	assert_success gob init --cache ../ssd --cache-size 5M blocks &&
+	assert_success "dd if=/dev/urandom bs=1048576 count=9 >input" &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success "test \"$(ls blocks/*/* | wc -l)\" -eq 3" &&
+	assert_success "test \"$(ls ssd/*/* | wc -l)\" -eq 2" &&
+	assert_failure "test -e ssd/$(sed -n 1p index | cut -c1-2)/$(sed -n 1p index | cut -c3-)" &&
+	assert_success gob catalog check ssd &&
+	assert_success "test -f ssd/$(sed -n 3p index | cut -c1-2)/$(sed -n 3p index | cut -c3-)" &&
+	assert_success gob cat blocks <index >output &&
+	assert_equal output input
+'
+
+test_expect_success 'tiered store without cache store can be used' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init --cache ../missing blocks &&
+	assert_success echo foobar >input &&
+	assert_success gob chunk blocks <input >index &&
+	assert_success gob cat blocks <index >output &&
+	assert_equal output input
+'
+
+test_expect_success 'chunking into multiple stores' '
+	test_when_finished rm -rf blocks mirror &&
+	assert_success gob init blocks &&
+	assert_success gob init mirror &&
+	assert_success echo foobar >input &&
+	assert_success "gob chunk blocks mirror <input >index" &&
+	assert_success test -f blocks/d6/d45901dec53e65d2b55fb6e2ab67b0 &&
+	assert_success test -f mirror/d6/d45901dec53e65d2b55fb6e2ab67b0 &&
+	assert_success "gob cat blocks <index >output" &&
+	assert_equal output input &&
+	assert_success "gob cat mirror <index >output" &&
+	assert_equal output input
+'
+
+test_expect_success 'chunking drops failing optional store' '
+	test_when_finished rm -rf blocks mirror &&
+	assert_success gob init blocks &&
+	assert_success gob init mirror &&
+	assert_success touch mirror/d6 &&
+	assert_success echo foobar >input &&
+	assert_success "gob chunk --optional mirror blocks <input >index 2>stderr" &&
+	assert_success "grep -q \"not valid for store .mirror.\" stderr" &&
+	assert_success "gob cat blocks <index >output" &&
+	assert_equal output input
+'
+
+test_expect_success 'chunking fails with failing required store' '
+	test_when_finished rm -rf blocks mirror &&
+	assert_success gob init blocks &&
+	assert_success gob init mirror &&
+	assert_success touch mirror/d6 &&
+	assert_success echo foobar >input &&
+	assert_failure "gob chunk blocks mirror <input >index"
+'
+
+test_expect_success 'chunking with reflinks roundtrips' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init blocks &&
+	assert_success "(yes a | head -c 4194304; yes b | head -c 4194304; yes c | head -c 1048576) >input" &&
+	assert_success "gob chunk --reflink blocks <input >index" &&
+	assert_success "gob cat blocks <index >output" &&
+	assert_equal output input &&
+	assert_success gob fsck blocks &&
+	assert_success "cat input | gob chunk --reflink blocks >expected" &&
+	assert_equal index expected
+'
+
+test_expect_success 'ordered cat restores into seekable output' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init blocks &&
+	assert_success "(yes a | head -c 4194304; yes b | head -c 4194304; yes a | head -c 4194304; yes c | head -c 1000) >input" &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success "gob cat --ordered --verbose blocks <index >output 2>stats" &&
+	assert_equal output input &&
+	assert_success "grep -q \"^3 unique blocks read for 4 blocks$\" stats" &&
+	assert_success rm -f restored &&
+	assert_success "gob cat --ordered --target restored --jobs 2 blocks <index" &&
+	assert_equal restored input
+'
+
+test_expect_success 'ordered cat fails with unseekable output' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init blocks &&
+	assert_success echo foobar >input &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success "{ gob cat --ordered blocks <index; echo \$? >status; } | cat" &&
+	assert_failure "grep -q \"^0$\" status"
+'
+
+test_expect_success 'ordered cat fails with appending output' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init blocks &&
+	assert_success echo foobar >input &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success echo foobar >output &&
+	assert_failure "gob cat --ordered blocks <index >>output"
+'
+
+test_expect_success 'ordered cat verifies overall hash' '
+	test_when_finished rm -rf blocks restored &&
+	assert_success gob init blocks &&
+	assert_success echo foobar >input &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success "sed \"s/^>[0-9a-f]*/>00000000000000000000000000000000/\" index >tampered" &&
+	assert_failure "gob cat --ordered blocks <tampered >output" &&
+	assert_failure "gob cat --ordered --target restored blocks <tampered"
+'
+
+test_expect_success 'repack moves blocks into pack' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init blocks &&
+	assert_success "(yes a | head -c 4194304; yes b | head -c 4194304; yes a | head -c 4194304; yes c | head -c 1000) >input" &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success gob repack blocks index &&
+	assert_success test -f blocks/packs/00000001.idx &&
+	assert_success test -f blocks/packs/00000001.pack &&
+	assert_success "test \"$(find blocks -path blocks/packs -prune -o -type f -path blocks/\?\?/\* -print | wc -l)\" -eq 0" &&
+	assert_success "gob cat blocks <index >output" &&
+	assert_equal output input &&
+	assert_success "gob cat --ordered blocks <index >output" &&
+	assert_equal output input &&
+	assert_success gob fsck blocks &&
+	assert_success gob catalog check blocks &&
+	assert_success "gob chunk blocks <input >expected" &&
+	assert_equal index expected &&
+	assert_success "test \"$(find blocks -path blocks/packs -prune -o -type f -path blocks/\?\?/\* -print | wc -l)\" -eq 0"
+'
+
+test_expect_success 'repack supersedes older packs' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init blocks &&
+	assert_success echo foobar >input &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success "echo barfoo | gob chunk blocks >other" &&
+	assert_success gob repack blocks index &&
+	assert_success gob repack blocks other index &&
+	assert_failure test -e blocks/packs/00000001.idx &&
+	assert_success test -f blocks/packs/00000002.idx &&
+	assert_success gob catalog check blocks &&
+	assert_success "gob cat blocks <index >output" &&
+	assert_equal output input
+'
+
+test_expect_success 'fsck detects corrupt packed block' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init blocks &&
+	assert_success echo foobar >input &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success gob repack blocks index &&
+	assert_success "printf x | dd of=blocks/packs/00000001.pack conv=notrunc 2>/dev/null" &&
+	assert_failure gob fsck blocks
+'
+
+test_expect_success 'similar blocks are stored as delta' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init --delta-depth 1 blocks &&
+	assert_success "seq 1 500000 >input" &&
+	assert_success "sed s/^250000$/x/ input >similar" &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success "gob chunk blocks <similar >other" &&
+	assert_success "find blocks -name \"*.delta\" -size -100c >deltas" &&
+	assert_success test -s deltas &&
+	assert_success "gob cat blocks <other >output" &&
+	assert_equal output similar &&
+	assert_success gob catalog check blocks &&
+	assert_success gob fsck blocks
+'
+
+test_expect_success 'delta with corrupt base fails to restore' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init --delta-depth 1 blocks &&
+	assert_success "seq 1 500000 >input" &&
+	assert_success "sed s/^250000$/x/ input >similar" &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success "gob chunk blocks <similar >other" &&
+	assert_success "printf x | dd of=blocks/a1/4392856ac97d782931f7655ba2f4b9 conv=notrunc 2>/dev/null" &&
+	assert_failure "gob cat blocks <other >output" &&
+	assert_failure gob fsck blocks
+'
+
+test_expect_success 'verify with full hashing reports delta with corrupt base' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init --delta-depth 1 blocks &&
+	assert_success "seq 1 500000 >input" &&
+	assert_success "sed s/^250000$/x/ input >similar" &&
+	assert_success "gob chunk blocks <input >index" &&
+	assert_success "gob chunk blocks <similar >other" &&
+	assert_success "printf x | dd of=blocks/a1/4392856ac97d782931f7655ba2f4b9 conv=notrunc 2>/dev/null" &&
+	assert_failure "gob verify --full --verbose blocks other 2>stderr" &&
+	assert_success "grep -q \"Unable to read block\" stderr" &&
+	assert_success "grep -q \"blocks checked\" stderr"
+'
+
+test_expect_success 'init refuses memory backend' '
+	test_when_finished rm -rf blocks &&
+	assert_failure gob init --backend memory blocks &&
+	assert_failure test -e blocks/config
+'
+
+test_expect_success 'parallel chunking produces identical index' '
+	test_when_finished rm -rf blocks parallel &&
+	assert_success gob init blocks &&
+	assert_success gob init parallel &&
+	assert_success "(yes a | head -c 4194304; yes b | head -c 4194304; yes c | head -c 1048576) >input" &&
+	assert_success "gob chunk blocks <input >expected" &&
+	assert_success "gob chunk --input input --jobs 4 parallel >index" &&
+	assert_equal index expected &&
+	assert_success "gob cat parallel <index >output" &&
+	assert_equal output input
+'
+
+test_expect_success 'parallel chunking requires input file' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init blocks &&
+	assert_success echo foobar >input &&
+	assert_failure "gob chunk --jobs 4 blocks <input >index"
+'
+
+test_expect_success 'parallel chunking drops failing optional store' '
+	test_when_finished rm -rf blocks mirror &&
+	assert_success gob init blocks &&
+	assert_success gob init mirror &&
+	assert_success touch mirror/d6 &&
+	assert_success echo foobar >input &&
+	assert_success "gob chunk --input input --jobs 2 --optional mirror blocks >index 2>stderr" &&
+	assert_success "grep -q \"not valid for store .mirror.\" stderr" &&
+	assert_success "gob cat blocks <index >output" &&
+	assert_equal output input
+'
+
+test_expect_success 'chunk and cat write traces' '
+	test_when_finished rm -rf blocks &&
+	assert_success gob init blocks &&
+	assert_success echo foobar >input &&
+	assert_success "gob chunk --trace chunk-trace blocks <input >index" &&
+	assert_success grep -q "rename.*d6d45901dec53e65d2b55fb6e2ab67b0" chunk-trace &&
+	assert_success "gob cat --trace cat-trace blocks <index >output" &&
+	assert_success grep -q store-read cat-trace &&
+	assert_success "tail -n 1 cat-trace >last" &&
+	assert_success "echo ] >expected" &&
+	assert_equal last expected
+'
+
 echo "1..$TEST_NUM"
 
 rm -rf "$TEST_DIR"